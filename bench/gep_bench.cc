@@ -0,0 +1,424 @@
+// Copyright Google Inc. Apache 2.0.
+
+// GEP transport benchmark: measures the round trip latency and the
+// one-way throughput of a GEP client/server pair running in the same
+// process, over each of the supported local transports, and the CPU time
+// (of both sides) per GB sent. It also measures the size and the cost of
+// the frame headers.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#ifdef __cplusplus
+#define __STDC_FORMAT_MACROS
+#endif
+
+
+#include <algorithm>  // for max, sort
+#include <atomic>
+#include <getopt.h>
+#include <gep_channel.h>  // for GepChannel
+#include <gep_client.h>  // for GepClient
+#include <gep_common.h>  // for GepProtobufMessage
+#include <gep_protocol.h>  // for MakeTag, GepProtocol
+#include <gep_server.h>  // for GepServer
+#include <gep_utils.h>  // for RecvMessage, RecvMessageId
+#include <inttypes.h>  // for PRId64
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>  // for atoi
+#include <string>
+#include <sys/resource.h>  // for getrusage
+#include <thread>
+#include <unistd.h>  // for getpid
+#include <vector>
+
+#include "bench.pb.h"  // for Payload
+#include "utils.h"  // for GetMonotonicTimeUsec, GetUnixTimeUsec, etc
+
+using namespace libgep_utils;
+
+// benchmark protocol
+class BenchProtocol : public GepProtocol {
+ public:
+  BenchProtocol() : GepProtocol(0) {}
+  virtual ~BenchProtocol() {}
+
+  static constexpr uint32_t MSG_TAG_PAYLOAD = MakeTag('p', 'l', 'o', 'd');
+
+  virtual uint32_t GetTag(const GepProtobufMessage *msg) {
+    if (dynamic_cast<const Payload *>(msg) != nullptr)
+      return MSG_TAG_PAYLOAD;
+    return 0;
+  }
+  virtual GepProtobufMessage *GetMessage(uint32_t tag) {
+    if (tag == MSG_TAG_PAYLOAD)
+      return new Payload();
+    return nullptr;
+  }
+};
+
+constexpr uint32_t BenchProtocol::MSG_TAG_PAYLOAD;
+
+// latency bound of the coalescing transports
+const int64_t kCoalesceDelayUsec = 100;
+// tags in the tables of the compact headers
+const int kNumHeaderTags = 32;
+
+// transport settings of a benchmark run
+struct Transport {
+  const char *name;
+  std::string unix_path;
+  int shm_ring_bytes;
+  int inproc_ring_bytes;
+  bool pass_objects;
+  int memfd_threshold;
+  int max_msg_size;
+  int zerocopy_threshold;
+  bool compact_header;
+  int coalesce_bytes;
+  int min_size;  // minimum payload size (whatever -s is)
+};
+
+// Class running a benchmark: It is the context of both the server and
+// the client callbacks.
+class Bench {
+ public:
+  explicit Bench(const Transport &transport);
+  ~Bench();
+
+  int Start();
+  void Stop();
+
+  // protocol callbacks
+  // server side: echo or count
+  bool Recv(const Payload &msg, int id);
+  // client side: record the round trip time
+  bool Recv(const Payload &msg);
+
+  // sends num_msgs messages of size bytes, one at a time, and waits for
+  // each one to come back. Fills rtts with the round trip times (usecs)
+  int RunLatency(int num_msgs, int size, std::vector<int64_t> *rtts);
+  // sends num_msgs messages of size bytes, and waits for all of them to
+  // reach the server. Returns the elapsed time (usecs)
+  int64_t RunThroughput(int num_msgs, int size);
+
+ private:
+  // maximum messages sent and not received yet in the throughput test
+  static const int kMaxInFlight = 64;
+
+  static const GepVFT kServerOps;
+  static const GepVFT kClientOps;
+
+  // owned by server_ and client_
+  BenchProtocol *sproto_;
+  BenchProtocol *cproto_;
+  GepServer *server_;
+  GepClient *client_;
+
+  std::atomic<int64_t> server_count_;
+  std::atomic<int64_t> client_count_;
+  std::atomic<int64_t> last_rtt_;
+};
+
+const GepVFT Bench::kServerOps = {
+  {BenchProtocol::MSG_TAG_PAYLOAD, &RecvMessageId<Bench, Payload>},
+};
+
+const GepVFT Bench::kClientOps = {
+  {BenchProtocol::MSG_TAG_PAYLOAD, &RecvMessage<Bench, Payload>},
+};
+
+Bench::Bench(const Transport &transport)
+    : sproto_(new BenchProtocol()),
+      cproto_(new BenchProtocol()),
+      server_count_(0),
+      client_count_(0),
+      last_rtt_(0) {
+  for (BenchProtocol *proto : {sproto_, cproto_}) {
+    proto->SetUnixPath(transport.unix_path);
+    proto->SetSharedMemory(transport.shm_ring_bytes);
+    proto->SetInProcess(transport.inproc_ring_bytes, transport.pass_objects);
+    proto->SetMemfdThreshold(transport.memfd_threshold);
+    proto->SetMaxMessageSize(transport.max_msg_size);
+    proto->SetZeroCopyThreshold(transport.zerocopy_threshold);
+    proto->SetCompactHeader(transport.compact_header);
+    proto->SetCoalescing(transport.coalesce_bytes, kCoalesceDelayUsec);
+    // measure the transports, not the text encoding
+    proto->SetMode(GepProtocol::MODE_BINARY);
+  }
+  server_ = new GepServer("bench_server", 1, reinterpret_cast<void *>(this),
+                          sproto_, &kServerOps);
+  client_ = new GepClient("bench_client", reinterpret_cast<void *>(this),
+                          cproto_, &kClientOps);
+}
+
+Bench::~Bench() {
+  delete client_;
+  delete server_;
+}
+
+int Bench::Start() {
+  if (server_->Start() < 0)
+    return -1;
+  cproto_->SetPort(sproto_->GetPort());
+  if (client_->Start() < 0) {
+    server_->Stop();
+    return -1;
+  }
+  // wait for the server to see the client (and for the shared memory
+  // negotiation)
+  bool rings = cproto_->GetShmRingBytes() > 0 ||
+      cproto_->GetInProcessRingBytes() > 0;
+  int64_t max_usec = GetUnixTimeUsec() + secs_to_usecs(5);
+  while (server_->GetNumClients() == 0 ||
+         (rings && !client_->GetGepChannel()->IsSharedMemory())) {
+    if (GetUnixTimeUsec() > max_usec) {
+      Stop();
+      return -1;
+    }
+    std::this_thread::yield();
+  }
+  return 0;
+}
+
+void Bench::Stop() {
+  client_->Stop();
+  server_->Stop();
+}
+
+bool Bench::Recv(const Payload &msg, int id) {
+  if (msg.echo())
+    return server_->Send(msg, id) == 0;
+  server_count_++;
+  return true;
+}
+
+bool Bench::Recv(const Payload &msg) {
+  last_rtt_ = GetUnixTimeUsec() - msg.send_usec();
+  client_count_++;
+  return true;
+}
+
+int Bench::RunLatency(int num_msgs, int size, std::vector<int64_t> *rtts) {
+  Payload msg;
+  msg.set_echo(true);
+  msg.set_data(std::string(size, 'x'));
+  rtts->clear();
+  for (int i = 0; i < num_msgs; ++i) {
+    int64_t expected = client_count_ + 1;
+    msg.set_id(i);
+    msg.set_send_usec(GetUnixTimeUsec());
+    if (client_->Send(msg) < 0)
+      return -1;
+    int64_t max_usec = GetUnixTimeUsec() + secs_to_usecs(5);
+    while (client_count_ < expected) {
+      if (GetUnixTimeUsec() > max_usec)
+        return -1;
+      std::this_thread::yield();
+    }
+    rtts->push_back(last_rtt_);
+  }
+  return 0;
+}
+
+int64_t Bench::RunThroughput(int num_msgs, int size) {
+  Payload msg;
+  msg.set_echo(false);
+  msg.set_data(std::string(size, 'x'));
+  int64_t base = server_count_;
+  int64_t expected = base + num_msgs;
+  int64_t start_usec = GetUnixTimeUsec();
+  int64_t max_usec = start_usec + secs_to_usecs(30);
+  for (int i = 0; i < num_msgs; ++i) {
+    // GEP sends time out quickly: keep the messages in flight bounded
+    while (i - (server_count_ - base) >= kMaxInFlight) {
+      if (GetUnixTimeUsec() > max_usec)
+        return -1;
+      std::this_thread::yield();
+    }
+    msg.set_id(i);
+    if (client_->Send(msg) < 0)
+      return -1;
+  }
+  while (server_count_ < expected) {
+    if (GetUnixTimeUsec() > max_usec)
+      return -1;
+    std::this_thread::yield();
+  }
+  return GetUnixTimeUsec() - start_usec;
+}
+
+// returns the CPU time used by the process (usecs)
+static int64_t GetCpuUsec() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+      usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// prints and scans num_hdrs frame headers of each format, and reports
+// their length and the time per header
+static void RunHeaders(int num_hdrs, int size) {
+  BenchProtocol proto;
+  // the tag tables of the compact headers, as GepChannel keeps them: the
+  // index of each tag in the table of the peer (sender), and the table
+  // (receiver), with the tags of a mid-sized protocol
+  std::map<uint32_t, int> send_tag_index;
+  std::vector<uint32_t> recv_tags;
+  for (int i = 0; i < kNumHeaderTags; ++i) {
+    uint32_t tag = i == 0 ? BenchProtocol::MSG_TAG_PAYLOAD :
+        MakeTag('t', 'a', 'g', i);
+    send_tag_index[tag] = 0;
+  }
+  for (auto &entry : send_tag_index) {
+    entry.second = recv_tags.size();
+    recv_tags.push_back(entry.first);
+  }
+  // (compact headers are shorter)
+  uint8_t buf[GepProtocol::GetHdrLen()];
+  // (accumulate the results so the loops are not optimized out)
+  uint64_t sum = 0;
+  // each loop runs the per-frame path of GepChannel: the sender prints
+  // the header, and the receiver scans it
+  int64_t start_usec = GetMonotonicTimeUsec();
+  for (int i = 0; i < num_hdrs; ++i) {
+    uint32_t tag;
+    uint32_t value_len;
+    proto.PrintHeader(BenchProtocol::MSG_TAG_PAYLOAD, size + (i & 1), buf);
+    if (proto.ScanHeader(buf, &tag, &value_len))
+      sum += value_len;
+  }
+  int64_t v1_usec = GetMonotonicTimeUsec() - start_usec;
+  int v2_len = 0;
+  start_usec = GetMonotonicTimeUsec();
+  for (int i = 0; i < num_hdrs; ++i) {
+    auto it = send_tag_index.find(BenchProtocol::MSG_TAG_PAYLOAD);
+    v2_len = GepProtocol::PrintCompactHeader(
+        BenchProtocol::MSG_TAG_PAYLOAD,
+        it != send_tag_index.end() ? it->second : -1, size + (i & 1), buf);
+    bool full_tag;
+    uint32_t tag;
+    uint32_t value_len;
+    if (GepProtocol::ScanCompactHeader(buf, v2_len, &full_tag, &tag,
+                                       &value_len) > 0) {
+      if (!full_tag && tag < recv_tags.size())
+        tag = recv_tags[tag];
+      sum += value_len + tag;
+    }
+  }
+  int64_t v2_usec = GetMonotonicTimeUsec() - start_usec;
+  if (sum == 0)
+    return;
+  printf("%-10s %10s %10s\n", "header", "bytes", "ns/header");
+  printf("%-10s %10d %10.1f\n", "v1", (int)proto.GetHdrLen(),
+         v1_usec * 1e3 / num_hdrs);
+  printf("%-10s %10d %10.1f\n\n", "v2", v2_len, v2_usec * 1e3 / num_hdrs);
+}
+
+
+// default values
+#define DEFAULT_NUM_MSGS 10000
+#define DEFAULT_SIZE 64
+
+const int kShmRingBytes = 1024 * 1024;
+const int kMemfdThreshold = 64 * 1024;
+const int kMaxMessageSize = 64 * 1024 * 1024;
+const int kZeroCopyThreshold = 64 * 1024;
+const int kCoalesceBytes = 64 * 1024;
+
+
+void usage(char *name) {
+  fprintf(stderr, "usage: %s [options]\n", name);
+  fprintf(stderr, "where options are:\n");
+  fprintf(stderr, "\t-n <num>:\tSend <num> messages per test [%i]\n",
+          DEFAULT_NUM_MSGS);
+  fprintf(stderr, "\t-s <size>:\tUse <size>-byte payloads [%i]\n",
+          DEFAULT_SIZE);
+  fprintf(stderr, "\t-h:\t\tHelp\n");
+}
+
+int main(int argc, char **argv) {
+  int num_msgs = DEFAULT_NUM_MSGS;
+  int size = DEFAULT_SIZE;
+  int c;
+  while ((c = getopt(argc, argv, "n:s:h")) != -1) {
+    switch (c) {
+      case 'n':
+        num_msgs = atoi(optarg);
+        break;
+      case 's':
+        size = atoi(optarg);
+        break;
+      case 'h':
+      default:
+        usage(argv[0]);
+        return c == 'h' ? 0 : -1;
+    }
+  }
+  if (num_msgs <= 0 || size < 0) {
+    usage(argv[0]);
+    return -1;
+  }
+
+  gep_log_set_level(LOG_ERROR);
+
+  RunHeaders(num_msgs * 100, size);
+
+  std::string suffix = "gep_bench." + std::to_string(getpid());
+  const Transport transports[] = {
+    {"tcp", "", 0, 0, false, 0, 0, 0, false, 0, 0},
+    {"tcp-v2", "", 0, 0, false, 0, 0, 0, true, 0, 0},
+    {"tcp-coal", "", 0, 0, false, 0, 0, 0, false, kCoalesceBytes, 0},
+    // (zero-copy only applies to the payloads over its threshold, so both
+    // rows use such payloads)
+    {"tcp-64k", "", 0, 0, false, 0, 0, 0, false, 0, kZeroCopyThreshold},
+    {"tcp-zc", "", 0, 0, false, 0, 0, kZeroCopyThreshold, false, 0,
+     kZeroCopyThreshold},
+    {"chunked", "", 0, 0, false, 0, kMaxMessageSize, 0, false, 0, 0},
+    {"unix", "/tmp/" + suffix, 0, 0, false, 0, 0, 0, false, 0, 0},
+    {"abstract", "@" + suffix, 0, 0, false, 0, 0, 0, false, 0, 0},
+    {"memfd", "@" + suffix, 0, 0, false, kMemfdThreshold, 0, 0, false, 0, 0},
+    {"shm", "", kShmRingBytes, 0, false, 0, 0, 0, false, 0, 0},
+    {"inproc", "", 0, kShmRingBytes, false, 0, 0, 0, false, 0, 0},
+    {"inproc-obj", "", 0, kShmRingBytes, true, 0, 0, 0, false, 0, 0},
+  };
+
+  printf("%-10s %10s %10s %10s %12s %10s %10s\n", "transport", "rtt_avg_us",
+         "rtt_p50_us", "rtt_p99_us", "msgs/s", "MB/s", "cpu_ms/GB");
+  for (const auto &transport : transports) {
+    Bench bench(transport);
+    if (bench.Start() < 0) {
+      fprintf(stderr, "%s: cannot start\n", transport.name);
+      continue;
+    }
+    int msg_size = std::max(size, transport.min_size);
+    std::vector<int64_t> rtts;
+    int ret = bench.RunLatency(num_msgs, msg_size, &rtts);
+    int64_t cpu_usec = GetCpuUsec();
+    int64_t elapsed_usec = bench.RunThroughput(num_msgs, msg_size);
+    cpu_usec = GetCpuUsec() - cpu_usec;
+    bench.Stop();
+    // (some transports cannot carry messages larger than kMaxMsgLen)
+    if (ret < 0 || elapsed_usec < 0) {
+      fprintf(stderr, "%s: benchmark failed\n", transport.name);
+      continue;
+    }
+
+    std::sort(rtts.begin(), rtts.end());
+    int64_t total = 0;
+    for (int64_t rtt : rtts)
+      total += rtt;
+    double secs = elapsed_usec / 1e6;
+    double bytes = static_cast<double>(num_msgs) * msg_size;
+    printf("%-10s %10.1f %10" PRId64 " %10" PRId64 " %12.0f %10.1f %10.1f\n",
+           transport.name, static_cast<double>(total) / rtts.size(),
+           rtts[rtts.size() / 2], rtts[(rtts.size() * 99) / 100],
+           num_msgs / secs, bytes / secs / 1e6,
+           bytes > 0 ? cpu_usec / 1e3 / (bytes / 1e9) : 0.0);
+  }
+
+  google::protobuf::ShutdownProtobufLibrary();
+  return 0;
+}
@@ -5,15 +5,115 @@
 #ifndef _GEP_CHANNEL_H_
 #define _GEP_CHANNEL_H_
 
+#include <atomic>  // for atomic
+#include <condition_variable>  // for condition_variable
+#include <deque>  // for deque
+#include <functional>  // for function
+#include <map>  // for map
+#include <memory>  // for unique_ptr
 #include <mutex>
+#include <set>  // for set
 #include <stdint.h>  // for uint32_t, uint8_t
 #include <string>  // for string
+#include <utility>  // for pair
+#include <vector>  // for vector
 
 #include "gep_common.h"  // for GepProtobufMessage
 #include "gep_protocol.h"  // for GepProtocol (ptr only), etc
 
+class GepChannel;
+class ShmTransport;
 class SocketInterface;
 
+// Callback used for the GEP control messages that the channel does not
+// handle itself. Returns true if the message was handled.
+typedef std::function<bool(GepChannel *channel, uint32_t tag,
+                           const std::string &value)> GepControlCallback;
+
+// Callback used to shed the incoming messages (before unpacking them),
+// given their tag and GepVFT priority. Returns true if the message must
+// be dropped.
+typedef std::function<bool(uint32_t tag, int priority)> GepShedCallback;
+
+// Slow-consumer policy: A peer that stops reading fills its socket send
+// buffer, and from then on every send to it blocks for the full send
+// timeout. A channel is considered slow once any of the (non-zero)
+// thresholds is exceeded, and the owner of the channel applies the action.
+struct GepSlowConsumerPolicy {
+  enum Action {
+    ACTION_NONE = 0,  // only report the slow channel
+    ACTION_DROP = 1,  // drop the messages to the slow channel
+    ACTION_CONFLATE = 2,  // keep only the latest message per tag, and send
+                          // them once the channel recovers
+    ACTION_DISCONNECT = 3,  // close the connection
+    ACTION_BACKGROUND = 4  // send from a background thread
+  };
+
+  GepSlowConsumerPolicy()
+      : max_queued_bytes(0),
+        max_send_timeouts(0),
+        max_send_latency_usec(0),
+        action(ACTION_NONE) {}
+
+  bool IsEnabled() const {
+    return max_queued_bytes > 0 || max_send_timeouts > 0 ||
+        max_send_latency_usec > 0;
+  }
+
+  int max_queued_bytes;  // bytes waiting in the socket send queue
+  int max_send_timeouts;  // consecutive timed out sends
+  int64_t max_send_latency_usec;  // duration of a single send
+  Action action;
+};
+
+// Inbound rate limit: A token bucket for the messages and another for the
+// bytes received, refilled at the given rates, and holding up to one
+// second of traffic. Zero rates are not limited.
+struct GepRateLimit {
+  GepRateLimit() : max_msgs_per_sec(0), max_bytes_per_sec(0) {}
+  GepRateLimit(double msgs_per_sec, double bytes_per_sec)
+      : max_msgs_per_sec(msgs_per_sec), max_bytes_per_sec(bytes_per_sec) {}
+
+  bool IsEnabled() const {
+    return max_msgs_per_sec > 0 || max_bytes_per_sec > 0;
+  }
+
+  double max_msgs_per_sec;
+  double max_bytes_per_sec;
+};
+
+// Inbound rate-limiting policy: A peer that floods the channel would keep
+// the receiving thread busy with its messages. Every message must fit in
+// the channel limit, and in the limit of its tag (if any). GEP control
+// messages are not limited (but delta-encoded ones count as their tag,
+// and the messages of a batch count one by one). Datagrams over the limits
+// are dropped, whatever the action.
+struct GepRateLimitPolicy {
+  enum Action {
+    ACTION_PAUSE = 0,  // stop reading from the socket until there are
+                       // tokens again (so TCP pushes back on the peer)
+    ACTION_DROP = 1,  // drop the messages over the limits
+    ACTION_DISCONNECT = 2  // close the connection
+  };
+
+  GepRateLimitPolicy() : action(ACTION_PAUSE) {}
+
+  bool IsEnabled() const { return channel.IsEnabled() || !tags.empty(); }
+
+  GepRateLimit channel;  // all the messages
+  std::map<uint32_t, GepRateLimit> tags;  // per-tag limits
+  Action action;
+};
+
+// Counters of the datagrams of a channel (see GepProtocol::SetDatagramTag()).
+struct GepDatagramStats {
+  GepDatagramStats() : sent(0), received(0), lost(0), reordered(0) {}
+  int64_t sent;
+  int64_t received;
+  int64_t lost;  // missing sequence numbers
+  int64_t reordered;  // received after a later one
+};
+
 
 // Class used to manage a communication channel where protobuf messages can
 // be sent back and forth.
@@ -26,7 +126,10 @@ class GepChannel {
   // Process received event data: execute any commands and remove completed
   // commands from the recv buffer.
   // Any leftover data is moved to beginning of the buffer. If the host data
-  // contains several commands, all of them are processed.
+  // contains several commands, all of them are processed, in decreasing
+  // order of their GepVFT priority (and in arrival order for the same
+  // priority). Commands whose GepVFT entry names an executor are posted
+  // to it instead of running in the caller thread.
   // Returns 0 for success, -1 on a fatal error, and -2 if the connection was
   // closed.
   int RecvData();
@@ -35,9 +138,170 @@ class GepChannel {
   // Returns status value (0 if ok, -1 for error)
   virtual int SendMessage(const GepProtobufMessage &msg);
 
+  // Send an already-serialized message (or a GEP control message) with
+  // the given tag.
+  // Returns status value (0 if ok, -1 for error)
+  int SendString(uint32_t tag, const std::string &s);
+  // Same as SendString(), for a serialized message that the channel can
+  // keep until the kernel is done sending it (see
+  // GepProtocol::SetZeroCopyThreshold()).
+  int SendBuffer(uint32_t tag, const std::shared_ptr<const std::string> &s);
+
+  // Send messages in as few batch frames as possible (up to kChunkBytes
+  // each), taking the socket lock and writing a header once per frame.
+  // Receivers dispatch the messages of a batch in order, but those of the
+  // tags with a batch callback (see GepVFTEntry::Batch()), which get all
+  // the messages of their tag at once. Load shedding and the inbound rate
+  // limits of the receiver apply to each message. Batched messages skip
+  // conflation, delta encoding, datagrams, and in-process objects.
+  // Returns status value (0 if ok, -1 for error)
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs);
+  // Same for already-serialized messages (tag and value).
+  int SendBatch(const std::vector<std::pair<uint32_t, std::string>> &values);
+
+  // Send coalescing (see GepProtocol::SetCoalescing()): Writes the
+  // buffered frames to the socket.
+  // Returns status value (0 if ok, -1 for error)
+  int Flush();
+  // Same, only if the oldest buffered frame has waited long enough (the
+  // service threads call it).
+  int FlushCoalesced();
+
+  // Send a message of a delta-encoded tag (see GepProtocol::SetDelta()),
+  // as the fields that changed from the last message sent with the same
+  // (tag, key). s is the serialized msg, used for keyframes.
+  // Returns status value (0 if ok, -1 for error)
+  int SendDelta(uint32_t tag, const std::string &key,
+                const GepProtobufMessage &msg, const std::string &s);
+
+  // Send a copy of the message object itself to an in-process peer (see
+  // GepProtocol::SetInProcess()).
+  // Returns status value (0 if ok, -1 for error, 1 if the message has to
+  // be serialized instead: no in-process peer, or no free object slots)
+  int SendObject(uint32_t tag, const GepProtobufMessage &msg);
+
+  // Tag interest: Each side can advertise the tags it handles (the keys
+  // of its GepVFT), so that the other side does not send messages that
+  // would be dropped on reception. Client channels advertise their tags
+  // when connecting.
+  // Returns status value (0 if ok, -1 for error)
+  int SendInterest();
+  // Returns whether the peer handles the given tag. Peers that have not
+  // advertised their tags are assumed to handle all of them.
+  bool IsInterested(uint32_t tag);
+
+  // Slow-consumer detection: After each send, the channel checks the
+  // policy thresholds, and marks itself as slow if any is exceeded.
+  void SetSlowConsumerPolicy(const GepSlowConsumerPolicy &policy);
+  bool IsSlow() const { return slow_; }
+  // Re-checks a slow channel, which recovers once its send queue drains
+  // (below half of max_queued_bytes, or completely if not set).
+  // Returns whether the channel is still slow.
+  bool CheckSlow();
+  // Returns the number of bytes in the socket send queue (or in the
+  // shared memory ring) (-1 for error).
+  int GetQueuedBytes();
+
+  // Inbound rate limiting: Messages over the policy limits are kept in the
+  // recv buffer (and the socket is not read until they can be processed),
+  // dropped, or make RecvData() fail, depending on the policy action.
+  void SetRateLimitPolicy(const GepRateLimitPolicy &policy);
+  // Returns the usecs until a paused channel can be resumed (0 if it is
+  // not paused, or can be resumed already).
+  int64_t GetRecvPausedUsec();
+  bool IsRecvPaused() const { return recv_paused_until_usec_ > 0; }
+  // Processes the messages kept in the recv buffer of a paused channel
+  // once they fit in the limits, and resumes reading.
+  // Returns status value (0 if ok, -1 on a fatal error)
+  int ResumeRecv();
+  // Returns the number of messages found over the limits.
+  int64_t GetNumRateLimited() const { return rate_limited_; }
+
+  // Shared memory transport (see GepProtocol::SetSharedMemory()): Returns
+  // whether the channel sends and receives through the shared memory rings
+  // (or the in-process ones).
+  bool IsSharedMemory();
+  // In-process transport (see GepProtocol::SetInProcess()): Returns whether
+  // the channel sends and receives through the in-process rings.
+  bool IsInProcess();
+  // Compact headers (see GepProtocol::SetCompactHeader()): Returns whether
+  // the channel sends compact headers.
+  bool IsCompactHeader();
+
+  // Sessions (see GepClient::AddSession()): A session channel carries a
+  // logical client over the connection of its parent channel, with its own
+  // id, context, and GepVFT. It sends its frames through the parent, which
+  // hands the incoming ones to the session channel registered for their
+  // session id. Sessions share the flow control, rate limits, and
+  // slow-consumer state of their connection, and do not use memfds,
+  // zero-copy sends, or object passing. Their conflated messages are
+  // written when their parent flushes its own.
+  void SetParent(const std::shared_ptr<GepChannel> &parent, uint32_t session);
+  const std::shared_ptr<GepChannel> &GetParent() const { return parent_; }
+  bool IsSession() const { return parent_ != nullptr; }
+  uint32_t GetSessionId() const { return session_id_; }
+  // (un)registers the channel of a session in its parent
+  void AddSession(uint32_t session, const std::shared_ptr<GepChannel> &channel);
+  void DelSession(uint32_t session);
+  // returns the channel of a session (nullptr if none), or all of them
+  std::shared_ptr<GepChannel> GetSession(uint32_t session);
+  std::vector<std::shared_ptr<GepChannel>> GetSessions();
+
+  // Datagrams (see GepProtocol::SetDatagramTag()): Sets the UDP socket
+  // (not owned) and the peer address used to send the datagram tags.
+  // Client channels open (and own) their UDP socket when connecting.
+  void SetDatagramPeer(int socket, const struct sockaddr_storage &addr,
+                       socklen_t addr_len);
+  // returns the UDP socket of the channel (-1 if none)
+  int GetDatagramSocket();
+  // reads the datagrams waiting in the UDP socket of a client channel (up
+  // to GepProtocol::kMaxDatagramsPerLoop)
+  void RecvDatagrams();
+  // processes a datagram received from the peer
+  void RecvDatagram(uint8_t *buf, int len);
+  GepDatagramStats GetDatagramStats();
+
+  // returns the number of times the stream was resynchronized after a bad
+  // frame (see GepProtocol::SetResync())
+  int64_t GetNumResyncs() const { return resyncs_; }
+  // returns the number of frames with a wrong checksum (see
+  // GepProtocol::SetChecksum())
+  int64_t GetNumChecksumErrors() const { return checksum_errors_; }
+
+  // Flow control (see GepProtocol::SetFlowControl()): Returns the number of
+  // messages waiting for credits.
+  int GetNumQueued();
+  // returns the number of messages that were never sent: those waiting for
+  // credits or in the coalescing buffer when the channel was closed, and
+  // those released by credits or in a coalescing buffer that could not be
+  // written
+  int64_t GetNumDropped() const { return flow_dropped_; }
+  // returns the number of zero-copy buffers (of all the channels) that the
+  // kernel had not completed when their channel closed. The process keeps
+  // the latest ones alive, and frees the older ones
+  static int64_t GetNumZeroCopyOrphaned();
+
+  // Conflation: Keeps only the latest (already-serialized) message of each
+  // (tag, key), until FlushConflated() sends them.
+  void Conflate(uint32_t tag, const std::string &key, const std::string &s);
+  // Conflates a message, and writes the pending ones right away if the
+  // socket has room for them.
+  // Returns status value (0 if ok, -1 for error)
+  int SendConflated(uint32_t tag, const std::string &key,
+                    const std::string &s);
+  // Returns status value (0 if ok, -1 for error)
+  int FlushConflated();
+  int GetNumConflated();
+  // Returns whether there are conflated messages waiting for the socket
+  // to be writable (slow channels wait until they recover instead).
+  bool HasPendingData();
+
   // socket opening/closing
   int OpenClientSocket();
   int Close();
+  // Shuts the connection down, but leaves the socket open until Close(),
+  // so that the receiving side sees the connection as closed.
+  int Shutdown();
 
   // accessors
   int GetId() const { return id_; }
@@ -45,6 +309,14 @@ class GepChannel {
   void SetSocket(int socket);
   bool IsOpenSocket();
   void *GetContext() const { return context_; }
+  void SetControlCallback(const GepControlCallback &control_callback) {
+    control_callback_ = control_callback;
+  }
+  void SetShedCallback(const GepShedCallback &shed_callback) {
+    shed_callback_ = shed_callback;
+  }
+  // returns the number of messages posted to executors not yet processed
+  int GetPendingTasks();
   int GetLen() const { return len_; }
   void SetLen(int len) { len_ = len; }
 
@@ -69,30 +341,329 @@ class GepChannel {
   bool IsRecoverable(Result ret) { return ret >= 0; }
 
  private:
+  // a complete message found in the recv buffer
+  struct Frame {
+    uint32_t tag;
+    uint32_t value_len;
+    uint32_t msg_len;  // length of the received frame (for the credits)
+    int offset;  // offset of the value in buf_
+    int priority;
+    int fd;  // descriptor passed with the message (-1 if none)
+  };
+
   // sends generic data to the GEP channel socket
-  int SendData(const char *buf, int bytes);
+  // (passing pass_fd with the first byte, if not negative). A non-null
+  // owner keeps buf alive, which allows sending it with MSG_ZEROCOPY
+  int SendData(const char *buf, int bytes, int pass_fd = -1,
+               const std::shared_ptr<const std::string> &owner = nullptr);
+  // same, skipping the coalescing buffer (socket_lock_ held)
+  int SendDataNow(const char *buf, int bytes, int pass_fd,
+                  const std::shared_ptr<const std::string> &owner);
+  // writes the coalescing buffer to the socket (socket_lock_ held). The
+  // frames of a failed write count as dropped
+  int FlushLocked();
+  // sends data with MSG_ZEROCOPY, keeping owner until the kernel reports
+  // the send complete (socket_lock_ held). Copies the data into the socket
+  // when zero-copy sends are not possible
+  int SendZeroCopy(const char *buf, int bytes,
+                   const std::shared_ptr<const std::string> &owner);
+  // releases the buffers of the zero-copy sends completed (socket_lock_
+  // held)
+  void ReapZeroCopy();
+  // waits (a little) for the pending zero-copy completions before closing
+  // the socket, and keeps the latest buffers not completed alive for good
+  // (socket_lock_ held)
+  void DrainZeroCopy();
+  // sends generic data to the shared memory ring (socket_lock_ held), with
+  // the same return values as SocketInterface::FullSend()
+  int SendShmData(const char *buf, int bytes);
+  // receives data from the shared memory ring, until it is empty
+  int RecvShmData();
+  // returns the bytes sent and not read by the peer yet (socket_lock_ held)
+  int GetQueuedBytesLocked();
+  // offers the peer a shared memory (or in-process) segment (clients only)
+  int OfferShm(bool local);
+  // receives a shared memory negotiation message
+  Result RecvShm(int value_len, const uint8_t *value);
   // receives generic data in the GEP channel socket
   Result RecvString();
   // receives a TLV tuple in the GEP channel socket
   Result RecvTLV(uint32_t tag, int value_len, const uint8_t *value);
+  // unpacks a message and runs its callback
+  Result RunCallback(uint32_t tag, const GepCallback &callback,
+                     const std::string &value_str);
+  // posts a message to an executor
+  void PostTLV(const GepExecutor &executor, uint32_t tag,
+               const GepCallback &callback, int value_len,
+               const uint8_t *value);
+  // posts a task to an executor, which takes over the credits of the
+  // message being dispatched
+  void PostTask(const GepExecutor &executor, const std::function<void()> &task);
+  // waits until all the messages posted to executors have been processed
+  void WaitForTasks();
+  // sends a serialized message (SendString() and SendBuffer())
+  int SendValue(uint32_t tag, const std::string &s,
+                const std::shared_ptr<const std::string> &owner);
   // sends a TLV tuple to the GEP channel socket
-  int SendTLV(uint32_t tag, int value_len, const char *value);
-  // sends a generic string to the GEP channel socket
-  int SendString(uint32_t tag, const std::string &s);
+  int SendTLV(uint32_t tag, int value_len, const char *value,
+              int pass_fd = -1,
+              const std::shared_ptr<const std::string> &owner = nullptr);
+  int SendTLVLocked(uint32_t tag, int value_len, const char *value,
+                    int pass_fd = -1,
+                    const std::shared_ptr<const std::string> &owner = nullptr);
+  // sends a serialized message in a datagram. Returns 1 if it does not fit
+  // in one, or the channel has no UDP socket
+  int SendDatagram(uint32_t tag, const std::string &s);
+  // opens the UDP socket of a client channel, and tells the server its
+  // port
+  void OpenDatagramSocket(const struct sockaddr_storage &addr,
+                          socklen_t addr_len);
+  // sends a serialized message through a memfd
+  int SendMemfd(uint32_t tag, const std::string &s);
+  // sends a serialized message as a sequence of chunks
+  int SendChunked(uint32_t tag, const std::string &s);
+  // waits for the turn of the next bulk chunk. Returns false if the
+  // control messages or the socket do not let it go in time, or the
+  // socket closes
+  bool WaitForBulkTurn();
+  // returns whether a frame goes through the bulk lane
+  static bool IsBulkFrame(uint32_t tag, int value_len, const char *value);
+  // updates the slow-consumer state after a send
+  void UpdateSlow(int64_t send_latency_usec);
+  // token buckets of a GepRateLimit
+  struct RateBuckets {
+    RateBuckets() : msgs(0), bytes(0), last_usec(0) {}
+    double msgs;  // available tokens
+    double bytes;
+    int64_t last_usec;  // last refill
+  };
+  // refills the buckets. Returns the usecs until they have the tokens for
+  // a message (0 if they have them already)
+  static int64_t RefillBuckets(const GepRateLimit &limit, int64_t now_usec,
+                               int msg_len, RateBuckets *buckets);
+  // checks a message against the rate limits, taking its tokens if it fits
+  // in them. Returns the usecs to wait for it (0 if it fits), and the
+  // policy action in action. With pause_after, a message over the limits
+  // with ACTION_PAUSE takes the tokens anyway, and the wait is for the
+  // messages after it
+  int64_t CheckRateLimit(uint32_t tag, int msg_len,
+                         GepRateLimitPolicy::Action *action,
+                         bool pause_after);
+  // returns whether the frames of a tag carry a protocol message (and so
+  // need flow control credits)
+  static bool CarriesMessage(uint32_t tag);
+  // returns the tag of the protocol message carried by a frame (kTagBatch
+  // for batches, which carry several)
+  static uint32_t GetMessageTag(uint32_t tag, int value_len,
+                                const uint8_t *value);
+  // returns the GepVFT priority of msg_tag, the message carried by a frame
+  // (in the GepVFT of its session for session frames)
+  int GetMessagePriority(uint32_t tag, int value_len, const uint8_t *value,
+                         uint32_t msg_tag);
+  // returns whether there are credits for a message (socket_lock_ held)
+  bool HasCredit(int msg_len);
+  // receives credits from the peer, and sends the queued messages that
+  // fit in them
+  void RecvCredit(uint32_t msgs, uint32_t bytes);
+  // grants the credits of a processed message (of msg_len bytes, or none
+  // if zero) back to the peer
+  void GrantCredit(int msg_len);
+  // receives a GEP control message
+  Result RecvControl(uint32_t tag, int value_len, const uint8_t *value);
+  // receives a delta-encoded message
+  Result RecvDelta(int value_len, const uint8_t *value);
+  // applies load shedding and the inbound rate limits to each message of
+  // a batch frame (or session frame carrying one), removing the dropped
+  // ones from the value. Returns the new value length (-1 to disconnect),
+  // the highest priority of the messages left in priority, and in
+  // wait_usec the pause for the frames after it
+  int FilterBatch(uint32_t tag, int value_len, uint8_t *value,
+                  int *priority, int64_t *wait_usec);
+  // receives a batch of messages
+  Result RecvBatch(int value_len, const uint8_t *value);
+  // runs a batch callback (or posts it to its executor)
+  Result DispatchBatch(
+      uint32_t tag, const GepVFTEntry &entry,
+      const std::vector<std::shared_ptr<GepProtobufMessage>> &msgs);
+  // receives a message object from an in-process peer
+  Result RecvObject(int value_len, const uint8_t *value);
+  // receives a message passed in a memfd (recv_fd_)
+  Result RecvMemfd(int value_len, const uint8_t *value);
+  // sends a compact header negotiation operation. Accepts and switches
+  // make us send compact headers, using peer_index (the indexes of the
+  // tags in the table of the peer)
+  int SendHeaderOp(uint8_t op, const std::map<uint32_t, int> &peer_index);
+  // receives a compact header negotiation operation
+  Result RecvHeader(int value_len, const uint8_t *value);
+  // sends a checksum negotiation operation. Accepts and switches make us
+  // add checksums
+  int SendChecksumOp(uint8_t op);
+  // receives a checksum negotiation operation
+  Result RecvChecksum(int value_len, const uint8_t *value);
+  // skips a bad frame header at *offset in buf_, up to the next header
+  // that may be valid. Returns false if the stream cannot be resynchronized
+  bool Resync(int *offset);
+  // receives a chunk of a message
+  Result RecvChunk(int value_len, const uint8_t *value);
+  // hands a session frame to the channel of its session
+  Result RecvSessionMsg(int value_len, const uint8_t *value);
+  // runs the callback of an unpacked message (or posts it to its executor)
+  Result DispatchMessage(uint32_t tag, const GepVFTEntry &entry,
+                         const std::shared_ptr<GepProtobufMessage> &msg);
+  // takes the descriptor passed by the peer with the frame at offset in
+  // buf_ if tag carries one (-1 otherwise), closing the stray ones
+  int TakeRecvFd(uint32_t tag, int offset);
+  // closes the descriptors passed before offset in buf_, and moves the
+  // rest to the start of it
+  void ReleaseRecvFds(int offset);
+  // releases the message object of a dropped message
+  void DropPayload(uint32_t tag, int value_len, const uint8_t *value);
 
   std::string name_;
   GepProtocol *proto_;      // not owned
   const GepVFT *ops_;       // VFT for the receiving side (not owned)
   void *context_;           // link to context (not owned)
+  GepControlCallback control_callback_;  // control messages from the peer
+  GepShedCallback shed_callback_;  // load shedding of incoming messages
+  bool peer_tags_valid_;  // whether the peer advertised its tags
+  std::set<uint32_t> peer_tags_;  // tags handled by the peer
+  std::mutex peer_tags_lock_;  // guards peer_tags_valid_ and peer_tags_
   int id_;
   SocketInterface *socket_interface_;  // socket interface
   int socket_;              // command socket used to talk to the other side
   int len_;                 // amount of data currently in buf
   uint8_t buf_[GepProtocol::kMaxMsgLen];  // receive buffer for command data
                                          // from clients
+  std::vector<Frame> frames_;  // complete messages in buf_ (recv only)
+  int pending_tasks_;  // messages posted to executors not yet processed
+  std::mutex pending_tasks_lock_;  // guards pending_tasks_
+  std::condition_variable pending_tasks_cv_;
   std::mutex socket_lock_;  // guards access to channel socket between senders
                             // and the socket controller (open/close) (which
                             // is also the recv)
+  // slow-consumer state (guarded by socket_lock_, but slow_)
+  GepSlowConsumerPolicy slow_policy_;
+  int send_timeouts_;  // consecutive timed out sends
+  std::atomic<bool> slow_;
+  // inbound rate-limiting state (guarded by rate_lock_, but the atomics)
+  GepRateLimitPolicy rate_policy_;
+  RateBuckets rate_channel_;
+  std::map<uint32_t, RateBuckets> rate_tags_;
+  std::mutex rate_lock_;
+  std::atomic<int64_t> recv_paused_until_usec_;  // 0 if not paused
+  std::atomic<int64_t> rate_limited_;
+  // flow control state: messages and bytes sent and not granted back yet,
+  // and messages waiting for credits (guarded by socket_lock_)
+  int flow_msgs_;
+  int64_t flow_bytes_;
+  std::deque<std::pair<uint32_t, std::string>> flow_queue_;
+  // messages discarded by Close() or by a failed flush
+  std::atomic<int64_t> flow_dropped_;
+  // messages and bytes processed and not granted yet
+  int credit_msgs_;
+  int64_t credit_bytes_;
+  std::mutex credit_lock_;  // guards credit_msgs_ and credit_bytes_
+  // credits of the message being dispatched (executors take them over)
+  int recv_credit_len_;
+  // shared memory transport: the segment (owned, guarded by socket_lock_
+  // for the senders, and only changed by the recv thread), and whether
+  // each direction uses it already
+  ShmTransport *shm_;
+  bool shm_send_;  // guarded by socket_lock_
+  std::atomic<bool> shm_recv_;
+  // sequence number of the next message object (guarded by socket_lock_)
+  uint32_t object_seq_;
+  // descriptors passed by the peer and not taken by a message yet, with
+  // their offset in buf_ (recv only), and the one of the message being
+  // dispatched
+  std::deque<std::pair<int, int>> recv_fds_;
+  int recv_fd_;
+  // descriptors of the memfd messages waiting for credits (guarded by
+  // socket_lock_)
+  std::deque<int> flow_fds_;
+  // chunked messages: id of the next stream sent, and messages being
+  // reassembled per stream id (recv only)
+  std::atomic<uint32_t> chunk_stream_id_;
+  struct ChunkStream {
+    uint32_t tag;
+    uint32_t total;  // message length
+    std::string data;  // chunks received so far
+  };
+  std::map<uint32_t, ChunkStream> chunks_;
+  // maximum number of messages being reassembled
+  static const int kMaxChunkStreams = 16;
+  // control messages waiting for the socket (when using lanes), and the
+  // bulk senders waiting for them to go
+  std::atomic<int> control_waiting_;
+  std::mutex control_lock_;
+  std::condition_variable control_cv_;
+  // times the receive stream was resynchronized after a bad frame
+  std::atomic<int64_t> resyncs_;
+  // compact headers: whether we send them (guarded by socket_lock_), and
+  // the index of each tag in the table of the peer, and whether we
+  // receive them (recv only), and our table
+  bool send_compact_;
+  std::map<uint32_t, int> send_tag_index_;
+  bool recv_compact_;
+  std::vector<uint32_t> recv_tags_;
+  // frame checksums: whether we send them (guarded by socket_lock_), and
+  // whether we receive them (recv only), and the frames dropped for a
+  // wrong one
+  bool send_checksum_;
+  bool recv_checksum_;
+  std::atomic<int64_t> checksum_errors_;
+  // send coalescing (guarded by socket_lock_): the frames not written to
+  // the socket yet, when the oldest one is due (monotonic usecs), and how
+  // many there are
+  std::string out_buf_;
+  int64_t out_flush_usec_;
+  int out_frames_;
+  // datagrams (guarded by datagram_lock_): the UDP socket, whether we own
+  // it (clients only), the peer address, the sequence numbers of the next
+  // datagram sent and of the next one expected, and the counters
+  int datagram_socket_;
+  bool datagram_owned_;
+  struct sockaddr_storage datagram_addr_;
+  socklen_t datagram_addr_len_;
+  uint32_t datagram_seq_;
+  uint32_t datagram_next_seq_;
+  GepDatagramStats datagram_stats_;
+  std::mutex datagram_lock_;
+  // sessions: the parent channel and session id of a session channel, and
+  // the session channels carried by a parent channel
+  std::shared_ptr<GepChannel> parent_;
+  uint32_t session_id_;
+  std::map<uint32_t, std::weak_ptr<GepChannel>> sessions_;
+  std::mutex sessions_lock_;  // guards sessions_
+  // zero-copy sends (guarded by socket_lock_): whether the socket takes
+  // them (0 if not tried yet, -1 if not), the send calls made so far, the
+  // leading calls completed, the completed ranges after a gap (by first
+  // call), and the buffers the kernel may still read, with the number of
+  // calls completed once they are free
+  int zerocopy_state_;
+  uint32_t zerocopy_calls_;
+  uint32_t zerocopy_done_;
+  std::map<uint32_t, uint32_t> zerocopy_ranges_;
+  std::deque<std::pair<uint32_t, std::shared_ptr<const std::string>>>
+      zerocopy_bufs_;
+  // maximum number of buffers waiting for zero-copy completions
+  static const int kMaxZeroCopyBufs = 256;
+  // maximum number of messages waiting for credits
+  static const int kMaxQueued = 65536;
+  // latest conflated message per (tag, key)
+  std::map<std::pair<uint32_t, std::string>, std::string> conflated_;
+  std::mutex conflated_lock_;  // guards conflated_
+  std::mutex conflated_flush_lock_;  // serializes FlushConflated()
+  // delta encoding state: last message sent/received per (tag, key)
+  struct DeltaState {
+    DeltaState() : seq(0), count(0) {}
+    std::unique_ptr<GepProtobufMessage> msg;
+    uint32_t seq;  // sequence number of msg
+    int count;  // messages since the last keyframe
+  };
+  std::map<std::pair<uint32_t, std::string>, DeltaState> delta_sent_;
+  std::mutex delta_sent_lock_;  // guards delta_sent_
+  std::map<std::pair<uint32_t, std::string>, DeltaState> delta_recv_;
 
   // do not copy this object
   GepChannel(const GepChannel&) = delete;  // suppress copy
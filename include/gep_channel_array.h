@@ -5,10 +5,15 @@
 #ifndef _GEP_CHANNEL_ARRAY_H_
 #define _GEP_CHANNEL_ARRAY_H_
 
+#include <atomic>  // for atomic
+#include <functional>  // for function
+#include <map>  // for map
 #include <memory>  // for shared_ptr
 #include <mutex>  // for mutex
+#include <set>  // for set
 #include <string>  // for string
 #include <sys/select.h>  // for fd_set
+#include <utility>  // for pair
 #include <vector>  // for vector
 
 #include "gep_channel.h"  // for GepChannel
@@ -17,6 +22,46 @@
 
 class GepServer;
 class SocketInterface;
+class ThreadPool;
+
+// Per-recipient results of a broadcast: client id to send status (0 if
+// ok, -1 for error).
+typedef std::map<int, int> GepSendResults;
+
+// Overload policy: A server whose service thread falls behind sheds the
+// messages with lower priority than min_priority, both incoming (using
+// their GepVFT priority, before unpacking them) and outgoing (using their
+// GepProtocol send priority, before serializing them). GEP control
+// messages are never shed. The server is overloaded once any of the
+// (non-zero) thresholds is exceeded, and recovers once all of them are
+// below half of their value, but not before hold_usec.
+struct GepOverloadPolicy {
+  GepOverloadPolicy()
+      : max_loop_lag_usec(0),
+        max_pending_tasks(0),
+        max_cpu_usage(0),
+        min_priority(kGepPriorityNormal),
+        hold_usec(1000000) {}
+
+  bool IsEnabled() const {
+    return max_loop_lag_usec > 0 || max_pending_tasks > 0 ||
+        max_cpu_usage > 0;
+  }
+
+  int64_t max_loop_lag_usec;  // time from a select() wakeup until the
+                              // events are dispatched
+  int max_pending_tasks;  // messages waiting for their executors
+  double max_cpu_usage;  // fraction of the service thread time (0 to 1)
+  int min_priority;  // lowest priority not shed
+  int64_t hold_usec;  // minimum overload duration
+};
+
+// Number of messages shed per tag.
+struct GepShedCounters {
+  GepShedCounters() : inbound(0), outbound(0) {}
+  int64_t inbound;
+  int64_t outbound;
+};
 
 // Class used to manage an array of communication channels where protobuf
 // messages can be sent back and forth.
@@ -48,21 +93,102 @@ class GepChannelArray {
   // implemented on top of GEP to not require idempotence in the
   // server-initiated operations.
   int SendMessage(const GepProtobufMessage &msg);
+  // Same, but also returns the status of each recipient in results (if
+  // not null).
+  int SendMessage(const GepProtobufMessage &msg, GepSendResults *results);
+
+  // Send messages in batch frames (see GepChannel::SendBatch()) to all
+  // GEP clients. The messages are serialized once, and go through load
+  // shedding, snapshots, parallel sends, and the slow-consumer policy
+  // like SendMessage() (slow clients get them one by one).
+  // Returns status value (0 if all ok, -1 if any of the receivers failed).
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs);
+
+  // Parallel broadcast: Sets the number of threads used to send a
+  // broadcast message. The message is serialized once, and the channels
+  // are split among the caller thread and (num_threads - 1) sender
+  // threads, so a slow client only delays the clients in its share. Use
+  // 1 (the default) for sequential sends in the caller thread.
+  void SetSendThreads(int num_threads);
+  int GetSendThreads();
+
+  // Slow-consumer isolation: Sets the thresholds used to detect slow
+  // clients, and the action applied to them (see GepSlowConsumerPolicy).
+  // Changes in the slow state of a client are reported using
+  // GepServer::SlowClient().
+  void SetSlowConsumerPolicy(const GepSlowConsumerPolicy &policy);
+  // Re-checks the slow clients, so that they can recover even if there is
+  // nothing new to send them.
+  void CheckSlowChannels();
+
+  // Inbound rate limiting: Sets the limits of every client (see
+  // GepRateLimitPolicy). Use GetGepChannel(id)->SetRateLimitPolicy() to
+  // change the limits of a single client.
+  void SetRateLimitPolicy(const GepRateLimitPolicy &policy);
+  // Resumes the clients paused by the rate limits whose messages fit in
+  // them again (disconnecting those that fail).
+  // Returns the usecs until the next paused client can be resumed (0 if
+  // there is none).
+  int64_t ResumeChannels();
+
+  // Overload control: Sets the overload thresholds (see
+  // GepOverloadPolicy). Changes in the overload state are reported using
+  // GepServer::Overloaded().
+  void SetOverloadPolicy(const GepOverloadPolicy &policy);
+  // Updates the overload state, given the lag of the last service loop.
+  // Must be called from the service thread (its CPU usage is measured).
+  void UpdateOverload(int64_t loop_lag_usec);
+  bool IsOverloaded() const { return overloaded_; }
+  // returns the number of messages shed per tag
+  std::map<uint32_t, GepShedCounters> GetShedCounters();
+
+  // Snapshot cache: The latest message broadcast (using SendMessage()) for
+  // each (tag, key) of a snapshot tag is kept serialized, and replayed to
+  // every new client when it connects. A null key function keeps a single
+  // message per tag.
+  void SetSnapshot(uint32_t tag, const GepMessageKey &key);
+  // Removes a message from the snapshot cache.
+  // Returns status value (0 if ok, -1 if there is no such message).
+  int DelSnapshot(uint32_t tag, const std::string &key);
+  void ClearSnapshot();
+  int GetSnapshotSize();
 
   // Send a specific protobuf message to a specified GEP client.
   // Returns status value (0 if all ok, -1 if the receiver failed).
   int SendMessage(const GepProtobufMessage &msg, int id);
+  // Same with messages in batch frames.
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs, int id);
+
+  // Topic subscriptions: Clients subscribe to topics by sending GEP
+  // control messages (see GepClient::Subscribe()), or the server can
+  // subscribe them explicitly. Subscriptions are removed when the client
+  // disconnects.
+  // Returns status value (0 if ok, -1 if there is no such client).
+  int Subscribe(int id, const std::string &topic);
+  int Unsubscribe(int id, const std::string &topic);
+  int GetNumSubscribers(const std::string &topic);
+
+  // Send a specific protobuf message to all the GEP clients subscribed to
+  // a topic. The message is serialized only once.
+  // Returns status value (0 if all ok, -1 if any of the receivers failed).
+  int Publish(const std::string &topic, const GepProtobufMessage &msg);
 
   void ClearGepChannelVector();
   // accessors
   int GetVectorSize();
   int GetVectorSocket(int i);
   int GetClientId(int i);
+  // returns the channel of a client (nullptr if there is no such client)
+  std::shared_ptr<GepChannel> GetGepChannel(int id);
 
   // network management
   int GetServerSocket() const { return server_socket_; }
   void GetVectorReadFds(int *max_fds, fd_set *read_fds);
   void RecvData(fd_set *read_fds);
+  // channels with pending (conflated) messages wait for their sockets to
+  // be writable
+  void GetVectorWriteFds(int *max_fds, fd_set *write_fds);
+  void SendData(fd_set *write_fds);
 
   // socket interface
   SocketInterface *GetSocketInterface() { return socket_interface_; }
@@ -72,6 +198,74 @@ class GepChannelArray {
 
  private:
   int AddChannel(int socket);
+  // adds the channel of a session opened by a client
+  bool AddSession(GepChannel *parent, const std::string &value);
+  // removes the channel of a session closed by a client
+  bool DelSession(GepChannel *parent, const std::string &value);
+  // removes the file system entry of the Unix domain server socket
+  void UnlinkUnixSocket();
+  // opens the UDP socket receiving the datagram tags
+  int OpenDatagramSocket();
+  // registers the UDP port of a client (value: port (4 bytes))
+  bool AddDatagramPeer(GepChannel *channel, const std::string &value);
+  // hands the waiting datagrams to the channels of their senders (up to
+  // GepProtocol::kMaxDatagramsPerLoop)
+  void RecvDatagrams();
+  // processes the GEP control messages received from a channel
+  bool RecvControl(GepChannel *channel, uint32_t tag, const std::string &value);
+  // returns whether a message must be shed (counting it if so)
+  bool ShedMessage(uint32_t tag, int priority, bool inbound);
+  // removes a channel (if it still exists) after a recv error
+  void DelChannel(const std::shared_ptr<GepChannel> &channel);
+  // removes all the subscriptions of a channel
+  void DelSubscriptions(int id);
+  // a message ready to be sent to a set of channels
+  struct OutMessage {
+    explicit OutMessage(const GepProtobufMessage &out_msg)
+        : msg(out_msg), tag(0), s(new std::string()), delta(false),
+          conflated(false) {}
+    const GepProtobufMessage &msg;
+    uint32_t tag;
+    // serialized message (shared with the zero-copy sends in flight)
+    std::shared_ptr<std::string> s;
+    bool delta;  // whether the tag is delta-encoded
+    bool conflated;  // whether the tag is conflated
+    std::string key;  // delta/conflation key
+  };
+  // serializes a message (only once for all the channels). Returns 0 on
+  // success, 1 if the message was shed, and -1 on error
+  int PrepareMessage(OutMessage *out);
+  // keeps the serialized message for the clients that join later (if its
+  // tag is a snapshot tag)
+  void KeepSnapshot(const OutMessage &out);
+  // messages ready to be sent in batch frames
+  struct OutBatch {
+    std::vector<std::unique_ptr<OutMessage>> outs;
+    std::vector<std::pair<uint32_t, std::string>> values;
+  };
+  // serializes the messages of a batch (only once for all the channels),
+  // shedding them like PrepareMessage(). Returns 0 on success, and -1 on
+  // error
+  int PrepareBatch(const std::vector<const GepProtobufMessage *> &msgs,
+                   OutBatch *batch);
+  // sends a message (or batch) to a set of channels with send, returning
+  // the status of each of them
+  void SendToChannels(
+      const std::vector<std::shared_ptr<GepChannel>> &channels,
+      const std::function<int(const std::shared_ptr<GepChannel> &)> &send,
+      std::vector<int> *status);
+  // sends a message to a channel, applying the slow-consumer policy
+  int SendToChannel(const std::shared_ptr<GepChannel> &channel,
+                    const OutMessage &out);
+  // same for a batch
+  int SendBatchToChannel(const std::shared_ptr<GepChannel> &channel,
+                         const OutBatch &batch);
+  // updates the slow state of a channel, reporting any change to the
+  // server. Returns whether the channel is (still) slow.
+  bool UpdateSlowChannel(const std::shared_ptr<GepChannel> &channel);
+  // sends a serialized message from the background lane
+  int PostBackground(const std::shared_ptr<GepChannel> &channel,
+                     uint32_t tag, const std::string &s);
 
   std::string name_;
   GepServer *server_;  // not owned
@@ -82,12 +276,53 @@ class GepChannelArray {
   int last_channel_id_;
   // GEP channel vector (one per client)
   std::vector<std::shared_ptr<GepChannel>> gep_channel_vector_;
-  // mutex to protect gep_channel_vector_
+  // sender threads for parallel broadcasts (null for sequential sends)
+  std::unique_ptr<ThreadPool> send_pool_;
+  // topic subscriptions (topic to channel ids)
+  std::map<std::string, std::set<int>> subscriptions_;
+  // slow-consumer policy
+  GepSlowConsumerPolicy slow_policy_;
+  // inbound rate-limiting policy
+  GepRateLimitPolicy rate_policy_;
+  // snapshot tags, and latest serialized message per (tag, key)
+  std::map<uint32_t, GepMessageKey> snapshot_tags_;
+  std::map<std::pair<uint32_t, std::string>, std::string> snapshot_;
+  // mutex to protect gep_channel_vector_, send_pool_, subscriptions_,
+  // slow_policy_, rate_policy_, snapshot_tags_ and snapshot_
   std::recursive_mutex gep_channel_vector_lock_;
+  // ids of the channels reported as slow
+  std::set<int> slow_ids_;
+  // pending background sends per channel id
+  std::map<int, int> background_sends_;
+  // mutex to protect slow_ids_ and background_sends_ (used by the sender
+  // threads)
+  std::mutex slow_lock_;
+  // sender thread for the slow channels (the background lane)
+  std::unique_ptr<ThreadPool> background_pool_;
+  // maximum number of pending background sends per channel
+  static const int kMaxBackgroundSends = 1024;
+  // overload state (guarded by overload_lock_, but the atomics, and the
+  // CPU usage, which is only used by the service thread)
+  GepOverloadPolicy overload_policy_;
+  std::atomic<bool> overloaded_;
+  std::atomic<int> shed_priority_;  // lowest priority not shed
+  int64_t overload_start_usec_;
+  std::map<uint32_t, GepShedCounters> shed_counters_;
+  std::mutex overload_lock_;
+  int64_t cpu_sample_usec_;  // start of the CPU usage sample
+  int64_t cpu_sample_thread_usec_;
+  double cpu_usage_;
+  // period of the CPU usage samples
+  static const int64_t kCpuSampleUsec = 100000;
 
   SocketInterface *socket_interface_;
   // socket accepting conns for new ctrl channels
   int server_socket_;
+  // socket receiving the datagram tags (-1 if not used)
+  int datagram_socket_;
+  // channels by the address of their UDP socket (guarded by
+  // gep_channel_vector_lock_)
+  std::map<std::string, std::weak_ptr<GepChannel>> datagram_peers_;
 };
 
 #endif  // _GEP_CHANNEL_ARRAY_H_
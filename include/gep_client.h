@@ -6,8 +6,13 @@
 #define _GEP_CLIENT_H_
 
 #include <atomic>  // for atomic
+#include <map>  // for map
+#include <memory>  // for shared_ptr
+#include <mutex>  // for mutex
+#include <set>  // for set
 #include <string>  // for string
 #include <thread>  // for thread
+#include <vector>  // for vector
 
 #include "gep_channel.h"  // for GepChannel
 #include "gep_common.h"  // for GepProtobufMessage
@@ -38,28 +43,63 @@ class GepClient {
 
   // accessors
   GepProtocol *GetProto() { return proto_; }
-  GepChannel *GetGepChannel() { return gep_channel_; }
+  GepChannel *GetGepChannel() { return gep_channel_.get(); }
   std::atomic<bool> &GetThreadCtrl() { return thread_ctrl_; }
 
   // send API
   // Returns status value (0 if all ok, -1 for any error)
   virtual int Send(const GepProtobufMessage &msg);
+  // Sends messages in batch frames (see GepChannel::SendBatch()).
+  // Returns status value (0 if all ok, -1 for any error)
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs);
+
+  // Subscribes to (unsubscribes from) a server topic (see
+  // GepServer::Publish()). Subscriptions are kept across reconnections.
+  // Returns status value (0 if all ok, -1 for any error)
+  int Subscribe(const std::string &topic);
+  int Unsubscribe(const std::string &topic);
 
   // Returns how many times the client reconnected to the server socket.
   int GetReconnectCount() { return reconnect_count_; }
 
+  // Sessions: A client can carry many logical clients over its connection.
+  // Each session has its own context and GepVFT, and the server sees it as
+  // a separate client, with its own id and AddClient()/DelClient() calls.
+  // Sessions are reopened after reconnections.
+  // Returns the session id (> 0), or -1 for error.
+  int AddSession(void *context, const GepVFT *ops);
+  // Returns status value (0 if ok, -1 if there is no such session)
+  int DelSession(int session);
+  // Sends a message from a session.
+  // Returns status value (0 if ok, -1 for error)
+  virtual int Send(const GepProtobufMessage &msg, int session);
+  // returns the channel of a session (nullptr if there is no such session),
+  // which the returned pointer keeps alive after a DelSession()
+  std::shared_ptr<GepChannel> GetSession(int session);
+
  private:
   // Attempts to reconnect the socket when disconnected.
   void Reconnect();
+  // Sends the current subscriptions to a (re)connected server.
+  void SendSubscriptions();
+  // Opens a session in a (re)connected server.
+  int OpenSession(const std::shared_ptr<GepChannel> &session);
+  // Opens the current sessions in a (re)connected server.
+  void SendSessions();
 
   std::string name_;
   void *context_;  // not owned
   GepProtocol *proto_;  // owned and responsible for destruction
   const GepVFT* ops_;  // not owned
-  GepChannel *gep_channel_;  // owned
+  std::shared_ptr<GepChannel> gep_channel_;  // owned (shared with sessions)
   std::thread thread_;
   std::atomic<bool> thread_ctrl_;
   std::atomic<int> reconnect_count_;
+  std::set<std::string> topics_;  // subscribed topics
+  std::mutex topics_lock_;  // guards topics_
+  std::map<int, std::shared_ptr<GepChannel>> sessions_;  // by session id
+  int last_session_id_;
+  std::mutex sessions_lock_;  // guards sessions_ and last_session_id_
 };
 
 #endif  // _GEP_CLIENT_H_
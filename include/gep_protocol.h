@@ -7,8 +7,12 @@
 
 #include <functional>  // for function
 #include <map>  // for map
+#include <set>  // for set
 #include <stdint.h>  // for uint32_t, uint8_t
 #include <string>  // for string
+#include <sys/socket.h>  // for sockaddr_storage, socklen_t
+#include <type_traits>  // for enable_if, is_same
+#include <vector>  // for vector
 
 #include "gep_common.h"  // for GepProtobufMessage
 
@@ -20,7 +24,58 @@
 typedef std::function<int(const GepProtobufMessage &msg,
                           void *context)> GepCallback;
 
-typedef std::map<uint32_t, GepCallback> GepVFT;
+// Callback function that will be called with all the messages of a tag
+// received in a batch frame (see GepVFTEntry::Batch()).
+typedef std::function<int(const std::vector<const GepProtobufMessage *> &msgs,
+                          void *context)> GepBatchCallback;
+
+// Function used to run a callback away from the I/O thread. It receives
+// a task, and must run it exactly once (in any thread).
+typedef std::function<void(const std::function<void()> &task)> GepExecutor;
+
+// Function that returns the key of a message, so that messages with the
+// same tag can be told apart (see GepProtocol::SetConflation() and
+// GepProtocol::SetDelta()).
+typedef std::function<std::string(const GepProtobufMessage &msg)>
+    GepMessageKey;
+
+// Dispatch priorities. Messages with higher priority that are received
+// in the same batch are dispatched before those with lower priority.
+const int kGepPriorityLow = -1;
+const int kGepPriorityNormal = 0;
+const int kGepPriorityHigh = 1;
+
+// An entry in the VFT: a callback plus its dispatch class. By default,
+// callbacks run inline on the I/O thread with normal priority. Setting
+// an executor name routes the message to the executor of that name
+// registered in the protocol (see GepProtocol::SetExecutor()).
+struct GepVFTEntry {
+  template <typename F, typename = typename std::enable_if<
+      !std::is_same<typename std::decay<F>::type, GepVFTEntry>::value>::type>
+  GepVFTEntry(F cb, int prio = kGepPriorityNormal,
+              const std::string &exec = "")
+      : callback(cb), priority(prio), executor(exec) {}
+
+  // an entry whose callback receives all the messages of its tag in a
+  // batch frame at once (see GepChannel::SendBatch()). Messages received
+  // on their own come in batches of one
+  static GepVFTEntry Batch(const GepBatchCallback &cb,
+                           int prio = kGepPriorityNormal,
+                           const std::string &exec = "") {
+    GepVFTEntry entry([cb](const GepProtobufMessage &msg, void *context) {
+      return cb({&msg}, context);
+    }, prio, exec);
+    entry.batch_callback = cb;
+    return entry;
+  }
+
+  GepCallback callback;
+  int priority;
+  std::string executor;
+  GepBatchCallback batch_callback;  // (empty for per-message entries)
+};
+
+typedef std::map<uint32_t, GepVFTEntry> GepVFT;
 
 // macro used to define tags
 constexpr int MakeTag(char a, char b, char c, char d) {
@@ -41,6 +96,66 @@ class GepProtocol {
   bool ScanHeader(uint8_t *buf, uint32_t *tag, uint32_t *value_len);
   // prints a a valid GEP header into a buffer
   void PrintHeader(uint32_t tag, uint32_t value_len, uint8_t *buf);
+  // returns the offset of the first position in a buffer that may start
+  // a valid GEP header (even if the buffer ends before the header does),
+  // or len if there is none
+  int FindHeader(const uint8_t *buf, int len) const;
+  // prints a compact header (see SetCompactHeader()) into a buffer of at
+  // least kMaxCompactHdrLen bytes, using the tag index, or the full tag if
+  // index is negative. Returns the header length
+  static int PrintCompactHeader(uint32_t tag, int index, uint32_t value_len,
+                                uint8_t *buf);
+  // scans a compact header in the first len bytes of a buffer. Sets *tag
+  // to the full tag or to its index, as *full_tag says. Returns the header
+  // length, 0 if the header is not complete yet, or -1 if it is invalid
+  static int ScanCompactHeader(const uint8_t *buf, int len, bool *full_tag,
+                               uint32_t *tag, uint32_t *value_len);
+
+  // GEP control messages: These are internal messages handled by the GEP
+  // library itself, and never passed to the GepVFT. Their tags have a
+  // zero first byte, so they cannot collide with printable protocol tags.
+  static bool IsControlTag(uint32_t tag) { return (tag >> 24) == 0; }
+  // subscribe/unsubscribe the sender to a topic (value: topic name)
+  static constexpr uint32_t kTagSubscribe = MakeTag('\0', 's', 'u', 'b');
+  static constexpr uint32_t kTagUnsubscribe = MakeTag('\0', 'u', 'n', 's');
+  // tags handled by the sender (value: list of 4-byte tags)
+  static constexpr uint32_t kTagInterest = MakeTag('\0', 'i', 'n', 't');
+  // delta-encoded message (value: see GepChannel::SendDelta())
+  static constexpr uint32_t kTagDelta = MakeTag('\0', 'd', 'l', 't');
+  // flow control credits (value: number of messages (4 bytes) and bytes
+  // (4) processed since the last grant)
+  static constexpr uint32_t kTagCredit = MakeTag('\0', 'c', 'r', 'd');
+  // shared memory negotiation (value: operation (1 byte), followed by the
+  // ring size (4) and the segment name for offers)
+  static constexpr uint32_t kTagShm = MakeTag('\0', 's', 'h', 'm');
+  // message object handed over in process (value: tag (4 bytes) and
+  // sequence number (4))
+  static constexpr uint32_t kTagObject = MakeTag('\0', 'o', 'b', 'j');
+  // message passed in a sealed memfd, whose descriptor comes with the
+  // first byte of the header (value: tag (4 bytes) and length (4))
+  static constexpr uint32_t kTagMemfd = MakeTag('\0', 'm', 'f', 'd');
+  // chunk of a large message (value: tag (4 bytes), stream id (4), total
+  // length (4), offset of the chunk (4), and the chunk data)
+  static constexpr uint32_t kTagChunk = MakeTag('\0', 'c', 'h', 'k');
+  // session opened/closed by the client (value: session id (4 bytes))
+  static constexpr uint32_t kTagSessionOpen = MakeTag('\0', 's', 'o', 'p');
+  static constexpr uint32_t kTagSessionClose = MakeTag('\0', 's', 'c', 'l');
+  // frame of a session (value: session id (4 bytes), tag (4), and value)
+  static constexpr uint32_t kTagSessionMsg = MakeTag('\0', 's', 'e', 's');
+  // message sent in a datagram (value: sequence number (4 bytes), tag
+  // (4), and the serialized message)
+  static constexpr uint32_t kTagDatagram = MakeTag('\0', 'd', 'g', 'm');
+  // UDP port the client receives datagrams on (value: port (4 bytes))
+  static constexpr uint32_t kTagDatagramPort = MakeTag('\0', 'd', 'g', 'p');
+  // compact header negotiation (value: operation (1 byte), followed by
+  // the tags of the GepVFT of the sender (4 bytes each) for offers and
+  // accepts). The sender uses compact headers after accepts and switches
+  static constexpr uint32_t kTagHeader = MakeTag('\0', 'h', 'd', 'r');
+  // checksum negotiation (value: operation (1 byte)). The sender adds
+  // checksums after accepts and switches
+  static constexpr uint32_t kTagChecksum = MakeTag('\0', 'c', 'r', 'c');
+  // batch of messages (value: see GepChannel::SendBatch())
+  static constexpr uint32_t kTagBatch = MakeTag('\0', 'b', 'a', 't');
 
   // returns the tag associated to a message.
   virtual uint32_t GetTag(const GepProtobufMessage *msg) = 0;
@@ -54,6 +169,8 @@ class GepProtocol {
   // Return an error code (true if ok, false if problems)
   bool Serialize(const GepProtobufMessage &msg, std::string *s);
   bool Unserialize(const std::string &s, GepProtobufMessage *msg);
+  // parses a message in place
+  bool Unserialize(const uint8_t *buf, size_t len, GepProtobufMessage *msg);
   enum Mode {
     MODE_TEXT = 0,  // use text-encoded protobuf messages
     MODE_BINARY = 1,  // use binary-encoded protobuf messages
@@ -61,6 +178,212 @@ class GepProtocol {
   void SetMode(Mode mode) { mode_ = mode; }
   Mode GetMode() const { return mode_; }
 
+  // named executors, used by GepVFT entries with a non-empty executor.
+  // Executors must be set before the client/server is started.
+  void SetExecutor(const std::string &name, const GepExecutor &executor);
+  // returns the executor with the given name, or nullptr if none
+  const GepExecutor *GetExecutor(const std::string &name) const;
+
+  // Latest-value conflation: Outgoing messages with a conflated tag are
+  // queued per channel, keeping only the latest message for each (tag,
+  // key), and written once the socket has room for them. A null key
+  // function conflates all the messages of the tag. Conflation must be
+  // set before the client/server is started.
+  void SetConflation(uint32_t tag, const GepMessageKey &key);
+  // gets the conflation key of a message. Returns false if the tag is not
+  // conflated
+  bool GetConflationKey(uint32_t tag, const GepProtobufMessage &msg,
+                        std::string *key) const;
+
+  // Delta encoding (full builds only): Messages with a delta tag are sent
+  // as the fields that changed from the last message sent on the same
+  // channel with the same (tag, key), and the receiver rebuilds the full
+  // message before running its callback. A full message (keyframe) is
+  // sent every keyframe_interval messages, and after any send error. A
+  // null key function uses a single key per tag. Delta encoding takes
+  // precedence over conflation, and must be set before the client/server
+  // is started (on both sides).
+  // Returns status value (0 if ok, -1 if not supported)
+  int SetDelta(uint32_t tag, const GepMessageKey &key,
+               int keyframe_interval = kDefaultKeyframeInterval);
+  // gets the delta key of a message. Returns false if the tag is not
+  // delta-encoded
+  bool GetDeltaKey(uint32_t tag, const GepProtobufMessage &msg,
+                   std::string *key) const;
+  // returns the keyframe interval of a delta-encoded tag
+  int GetKeyframeInterval(uint32_t tag) const;
+  static const int kDefaultKeyframeInterval = 100;
+
+  // Send priorities: Priority of the outgoing messages of a tag (the
+  // incoming ones use their GepVFT priority). Under overload, servers shed
+  // the messages with lower priority (see GepOverloadPolicy).
+  void SetTagPriority(uint32_t tag, int priority);
+  // returns the send priority of a tag (kGepPriorityNormal if not set)
+  int GetTagPriority(uint32_t tag) const;
+
+  // Credit-based flow control: Each side sends at most window_msgs
+  // messages (and window_bytes bytes, headers included) that the other
+  // side has not processed yet. Receivers grant the credits back (using
+  // kTagCredit) as their callbacks complete, and senders queue the
+  // messages locally while they have no credits. Zero windows are not
+  // limited. Flow control must be set before the client/server is
+  // started (on both sides, with the same windows).
+  void SetFlowControl(int window_msgs, int window_bytes);
+  int GetFlowWindowMsgs() const { return flow_window_msgs_; }
+  int GetFlowWindowBytes() const { return flow_window_bytes_; }
+  bool IsFlowControlled() const {
+    return flow_window_msgs_ > 0 || flow_window_bytes_ > 0;
+  }
+
+  // Shared memory transport: Clients offer the server (over the socket,
+  // right after connecting) a shared memory segment with a pair of
+  // rings of ring_bytes each. If the server has it enabled too (with
+  // rings at least as large), and can map the segment, both sides move
+  // the traffic of the channel to the rings, and only use the socket to
+  // wake up an idle peer and to detect disconnections. Otherwise they
+  // keep using the socket. Zero disables it (the default). It must be set
+  // before the client/server is started.
+  void SetSharedMemory(int ring_bytes) { shm_ring_bytes_ = ring_bytes; }
+  int GetShmRingBytes() const { return shm_ring_bytes_; }
+
+  // In-process transport: Same as the shared memory transport, for a
+  // client and a server running in the same process. The rings live in
+  // process memory, and, with pass_objects, the messages that are not
+  // delta-encoded or conflated are handed over as copies of the message
+  // objects, instead of being serialized and parsed. Clients offer it
+  // before shared memory, and fall back to shared memory (or the socket)
+  // when the server is in another process. Zero ring_bytes disables it
+  // (the default). It must be set before the client/server is started
+  // (on both sides).
+  void SetInProcess(int ring_bytes, bool pass_objects);
+  int GetInProcessRingBytes() const { return inproc_ring_bytes_; }
+  bool IsPassingObjects() const { return pass_objects_; }
+
+  // Large payloads (Unix domain sockets only): Serialized messages of at
+  // least threshold bytes are written to a sealed memfd, whose descriptor
+  // is passed to the peer (SCM_RIGHTS) instead of copying the bytes
+  // through the socket. The receiver maps the memfd and parses the message
+  // in place, so these messages can be larger than kMaxMsgLen. Zero
+  // disables it (the default). The receivers need it too, as they only
+  // accept descriptors with it.
+  void SetMemfdThreshold(int threshold) { memfd_threshold_ = threshold; }
+  int GetMemfdThreshold() const { return memfd_threshold_; }
+
+  // Zero-copy sends: On TCP sockets, serialized messages of at least
+  // threshold bytes are sent with MSG_ZEROCOPY. The kernel reads them
+  // from our memory, which is kept until it reports the send complete.
+  // This saves a copy for large messages only, and the loopback device
+  // copies the data anyway. Zero disables it (the default).
+  void SetZeroCopyThreshold(int threshold) { zerocopy_threshold_ = threshold; }
+  int GetZeroCopyThreshold() const { return zerocopy_threshold_; }
+
+  // Chunked messages: Serialized messages larger than kChunkBytes, with a
+  // non-zero maximum size for their tag, are sent as a sequence of chunks,
+  // one frame each. They can be larger than kMaxMsgLen, and the messages
+  // of other senders can go in between their chunks. Receivers
+  // reassemble each message, up to the maximum size of its tag, before
+  // parsing it. The first call sets the default for all tags, and the
+  // second one overrides it for a tag. Zero disables chunking (the
+  // default). It must be set before the client/server is started (on both
+  // sides).
+  void SetMaxMessageSize(int max_bytes) { max_msg_size_ = max_bytes; }
+  void SetMaxMessageSize(uint32_t tag, int max_bytes);
+  // returns the maximum size of a message of a tag (0 if not chunked)
+  int GetMaxMessageSize(uint32_t tag) const;
+
+  // Lanes: Messages of bulk tags larger than kChunkBytes go through the
+  // bulk lane. They are chunked (up to their maximum size, or kMaxMsgLen if
+  // they have none), and each chunk waits for the messages of the
+  // control lane (all the other ones) ready to be sent, and for the
+  // socket to hold less than bulk_queue_bytes. Control messages then wait
+  // for about a chunk plus bulk_queue_bytes, instead of for whole bulk
+  // messages. It must be set before the client/server is started (on
+  // both sides).
+  void SetBulkTag(uint32_t tag) { bulk_tags_.insert(tag); }
+  bool IsBulkTag(uint32_t tag) const { return bulk_tags_.count(tag) > 0; }
+  bool HasBulkTags() const { return !bulk_tags_.empty(); }
+  void SetBulkQueueBytes(int bytes) { bulk_queue_bytes_ = bytes; }
+  int GetBulkQueueBytes() const { return bulk_queue_bytes_; }
+  static const int kDefaultBulkQueueBytes = 256 * 1024;
+
+  // Datagram tags (TCP only): Messages of datagram tags go in UDP
+  // datagrams, one frame each, instead of through the connection, so a
+  // lost or late message does not hold back the ones after it. They may
+  // be lost or reordered, and receivers count both using their sequence
+  // numbers (see GepChannel::GetDatagramStats()). Servers receive them on
+  // the UDP port with the number of their TCP port. Messages whose frame
+  // does not fit in kMaxDatagramLen go through the connection. It must be
+  // set before the client/server is started (on both sides).
+  void SetDatagramTag(uint32_t tag) { datagram_tags_.insert(tag); }
+  bool IsDatagramTag(uint32_t tag) const {
+    return datagram_tags_.count(tag) > 0;
+  }
+  bool UsesDatagrams() const { return !datagram_tags_.empty() && !IsUnix(); }
+
+  // Stream resynchronization: When a received frame has a wrong magic
+  // number or an invalid length, the receiver skips forward to the next
+  // valid header instead of closing the connection, so corruption costs
+  // the frames in between, not a reconnection. Disabled by default (only
+  // receivers need it).
+  void SetResync(bool resync) { resync_ = resync; }
+  bool IsResync() const { return resync_; }
+
+  // Compact frame header (wire format v2): Clients offer it when they
+  // connect, and if the server has it enabled too, each side sends the
+  // other the tags of its GepVFT. From then on, frames start with a flags
+  // byte, the index of their tag in the table of the receiver (or the
+  // full tag, for the other tags), and the value length, both as varints:
+  // 3 bytes for most frames, instead of 12. The magic number is only
+  // checked during the negotiation, so compact streams cannot be
+  // resynchronized (see SetResync()). It must be set before the
+  // client/server is started (on both sides).
+  void SetCompactHeader(bool compact) { compact_header_ = compact; }
+  bool IsCompactHeader() const { return compact_header_; }
+
+  // Frame checksums: Clients offer them when they connect, and if the
+  // server has them enabled too, each frame ends with a CRC32C of its
+  // header and value (kChecksumLen bytes, not counted in the value
+  // length), computed with the CPU CRC instructions when there are. A
+  // frame with a wrong checksum is dropped, with the stream resynchronized
+  // if possible (see SetResync()), or with the connection otherwise. It
+  // must be set before the client/server is started (on both sides).
+  void SetChecksum(bool checksum) { checksum_ = checksum; }
+  bool IsChecksum() const { return checksum_; }
+
+  // Send coalescing: Channels keep the frames they send in a buffer, and
+  // write it to the socket once it holds at least bytes, once its oldest
+  // frame has waited delay_usec (if positive), or on GepChannel::Flush().
+  // GEP control frames (credits, negotiations) flush it too.
+  // The sockets use TCP_NODELAY, so this trades a bounded latency for
+  // fewer send calls and TCP segments. While it is enabled, the service
+  // threads wake up at least every delay_usec. Zero bytes disables it
+  // (the default).
+  void SetCoalescing(int bytes, int64_t delay_usec);
+  int GetCoalesceBytes() const { return coalesce_bytes_; }
+  int64_t GetCoalesceDelayUsec() const { return coalesce_delay_usec_; }
+
+  // SO_PRIORITY of the sockets (both lanes share the connection)
+  void SetSocketPriority(int priority) { socket_priority_ = priority; }
+  int GetSocketPriority() const { return socket_priority_; }
+  static const int kDefaultSocketPriority = 4;
+
+  // Transport address: Servers listen on (and clients connect to) the
+  // loopback TCP port by default. A non-empty Unix path makes them use a
+  // Unix domain stream socket instead, which skips the TCP stack for
+  // local peers. Paths starting with '@' are names in the (Linux)
+  // abstract namespace, which have no file system entry.
+  void SetUnixPath(const std::string &path) { unix_path_ = path; }
+  const std::string &GetUnixPath() const { return unix_path_; }
+  bool IsUnix() const { return !unix_path_.empty(); }
+  bool IsAbstractUnix() const { return IsUnix() && unix_path_[0] == '@'; }
+  // returns the socket domain of the transport (AF_INET or AF_UNIX)
+  int GetDomain() const { return IsUnix() ? AF_UNIX : AF_INET; }
+  // fills addr with the socket address of the transport. Returns its
+  // length (0 if the Unix path is too long)
+  socklen_t GetSockAddr(struct sockaddr_storage *addr) const;
+  // converts the transport address into a printable string
+  std::string AddressString() const;
+
   // accessors
   int GetPort() const { return port_; }
   void SetPort(int port) { port_ = port; }
@@ -74,9 +397,26 @@ class GepProtocol {
   // GEP protocol constants
   // maximum length of a single message (including 12-byte header)
   static const uint32_t kMaxMsgLen = 1 << 20;
+  // maximum data length of a message chunk
+  static const uint32_t kChunkBytes = 64 * 1024;
+  // maximum length of a compact header: flags, and up to 5-byte varints
+  // (or a 4-byte tag)
+  static const int kMaxCompactHdrLen = 11;
+  // compact header flags: the full tag follows (instead of its index).
+  // The other bits are reserved for per-frame features (e.g. compression),
+  // and must be zero
+  static const uint8_t kCompactFullTag = 0x01;
+  // length of the frame checksum
+  static const uint32_t kChecksumLen = 4;
+  // maximum length of a datagram frame (an Ethernet MTU minus the IPv4
+  // and UDP headers, so datagrams are not fragmented)
+  static const uint32_t kMaxDatagramLen = 1472;
+  // maximum number of datagrams read from a UDP socket per service loop
+  static const int kMaxDatagramsPerLoop = 64;
 
  protected:
   int port_;
+  std::string unix_path_;
   Mode mode_;
 #ifndef GEP_LITE
   // default in vanilla (non-lite) mode
@@ -99,6 +439,66 @@ class GepProtocol {
 
   // select() timeout, in usec
   int64_t select_timeout_usec_;
+
+  // named executors
+  std::map<std::string, GepExecutor> executors_;
+
+  // conflated tags
+  std::map<uint32_t, GepMessageKey> conflations_;
+
+  // delta-encoded tags
+  struct DeltaConfig {
+    GepMessageKey key;
+    int keyframe_interval;
+  };
+  std::map<uint32_t, DeltaConfig> deltas_;
+
+  // send priorities
+  std::map<uint32_t, int> priorities_;
+
+  // flow control windows
+  int flow_window_msgs_;
+  int flow_window_bytes_;
+
+  // shared memory ring size
+  int shm_ring_bytes_;
+
+  // in-process transport
+  int inproc_ring_bytes_;
+  bool pass_objects_;
+
+  // minimum size of the messages passed in a memfd
+  int memfd_threshold_;
+
+  // minimum size of the messages sent with MSG_ZEROCOPY
+  int zerocopy_threshold_;
+
+  // maximum size of chunked messages, by default and per tag
+  int max_msg_size_;
+  std::map<uint32_t, int> tag_max_msg_sizes_;
+
+  // bulk lane
+  std::set<uint32_t> bulk_tags_;
+  int bulk_queue_bytes_;
+
+  // datagram tags
+  std::set<uint32_t> datagram_tags_;
+
+  // SO_PRIORITY of the sockets
+  int socket_priority_;
+
+  // whether receivers resynchronize the stream after bad frames
+  bool resync_;
+
+  // whether to negotiate compact headers
+  bool compact_header_;
+
+  // whether to negotiate frame checksums
+  bool checksum_;
+
+  // send coalescing threshold (0 if disabled) and delay
+  int coalesce_bytes_;
+  int64_t coalesce_delay_usec_;
 };
 
 #endif  // _GEP_PROTOCOL_H_
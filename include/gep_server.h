@@ -9,6 +9,7 @@
 #include <thread>  // for thread
 #include <string>  // for string
 #include <stddef.h>  // for NULL
+#include <vector>  // for vector
 
 #include "gep_channel_array.h"
 #include "gep_common.h"  // for GepProtobufMessage
@@ -55,10 +56,41 @@ class GepServer {
   // Returns status value (0 if all ok, -1 for any error)
   virtual int Send(const GepProtobufMessage &msg);
   virtual int Send(const GepProtobufMessage &msg, int id);
+  // Sends messages in batch frames (see GepChannel::SendBatch()).
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs);
+  int SendBatch(const std::vector<const GepProtobufMessage *> &msgs, int id);
+  // Sends a message only to the clients subscribed to the given topic.
+  virtual int Publish(const std::string &topic, const GepProtobufMessage &msg);
+
+  // topic subscriptions (clients can also subscribe themselves)
+  // Returns status value (0 if ok, -1 for error)
+  int Subscribe(int id, const std::string &topic);
+  int Unsubscribe(int id, const std::string &topic);
+  int GetNumSubscribers(const std::string &topic);
+
+  // slow-consumer isolation (see GepSlowConsumerPolicy)
+  void SetSlowConsumerPolicy(const GepSlowConsumerPolicy &policy);
+
+  // inbound rate limiting of every client (see GepRateLimitPolicy)
+  void SetRateLimitPolicy(const GepRateLimitPolicy &policy);
+
+  // overload control (see GepOverloadPolicy)
+  void SetOverloadPolicy(const GepOverloadPolicy &policy);
+
+  // snapshot cache: the latest message sent (using Send(msg)) per (tag,
+  // key) of a snapshot tag is replayed to every new client, before
+  // AddClient() is called (see GepChannelArray::SetSnapshot())
+  void SetSnapshot(uint32_t tag, const GepMessageKey &key);
 
   // client (dis)connection callbacks
   virtual void AddClient(int id) { }
   virtual void DelClient(int id) { }
+  // slow client callback: called (from a sending thread) when a client
+  // becomes slow, and when it recovers
+  virtual void SlowClient(int id, bool slow) { }
+  // overload callback: called (from the service thread) when the server
+  // becomes overloaded, and when it recovers
+  virtual void Overloaded(bool overloaded) { }
 
  private:
   std::string name_;
@@ -0,0 +1,111 @@
+// Copyright Google Inc. Apache 2.0.
+
+// Field-level deltas between protobuf messages.
+
+#include "delta_encoding.h"
+
+#include <google/protobuf/descriptor.h>  // for Descriptor, FieldDescriptor
+#include <google/protobuf/unknown_field_set.h>  // for UnknownFieldSet
+
+using google::protobuf::Descriptor;
+using google::protobuf::FieldDescriptor;
+using google::protobuf::Message;
+using google::protobuf::Reflection;
+
+namespace libgep_utils {
+
+namespace {
+
+// compares a (repeated field element or singular) value of two messages
+bool ValueEquals(const Message &a, const Message &b,
+                 const FieldDescriptor *field, int index) {
+  const Reflection *ra = a.GetReflection();
+  const Reflection *rb = b.GetReflection();
+  bool repeated = field->is_repeated();
+#define VALUE_EQUALS(TYPE)                                      \
+  (repeated ? ra->GetRepeated##TYPE(a, field, index) ==         \
+                  rb->GetRepeated##TYPE(b, field, index) :      \
+              ra->Get##TYPE(a, field) == rb->Get##TYPE(b, field))
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      return VALUE_EQUALS(Int32);
+    case FieldDescriptor::CPPTYPE_INT64:
+      return VALUE_EQUALS(Int64);
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return VALUE_EQUALS(UInt32);
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return VALUE_EQUALS(UInt64);
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return VALUE_EQUALS(Double);
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return VALUE_EQUALS(Float);
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return VALUE_EQUALS(Bool);
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return VALUE_EQUALS(EnumValue);
+    case FieldDescriptor::CPPTYPE_STRING:
+      return VALUE_EQUALS(String);
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      // sub-messages are compared (and sent) as a whole
+      return repeated ?
+          ra->GetRepeatedMessage(a, field, index).SerializeAsString() ==
+              rb->GetRepeatedMessage(b, field, index).SerializeAsString() :
+          ra->GetMessage(a, field).SerializeAsString() ==
+              rb->GetMessage(b, field).SerializeAsString();
+  }
+#undef VALUE_EQUALS
+  return false;
+}
+
+// compares a field of two messages
+bool FieldEquals(const Message &a, const Message &b,
+                 const FieldDescriptor *field) {
+  const Reflection *ra = a.GetReflection();
+  const Reflection *rb = b.GetReflection();
+  if (field->is_repeated()) {
+    int size = ra->FieldSize(a, field);
+    if (size != rb->FieldSize(b, field))
+      return false;
+    for (int i = 0; i < size; ++i) {
+      if (!ValueEquals(a, b, field, i))
+        return false;
+    }
+    return true;
+  }
+  if (ra->HasField(a, field) != rb->HasField(b, field))
+    return false;
+  return !ra->HasField(a, field) || ValueEquals(a, b, field, -1);
+}
+
+}  // namespace
+
+void DeltaEncode(const Message &base, const Message &msg,
+                 std::vector<int> *fields, Message *diff) {
+  fields->clear();
+  diff->CopyFrom(msg);
+  const Descriptor *descriptor = msg.GetDescriptor();
+  const Reflection *reflection = diff->GetReflection();
+  for (int i = 0; i < descriptor->field_count(); ++i) {
+    const FieldDescriptor *field = descriptor->field(i);
+    if (FieldEquals(base, msg, field))
+      reflection->ClearField(diff, field);
+    else
+      fields->push_back(field->number());
+  }
+  // the receiver keeps the unknown fields of the base
+  reflection->MutableUnknownFields(diff)->Clear();
+}
+
+void DeltaApply(const std::vector<int> &fields, const Message &diff,
+                Message *base) {
+  const Descriptor *descriptor = base->GetDescriptor();
+  const Reflection *reflection = base->GetReflection();
+  for (int number : fields) {
+    const FieldDescriptor *field = descriptor->FindFieldByNumber(number);
+    if (field != nullptr)
+      reflection->ClearField(base, field);
+  }
+  base->MergeFrom(diff);
+}
+
+}  // namespace libgep_utils
@@ -0,0 +1,28 @@
+// Copyright Google Inc. Apache 2.0.
+
+// Field-level deltas between protobuf messages (full builds only, as it
+// needs protobuf reflection).
+
+#ifndef _SRC_DELTA_ENCODING_H_
+#define _SRC_DELTA_ENCODING_H_
+
+#include <google/protobuf/message.h>  // for Message
+#include <vector>  // for vector
+
+namespace libgep_utils {
+
+// Computes the delta from base to msg (both of the same type). fields gets
+// the numbers of the (top-level) fields that differ, including the ones
+// cleared in msg, and diff gets msg without the fields that are equal.
+void DeltaEncode(const google::protobuf::Message &base,
+                 const google::protobuf::Message &msg,
+                 std::vector<int> *fields, google::protobuf::Message *diff);
+
+// Applies a delta to base: clears the changed fields and merges the diff.
+void DeltaApply(const std::vector<int> &fields,
+                const google::protobuf::Message &diff,
+                google::protobuf::Message *base);
+
+}  // namespace libgep_utils
+
+#endif  // _SRC_DELTA_ENCODING_H_
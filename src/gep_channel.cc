@@ -13,22 +13,98 @@
 
 #include "gep_channel.h"
 
+#include <algorithm>  // for max, min, stable_sort
+#include <atomic>
+#include <chrono>  // for microseconds
+#include <deque>
 #include <errno.h>  // for errno, ECONNRESET
+#include <fcntl.h>  // for fcntl, F_ADD_SEALS, etc
 #include <inttypes.h>
+#include <limits.h>  // for INT_MAX
 #include <map>  // for _Rb_tree_const_iterator
+#include <memory>  // for shared_ptr, unique_ptr
 #include <mutex>
 #include <netinet/in.h>  // for sockaddr_in, htonl, htons, etc
 #include <string.h>  // for memmove
+#include <sys/mman.h>  // for memfd_create, mmap, munmap
 #include <sys/socket.h>  // for AF_INET, connect, recv, etc
+#include <sys/stat.h>  // for fstat
+#include <thread>  // for hardware_concurrency
 #include <unistd.h>  // for close, usleep
 #include <utility>  // for pair
 
 #include "gep_common.h"  // for GepProtobufMessage
+#ifndef GEP_LITE
+#include "delta_encoding.h"  // for DeltaEncode, DeltaApply
+#endif
+#include "shm_transport.h"  // for ShmTransport
 #include "socket_interface.h"  // for SocketInterface
-#include "utils.h"  // for snprintf_printable
+#include "utils.h"  // for Crc32c, snprintf_printable
 
 using namespace libgep_utils;
 
+namespace {
+
+#ifndef GEP_LITE
+// delta-encoded message header: tag, flags, seq, base_seq, and key length
+const int kDeltaHdrLen = 20;
+// delta-encoded message flags
+const uint32_t kDeltaKeyframe = 1;
+#endif
+
+// header of a message in a batch: tag and length
+const int kBatchItemHdrLen = 8;
+
+// shared memory negotiation operations: The client offers a segment, and
+// the server accepts it (and switches to it) or rejects it. After an
+// accept, the client switches to it too.
+const uint8_t kShmOffer = 1;
+const uint8_t kShmAccept = 2;
+const uint8_t kShmReject = 3;
+const uint8_t kShmSwitch = 4;
+const uint8_t kShmOfferLocal = 5;
+// prefix of the names of the shared memory segments (the server only maps
+// segments with it)
+const char kShmNamePrefix[] = "/gep.";
+// compact header negotiation operations: The client offers them, and the
+// server accepts them if it has them enabled (and ignores the offer
+// otherwise). After an accept, the client switches to them too.
+const uint8_t kHeaderOffer = 1;
+const uint8_t kHeaderAccept = 2;
+const uint8_t kHeaderSwitch = 3;
+// checksum negotiation operations (same as the compact header ones)
+const uint8_t kChecksumOffer = 1;
+const uint8_t kChecksumAccept = 2;
+const uint8_t kChecksumSwitch = 3;
+// descriptors passed by the peer and not taken by a frame yet (one per
+// memfd frame, which we parse as soon as it is complete)
+const size_t kMaxRecvFds = 16;
+// wait between polls of a full ring
+const int kShmPollUsec = 20;
+// time an emptied ring is polled before waiting for a wake-up
+const int64_t kShmPollingUsec = 50;
+// wait between polls of the socket queue of the bulk lane, and maximum
+// time a bulk chunk waits for it to drain
+const int kBulkPollUsec = 100;
+const int64_t kBulkWaitMs = 1000;
+// wait between polls of the zero-copy completions when closing, and
+// maximum time to wait for them
+const int kZeroCopyPollUsec = 100;
+const int64_t kZeroCopyCloseMs = 100;
+// maximum number of zero-copy buffers kept after their channel closed
+const size_t kMaxZeroCopyOrphans = 1024;
+
+// number of zero-copy buffers not completed when their channel closed
+std::atomic<int64_t> zerocopy_orphaned(0);
+
+void AppendUint32(std::string *s, uint32_t value) {
+  uint8_t buf[4];
+  SET_UINT32(buf, value);
+  s->append(reinterpret_cast<const char *>(buf), sizeof(buf));
+}
+
+}  // namespace
+
 GepChannel::GepChannel(int id, const std::string &name,
                        GepProtocol *proto, const GepVFT *ops,
                        void *context, int socket)
@@ -36,24 +112,61 @@ GepChannel::GepChannel(int id, const std::string &name,
       proto_(proto),
       ops_(ops),
       context_(context),
+      peer_tags_valid_(false),
       id_(id),
       socket_(socket),
-      len_(0) {
+      len_(0),
+      pending_tasks_(0),
+      send_timeouts_(0),
+      slow_(false),
+      recv_paused_until_usec_(0),
+      rate_limited_(0),
+      flow_msgs_(0),
+      flow_bytes_(0),
+      flow_dropped_(0),
+      credit_msgs_(0),
+      credit_bytes_(0),
+      recv_credit_len_(0),
+      shm_(nullptr),
+      shm_send_(false),
+      shm_recv_(false),
+      object_seq_(0),
+      recv_fd_(-1),
+      chunk_stream_id_(0),
+      control_waiting_(0),
+      resyncs_(0),
+      send_compact_(false),
+      recv_compact_(false),
+      send_checksum_(false),
+      recv_checksum_(false),
+      checksum_errors_(0),
+      out_flush_usec_(0),
+      out_frames_(0),
+      datagram_socket_(-1),
+      datagram_owned_(false),
+      datagram_addr_len_(0),
+      datagram_seq_(0),
+      datagram_next_seq_(0),
+      session_id_(0),
+      zerocopy_state_(0),
+      zerocopy_calls_(0),
+      zerocopy_done_(0) {
   socket_interface_ = new SocketInterface();
 }
 
 GepChannel::~GepChannel() {
+  WaitForTasks();
   Close();
+  delete shm_;
   delete socket_interface_;
 }
 
 
 int GepChannel::OpenClientSocket() {
-  int port = proto_->GetPort();
-
   // Open socket.
   int new_socket;
-  if ((new_socket = socket_interface_->Socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+  if ((new_socket = socket_interface_->Socket(proto_->GetDomain(),
+                                              SOCK_STREAM, 0)) == -1) {
     gep_log(LOG_ERROR,
             "%s(%i):Error-cannot open client socket",
             name_.c_str(), id_);
@@ -61,40 +174,569 @@ int GepChannel::OpenClientSocket() {
   }
 
   // Connect socket.
-  struct sockaddr_in saddr;
-  saddr.sin_family = AF_INET;
-  saddr.sin_port = htons(port);
-  // Use INADDR_LOOPBACK as server address to connect to the localhost.
-  //  You have to bind the server to the same INADDR_LOOPBACK address for
-  //  the latter to only accept calls from there.
-  saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  if (connect(new_socket, (struct sockaddr *)&saddr, sizeof(saddr)) < 0) {
+  struct sockaddr_storage saddr;
+  socklen_t saddr_len = proto_->GetSockAddr(&saddr);
+  if (saddr_len == 0 ||
+      connect(new_socket, (struct sockaddr *)&saddr, saddr_len) < 0) {
     gep_log(LOG_ERROR,
             "%s(%i):Error-cannot connect client socket %i",
             name_.c_str(), id_, new_socket);
     close(new_socket);
     return -1;
   }
+  // the header and the value are sent separately: avoid Nagle delays
+  if (!proto_->IsUnix())
+    socket_interface_->SetNoDelay(name_.c_str(), new_socket);
+  socket_interface_->SetPriority(name_.c_str(), new_socket,
+                                 proto_->GetSocketPriority());
+  {
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    socket_ = new_socket;
+    gep_log(LOG_DEBUG,
+            "%s(%i):open client socket %d",
+            name_.c_str(), id_, socket_);
+  }
+  // let the server know which messages we handle
+  SendInterest();
+  if (proto_->IsCompactHeader())
+    SendHeaderOp(kHeaderOffer, {});
+  if (proto_->IsChecksum())
+    SendChecksumOp(kChecksumOffer);
+  if (proto_->UsesDatagrams())
+    OpenDatagramSocket(saddr, saddr_len);
+  if (proto_->GetInProcessRingBytes() > 0)
+    OfferShm(true);
+  else if (proto_->GetShmRingBytes() > 0)
+    OfferShm(false);
+  return 0;
+}
+
+int GepChannel::Close() {
+  // sessions have no socket, but a new connection needs a new state too
+  if (socket_ != -1 || parent_) {
+    for (const auto &session : GetSessions())
+      session->Close();
+    {
+      // a new peer needs keyframes
+      std::lock_guard<std::mutex> delta_lock_guard(delta_sent_lock_);
+      delta_sent_.clear();
+    }
+    delta_recv_.clear();
+    chunks_.clear();
+    {
+      std::lock_guard<std::mutex> datagram_lock_guard(datagram_lock_);
+      if (datagram_owned_)
+        close(datagram_socket_);
+      datagram_socket_ = -1;
+      datagram_owned_ = false;
+      datagram_seq_ = 0;
+      datagram_next_seq_ = 0;
+      datagram_stats_ = GepDatagramStats();
+    }
+    {
+      // a new peer starts with a full window
+      std::lock_guard<std::mutex> credit_lock_guard(credit_lock_);
+      credit_msgs_ = 0;
+      credit_bytes_ = 0;
+    }
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    flow_msgs_ = 0;
+    flow_bytes_ = 0;
+    if (!flow_queue_.empty()) {
+      gep_log(LOG_WARNING,
+              "%s:close(%i):Dropping %zu messages waiting for credits",
+              name_.c_str(), id_, flow_queue_.size());
+      flow_dropped_ += flow_queue_.size();
+    }
+    flow_queue_.clear();
+    for (int fd : flow_fds_)
+      close(fd);
+    flow_fds_.clear();
+    for (const auto &entry : recv_fds_)
+      close(entry.second);
+    recv_fds_.clear();
+    delete shm_;
+    shm_ = nullptr;
+    shm_send_ = false;
+    shm_recv_ = false;
+    send_compact_ = false;
+    send_tag_index_.clear();
+    recv_compact_ = false;
+    recv_tags_.clear();
+    send_checksum_ = false;
+    recv_checksum_ = false;
+    if (out_frames_ > 0) {
+      gep_log(LOG_WARNING,
+              "%s:close(%i):Dropping %d coalesced messages",
+              name_.c_str(), id_, out_frames_);
+      flow_dropped_ += out_frames_;
+    }
+    out_buf_.clear();
+    out_frames_ = 0;
+    // the kernel may still read the zero-copy buffers after close()
+    DrainZeroCopy();
+    zerocopy_state_ = 0;
+    zerocopy_calls_ = 0;
+    zerocopy_done_ = 0;
+    zerocopy_ranges_.clear();
+    zerocopy_bufs_.clear();
+    if (socket_ != -1) {
+      gep_log(LOG_DEBUG,
+              "%s(%i):closed socket %d",
+              name_.c_str(), id_, socket_);
+      close(socket_);
+      socket_ = -1;
+    }
+    len_ = 0;
+    recv_paused_until_usec_ = 0;
+    // a new peer may handle a different set of tags
+    std::lock_guard<std::mutex> peer_tags_lock_guard(peer_tags_lock_);
+    peer_tags_valid_ = false;
+    peer_tags_.clear();
+    return 0;
+  }
+  return -1;
+}
+
+int GepChannel::Shutdown() {
   std::lock_guard<std::mutex> lock_guard(socket_lock_);
-  socket_ = new_socket;
+  if (socket_ == -1)
+    return -1;
   gep_log(LOG_DEBUG,
-          "%s(%i):open client socket %d",
+          "%s(%i):shut down socket %d",
           name_.c_str(), id_, socket_);
-  return 0;
+  return shutdown(socket_, SHUT_RDWR);
 }
 
-int GepChannel::Close() {
-  if (socket_ != -1) {
+void GepChannel::SetSlowConsumerPolicy(const GepSlowConsumerPolicy &policy) {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  slow_policy_ = policy;
+  send_timeouts_ = 0;
+  slow_ = false;
+}
+
+int GepChannel::GetQueuedBytes() {
+  if (parent_)
+    return parent_->GetQueuedBytes();
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return GetQueuedBytesLocked();
+}
+
+int GepChannel::GetQueuedBytesLocked() {
+  if (shm_send_)
+    return shm_->GetWriteQueued();
+  int bytes;
+  if (socket_interface_->GetSendQueueSize(name_.c_str(), socket_, &bytes) < 0)
+    return -1;
+  // (including the coalesced frames)
+  return bytes + out_buf_.length();
+}
+
+bool GepChannel::IsSharedMemory() {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return shm_send_ && shm_recv_;
+}
+
+bool GepChannel::IsCompactHeader() {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return send_compact_;
+}
+
+void GepChannel::SetParent(const std::shared_ptr<GepChannel> &parent,
+                           uint32_t session) {
+  parent_ = parent;
+  session_id_ = session;
+}
+
+void GepChannel::AddSession(uint32_t session,
+                            const std::shared_ptr<GepChannel> &channel) {
+  std::lock_guard<std::mutex> lock_guard(sessions_lock_);
+  sessions_[session] = channel;
+}
+
+void GepChannel::DelSession(uint32_t session) {
+  std::lock_guard<std::mutex> lock_guard(sessions_lock_);
+  sessions_.erase(session);
+}
+
+std::shared_ptr<GepChannel> GepChannel::GetSession(uint32_t session) {
+  std::lock_guard<std::mutex> lock_guard(sessions_lock_);
+  auto iter = sessions_.find(session);
+  return iter != sessions_.end() ? iter->second.lock() : nullptr;
+}
+
+std::vector<std::shared_ptr<GepChannel>> GepChannel::GetSessions() {
+  std::vector<std::shared_ptr<GepChannel>> sessions;
+  std::lock_guard<std::mutex> lock_guard(sessions_lock_);
+  for (const auto &entry : sessions_) {
+    std::shared_ptr<GepChannel> session = entry.second.lock();
+    if (session)
+      sessions.push_back(session);
+  }
+  return sessions;
+}
+
+GepChannel::Result GepChannel::RecvSessionMsg(int value_len,
+                                              const uint8_t *value) {
+  if (value_len < 8) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid session message (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  uint32_t session_id = UINT32(value);
+  std::shared_ptr<GepChannel> session = GetSession(session_id);
+  if (!session) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Message for unknown session %" PRIu32,
+            name_.c_str(), id_, session_id);
+    return CMD_DROPPED;
+  }
+  // the session takes over the credits of the frame if it posts the
+  // message to an executor
+  session->recv_credit_len_ = recv_credit_len_;
+  Result ret = session->RecvTLV(UINT32(value + 4), value_len - 8, value + 8);
+  recv_credit_len_ = session->recv_credit_len_;
+  session->recv_credit_len_ = 0;
+  return ret;
+}
+
+bool GepChannel::IsInProcess() {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return shm_send_ && shm_recv_ && shm_->IsLocal();
+}
+
+int GepChannel::OfferShm(bool local) {
+  ShmTransport *shm;
+  if (local) {
+    shm = ShmTransport::CreateLocal(proto_->GetInProcessRingBytes());
+  } else {
+    // the name only needs to be unique in the host
+    static std::atomic<int> num_segments(0);
+    std::string name = kShmNamePrefix + std::to_string(getpid()) + "." +
+        std::to_string(num_segments++);
+    shm = ShmTransport::Create(name, proto_->GetShmRingBytes());
+  }
+  if (shm == nullptr) {
+    gep_log(LOG_WARNING,
+            "%s(%i):cannot create shared memory segment, using the socket",
+            name_.c_str(), id_);
+    return -1;
+  }
+  std::string value(1, local ? kShmOfferLocal : kShmOffer);
+  AppendUint32(&value, shm->GetRingBytes());
+  value.append(shm->GetName());
+  {
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    delete shm_;
+    shm_ = shm;
+  }
+  return SendString(GepProtocol::kTagShm, value);
+}
+
+GepChannel::Result GepChannel::RecvShm(int value_len, const uint8_t *value) {
+  uint8_t op = value_len >= 1 ? value[0] : 0;
+  if ((op == kShmOffer || op == kShmOfferLocal) && value_len > 5) {
+    std::string name((const char *)value + 5, (size_t)value_len - 5);
+    uint32_t ring_bytes = UINT32(value + 1);
+    ShmTransport *shm = nullptr;
+    if (op == kShmOfferLocal && proto_->GetInProcessRingBytes() > 0) {
+      shm = ShmTransport::OpenLocal(name, ring_bytes);
+    } else if (op == kShmOffer && proto_->GetShmRingBytes() > 0) {
+      // only map segments created by the library, and no larger than ours
+      if (name.compare(0, strlen(kShmNamePrefix), kShmNamePrefix) != 0 ||
+          name.find('/', 1) != std::string::npos) {
+        gep_log(LOG_WARNING,
+                "%s(%i):rejecting shared memory segment %s",
+                name_.c_str(), id_, name.c_str());
+      } else {
+        shm = ShmTransport::Open(name, ring_bytes, proto_->GetShmRingBytes());
+      }
+      // the segment is mapped now, and must not outlive the peer
+      if (shm != nullptr)
+        shm->Unlink();
+    }
+    uint8_t reply = shm != nullptr ? kShmAccept : kShmReject;
+    // the accept is the last message sent through the socket
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    if (SendTLVLocked(GepProtocol::kTagShm, sizeof(reply),
+                      (const char *)&reply) < 0) {
+      delete shm;
+      return CMD_ERROR;
+    }
+    if (shm != nullptr) {
+      gep_log(LOG_DEBUG,
+              "%s(%i):using shared memory segment %s",
+              name_.c_str(), id_, name.c_str());
+      delete shm_;
+      shm_ = shm;
+      shm_send_ = true;
+    }
+    return CMD_OK;
+  }
+  if (op == kShmAccept) {
     std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    if (shm_ == nullptr)
+      return CMD_ERROR;
     gep_log(LOG_DEBUG,
-            "%s(%i):closed socket %d",
+            "%s(%i):using shared memory segment %s",
+            name_.c_str(), id_, shm_->GetName().c_str());
+    // both sides have it mapped already (the server unlinks it as well)
+    shm_->Unlink();
+    shm_recv_ = true;
+    uint8_t reply = kShmSwitch;
+    if (SendTLVLocked(GepProtocol::kTagShm, sizeof(reply),
+                      (const char *)&reply) < 0)
+      return CMD_ERROR;
+    shm_send_ = true;
+    return CMD_OK;
+  }
+  if (op == kShmReject) {
+    bool local;
+    {
+      std::lock_guard<std::mutex> lock_guard(socket_lock_);
+      if (shm_ == nullptr)
+        return CMD_ERROR;
+      local = shm_->IsLocal();
+      delete shm_;
+      shm_ = nullptr;
+    }
+    // a server in another process may still take shared memory
+    if (local && proto_->GetShmRingBytes() > 0) {
+      gep_log(LOG_DEBUG,
+              "%s(%i):peer is not in process, offering shared memory",
+              name_.c_str(), id_);
+      return OfferShm(false) < 0 ? CMD_ERROR : CMD_OK;
+    }
+    gep_log(LOG_WARNING,
+            "%s(%i):peer rejected shared memory, using the socket",
+            name_.c_str(), id_);
+    return CMD_OK;
+  }
+  if (op == kShmSwitch) {
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    if (shm_ == nullptr)
+      return CMD_ERROR;
+    shm_recv_ = true;
+    return CMD_OK;
+  }
+  gep_log(LOG_ERROR,
+          "%s:recv(%i):Error-Invalid shared memory message (%d bytes)",
+          name_.c_str(), id_, value_len);
+  return CMD_ERROR;
+}
+
+void GepChannel::SetRateLimitPolicy(const GepRateLimitPolicy &policy) {
+  std::lock_guard<std::mutex> lock_guard(rate_lock_);
+  rate_policy_ = policy;
+  rate_channel_ = RateBuckets();
+  rate_tags_.clear();
+}
+
+int64_t GepChannel::RefillBuckets(const GepRateLimit &limit,
+                                  int64_t now_usec, int msg_len,
+                                  RateBuckets *buckets) {
+  // new buckets start full
+  double elapsed_secs = buckets->last_usec == 0 ? 1.0 :
+      (now_usec - buckets->last_usec) / (double)kUsecsPerSec;
+  buckets->last_usec = now_usec;
+  int64_t wait_usec = 0;
+  // a message larger than the buckets only needs them full (and takes
+  // them below zero)
+  if (limit.max_msgs_per_sec > 0) {
+    double size = std::max(limit.max_msgs_per_sec, 1.0);
+    buckets->msgs = std::min(size,
+        buckets->msgs + limit.max_msgs_per_sec * elapsed_secs);
+    if (buckets->msgs < 1)
+      wait_usec = 1 + (int64_t)((1 - buckets->msgs) * kUsecsPerSec /
+                                limit.max_msgs_per_sec);
+  }
+  if (limit.max_bytes_per_sec > 0) {
+    double size = std::max(limit.max_bytes_per_sec, 1.0);
+    double needed = std::min((double)msg_len, size);
+    buckets->bytes = std::min(size,
+        buckets->bytes + limit.max_bytes_per_sec * elapsed_secs);
+    if (buckets->bytes < needed)
+      wait_usec = std::max(wait_usec, 1 + (int64_t)(
+          (needed - buckets->bytes) * kUsecsPerSec / limit.max_bytes_per_sec));
+  }
+  return wait_usec;
+}
+
+int64_t GepChannel::CheckRateLimit(uint32_t tag, int msg_len,
+                                   GepRateLimitPolicy::Action *action,
+                                   bool pause_after) {
+  std::lock_guard<std::mutex> lock_guard(rate_lock_);
+  if (!rate_policy_.IsEnabled())
+    return 0;
+  *action = rate_policy_.action;
+  int64_t now_usec = GetMonotonicTimeUsec();
+  int64_t wait_usec = RefillBuckets(rate_policy_.channel, now_usec, msg_len,
+                                    &rate_channel_);
+  RateBuckets *tag_buckets = nullptr;
+  auto iter = rate_policy_.tags.find(tag);
+  if (iter != rate_policy_.tags.end()) {
+    tag_buckets = &rate_tags_[tag];
+    wait_usec = std::max(wait_usec, RefillBuckets(iter->second, now_usec,
+                                                  msg_len, tag_buckets));
+  }
+  if (wait_usec > 0 &&
+      (!pause_after || *action != GepRateLimitPolicy::ACTION_PAUSE))
+    return wait_usec;
+  rate_channel_.msgs -= 1;
+  rate_channel_.bytes -= msg_len;
+  if (tag_buckets != nullptr) {
+    tag_buckets->msgs -= 1;
+    tag_buckets->bytes -= msg_len;
+  }
+  return wait_usec;
+}
+
+int64_t GepChannel::GetRecvPausedUsec() {
+  int64_t paused_until_usec = recv_paused_until_usec_;
+  if (paused_until_usec == 0)
+    return 0;
+  return std::max((int64_t)0, paused_until_usec - GetMonotonicTimeUsec());
+}
+
+int GepChannel::ResumeRecv() {
+  if (!IsRecvPaused() || GetRecvPausedUsec() > 0)
+    return 0;
+  recv_paused_until_usec_ = 0;
+  gep_log(LOG_DEBUG,
+          "%s(%i):resuming recv (%d bytes buffered)",
+          name_.c_str(), id_, len_);
+  if (RecvString() == CMD_ERROR) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Incorrect data received on socket %d",
             name_.c_str(), id_, socket_);
-    close(socket_);
-    socket_ = -1;
-    len_ = 0;
+    return -1;
+  }
+  // the peer does not wake us up for the data left in the ring
+  if (shm_recv_ && !IsRecvPaused() && RecvShmData() < 0)
+    return -1;
+  return 0;
+}
+
+bool GepChannel::CheckSlow() {
+  if (!slow_)
+    return false;
+  int bytes = GetQueuedBytes();
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  // use some hysteresis to avoid flapping around the threshold
+  if (bytes < 0 || bytes > slow_policy_.max_queued_bytes / 2)
+    return true;
+  gep_log(LOG_DEBUG,
+          "%s(%i):channel recovered (%d queued bytes)",
+          name_.c_str(), id_, bytes);
+  send_timeouts_ = 0;
+  slow_ = false;
+  return false;
+}
+
+void GepChannel::UpdateSlow(int64_t send_latency_usec) {
+  if (slow_)
+    return;
+  const char *reason = nullptr;
+  if (slow_policy_.max_send_timeouts > 0 &&
+      send_timeouts_ >= slow_policy_.max_send_timeouts) {
+    reason = "send timeouts";
+  } else if (slow_policy_.max_send_latency_usec > 0 &&
+             send_latency_usec > slow_policy_.max_send_latency_usec) {
+    reason = "send latency";
+  } else if (slow_policy_.max_queued_bytes > 0 &&
+             GetQueuedBytesLocked() > slow_policy_.max_queued_bytes) {
+    reason = "queued bytes";
+  }
+  if (reason != nullptr) {
+    gep_log(LOG_WARNING,
+            "%s(%i):slow consumer detected (%s)",
+            name_.c_str(), id_, reason);
+    slow_ = true;
+  }
+}
+
+void GepChannel::Conflate(uint32_t tag, const std::string &key,
+                          const std::string &s) {
+  std::lock_guard<std::mutex> lock_guard(conflated_lock_);
+  conflated_[std::make_pair(tag, key)] = s;
+}
+
+int GepChannel::SendConflated(uint32_t tag, const std::string &key,
+                              const std::string &s) {
+  Conflate(tag, key, s);
+  // otherwise the socket controller writes them once the socket has room
+  // (that of the parent for sessions, which flushes them with its own)
+  GepChannel *connection = parent_ ? parent_.get() : this;
+  int socket = connection->GetSocket();
+  if (connection->slow_ || socket < 0 ||
+      !connection->socket_interface_->IsWritable(socket))
     return 0;
+  return FlushConflated();
+}
+
+int GepChannel::FlushConflated() {
+  {
+    // a concurrent flush could send an older value after a newer one
+    std::lock_guard<std::mutex> flush_lock_guard(conflated_flush_lock_);
+    std::map<std::pair<uint32_t, std::string>, std::string> conflated;
+    {
+      std::lock_guard<std::mutex> lock_guard(conflated_lock_);
+      conflated.swap(conflated_);
+    }
+    for (auto iter = conflated.begin(); iter != conflated.end(); ++iter) {
+      if (SendString(iter->first.first, iter->second) != 0) {
+        // keep the messages not sent (including this one), unless they
+        // have been overwritten
+        std::lock_guard<std::mutex> lock_guard(conflated_lock_);
+        conflated_.insert(iter, conflated.end());
+        return -1;
+      }
+    }
   }
-  return -1;
+  // sessions have no socket to wait for: they go with their connection
+  for (const auto &session : GetSessions()) {
+    if (session->FlushConflated() < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int GepChannel::GetNumConflated() {
+  std::lock_guard<std::mutex> lock_guard(conflated_lock_);
+  return conflated_.size();
+}
+
+bool GepChannel::HasPendingData() {
+  if (slow_)
+    return false;
+  {
+    std::lock_guard<std::mutex> lock_guard(conflated_lock_);
+    if (!conflated_.empty())
+      return true;
+  }
+  for (const auto &session : GetSessions()) {
+    if (session->HasPendingData())
+      return true;
+  }
+  return false;
+}
+
+int GepChannel::SendInterest() {
+  std::string value;
+  for (const auto &entry : *ops_) {
+    uint8_t tag[4];
+    SET_UINT32(tag, entry.first);
+    value.append(reinterpret_cast<const char *>(tag), sizeof(tag));
+  }
+  return SendString(GepProtocol::kTagInterest, value);
+}
+
+bool GepChannel::IsInterested(uint32_t tag) {
+  if (GepProtocol::IsControlTag(tag))
+    return true;
+  std::lock_guard<std::mutex> lock_guard(peer_tags_lock_);
+  return !peer_tags_valid_ || peer_tags_.count(tag) > 0;
 }
 
 int GepChannel::GetSocket() {
@@ -108,6 +750,8 @@ void GepChannel::SetSocket(int socket) {
 }
 
 bool GepChannel::IsOpenSocket() {
+  if (parent_)
+    return parent_->IsOpenSocket();
   std::lock_guard<std::mutex> lock_guard(socket_lock_);
   return socket_ != -1;
 }
@@ -128,14 +772,46 @@ int GepChannel::RecvData() {
     return -1;
   }
 
+  if (shm_recv_)
+    return RecvShmData();
+
   // read new data from command socket and append to any leftover one
   socket_lock_.lock();
-  int bytes = socket_interface_->Recv(socket_, buf_ + len_,
-                                      sizeof(buf_) - len_, 0);
+  // the socket is also readable when the kernel reports zero-copy
+  // completions, which may come without data
+  int flags = 0;
+  if (zerocopy_state_ > 0) {
+    ReapZeroCopy();
+    flags = MSG_DONTWAIT;
+  }
+  // Unix domain sockets may carry descriptors (see SendMemfd()), which
+  // we only take when we use memfds ourselves (the kernel closes them
+  // otherwise)
+  std::deque<int> fds;
+  int bytes = proto_->IsUnix() && proto_->GetMemfdThreshold() > 0 ?
+      socket_interface_->RecvFds(socket_, buf_ + len_, sizeof(buf_) - len_,
+                                 flags, &fds) :
+      socket_interface_->Recv(socket_, buf_ + len_, sizeof(buf_) - len_,
+                              flags);
   socket_lock_.unlock();
+  // (they come with the first byte of the frame that carries them)
+  for (int fd : fds) {
+    if (bytes > 0)
+      recv_fds_.emplace_back(len_, fd);
+    else
+      close(fd);
+  }
+  if (recv_fds_.size() > kMaxRecvFds) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Too many descriptors passed on socket %d",
+            name_.c_str(), id_, socket_);
+    return -1;
+  }
 
   // TODO(chema): support EAGAIN and EWOULDBLOCK
-  if (bytes > 0) {
+  if (bytes < 0 && flags != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  } else if (bytes > 0) {
     len_ += bytes;
     if (RecvString() == CMD_ERROR) {
       gep_log(LOG_ERROR,
@@ -143,6 +819,9 @@ int GepChannel::RecvData() {
               name_.c_str(), id_, socket_);
       return -1;
     }
+    // the peer may have sent data to the ring after switching to it
+    if (shm_recv_)
+      return RecvShmData();
   } else if (bytes == 0) {
     gep_log(LOG_DEBUG,
             "%s:recv(%i):socket %d was closed by peer",
@@ -156,13 +835,239 @@ int GepChannel::RecvData() {
   return 0;
 }
 
-int GepChannel::SendData(const char *buf, int bytes) {
-  int sent = socket_interface_->FullSend(socket_, (const uint8_t *)buf, bytes,
-                                         kGepSendTimeoutMs);
+int GepChannel::RecvShmData() {
+  // The socket only carries wake-ups now: drain them, and check whether
+  // the peer closed the connection.
+  uint8_t wakeups[256];
+  socket_lock_.lock();
+  int bytes = socket_interface_->Recv(socket_, wakeups, sizeof(wakeups),
+                                      MSG_DONTWAIT);
+  socket_lock_.unlock();
+  if (bytes == 0) {
+    gep_log(LOG_DEBUG,
+            "%s:recv(%i):socket %d was closed by peer",
+            name_.c_str(), id_, socket_);
+    return -2;
+  } else if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    gep_perror(errno, "%s:recv(%i):Error-recv() failed on socket %d:",
+                 name_.c_str(), id_, socket_);
+    return -1;
+  }
+
+  // The peer only wakes us up once we have emptied the ring. Keep polling
+  // it for a while before that, so back-to-back messages need no wake-ups.
+  // A busy peer would keep us here forever, though: after a ring's worth
+  // of data, pause the recv until the next service loop (which resumes
+  // it with ResumeRecv()), so the other channels get their turn.
+  int64_t poll_until_usec = 0;
+  int64_t drained = 0;
+  int ret = 0;
+  while (!IsRecvPaused()) {
+    if (shm_ != nullptr && drained >= shm_->GetRingBytes()) {
+      recv_paused_until_usec_ = GetMonotonicTimeUsec();
+      break;
+    }
+    if (len_ >= sizeof(buf_)) {
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-buf_ full (%i/%zu)",
+              name_.c_str(), id_, len_, sizeof(buf_));
+      ret = -1;
+      break;
+    }
+    // no lock: shm_ only changes in the recv thread (or once it stops)
+    if (shm_ == nullptr) {
+      ret = -1;
+      break;
+    }
+    bytes = shm_->Read(buf_ + len_, sizeof(buf_) - len_);
+    if (bytes == 0) {
+      // polling a single CPU would only delay the peer
+      static const int64_t polling_usec =
+          std::thread::hardware_concurrency() > 1 ? kShmPollingUsec : 0;
+      int64_t now_usec = GetMonotonicTimeUsec();
+      if (poll_until_usec == 0)
+        poll_until_usec = now_usec + polling_usec;
+      bool polling = now_usec < poll_until_usec;
+      shm_->SetPolling(polling);
+      if (polling)
+        continue;
+      // the peer may have skipped the wake-up while we were polling
+      bytes = shm_->Read(buf_ + len_, sizeof(buf_) - len_);
+      if (bytes == 0)
+        break;
+    }
+    if (bytes < 0) {
+      ret = -1;
+      break;
+    }
+    poll_until_usec = 0;
+    drained += bytes;
+    len_ += bytes;
+    if (RecvString() == CMD_ERROR) {
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-Incorrect data received on shared memory",
+              name_.c_str(), id_);
+      ret = -1;
+      break;
+    }
+  }
+  // the peer must wake us up from now on
+  if (shm_ != nullptr)
+    shm_->SetPolling(false);
+  return ret;
+}
+
+int GepChannel::SendZeroCopy(const char *buf, int bytes,
+                             const std::shared_ptr<const std::string> &owner) {
+  if (zerocopy_state_ == 0) {
+    // only TCP sockets support it
+    zerocopy_state_ = !proto_->IsUnix() &&
+        socket_interface_->SetZeroCopy(name_.c_str(), socket_) == 0 ? 1 : -1;
+  }
+  if (zerocopy_state_ > 0)
+    ReapZeroCopy();
+  // do not pin more memory while the kernel is behind
+  if (zerocopy_state_ < 0 || zerocopy_bufs_.size() >= kMaxZeroCopyBufs)
+    return socket_interface_->FullSend(socket_, (const uint8_t *)buf, bytes,
+                                       kGepSendTimeoutMs);
+
+  uint32_t calls = 0;
+  int sent = socket_interface_->FullSendZeroCopy(
+      socket_, (const uint8_t *)buf, bytes, kGepSendTimeoutMs, &calls);
+  if (calls > 0) {
+    zerocopy_calls_ += calls;
+    zerocopy_bufs_.emplace_back(zerocopy_calls_, owner);
+  }
+  return sent;
+}
+
+void GepChannel::ReapZeroCopy() {
+  int ret = socket_interface_->RecvZeroCopyCompletions(
+      socket_, [this](uint32_t first, uint32_t last, bool copied) {
+        if (copied)
+          gep_log(LOG_DEBUG,
+                  "%s:send(%i):kernel copied zero-copy sends %" PRIu32
+                  "-%" PRIu32, name_.c_str(), id_, first, last);
+        zerocopy_ranges_[first] = last;
+      });
+  if (ret < 0) {
+    gep_perror(errno, "%s:send(%i):Error-cannot read zero-copy completions-",
+               name_.c_str(), id_);
+    return;
+  }
+  // completions usually come in order, but may not
+  auto iter = zerocopy_ranges_.begin();
+  while (iter != zerocopy_ranges_.end() &&
+         (int32_t)(iter->first - zerocopy_done_) <= 0) {
+    if ((int32_t)(iter->second + 1 - zerocopy_done_) > 0)
+      zerocopy_done_ = iter->second + 1;
+    iter = zerocopy_ranges_.erase(iter);
+  }
+  while (!zerocopy_bufs_.empty() &&
+         (int32_t)(zerocopy_done_ - zerocopy_bufs_.front().first) >= 0)
+    zerocopy_bufs_.pop_front();
+}
+
+void GepChannel::DrainZeroCopy() {
+  int64_t max_usec = GetMonotonicTimeUsec() +
+      msecs_to_usecs(kZeroCopyCloseMs);
+  while (!zerocopy_bufs_.empty() && socket_ != -1) {
+    ReapZeroCopy();
+    if (zerocopy_bufs_.empty() || GetMonotonicTimeUsec() >= max_usec)
+      break;
+    usleep(kZeroCopyPollUsec);
+  }
+  if (zerocopy_bufs_.empty())
+    return;
+  // the pages are still pinned for the socket: reusing them could put
+  // other data on the wire. The closed socket reports no completions, so
+  // only the oldest buffers (most likely sent by now) are freed to keep
+  // the memory bounded
+  gep_log(LOG_WARNING,
+          "%s(%i):keeping %zu zero-copy buffers not completed at close",
+          name_.c_str(), id_, zerocopy_bufs_.size());
+  zerocopy_orphaned += zerocopy_bufs_.size();
+  static std::mutex orphans_lock;
+  static auto *orphans = new std::deque<std::shared_ptr<const std::string>>();
+  std::lock_guard<std::mutex> orphans_lock_guard(orphans_lock);
+  for (auto &entry : zerocopy_bufs_)
+    orphans->push_back(std::move(entry.second));
+  zerocopy_bufs_.clear();
+  while (orphans->size() > kMaxZeroCopyOrphans)
+    orphans->pop_front();
+}
+
+int64_t GepChannel::GetNumZeroCopyOrphaned() {
+  return zerocopy_orphaned;
+}
+
+int GepChannel::SendShmData(const char *buf, int bytes) {
+  int64_t start_usec = GetMonotonicTimeUsec();
+  int total_sent = 0;
+  while (total_sent < bytes) {
+    bool wake;
+    int count = shm_->Write(buf + total_sent, bytes - total_sent, &wake);
+    if (count < 0)
+      return -1;
+    total_sent += count;
+    if (wake) {
+      // a full socket means that the peer has wake-ups pending already
+      uint8_t wakeup = 0;
+      if (socket_interface_->Send(socket_, &wakeup, sizeof(wakeup),
+                                  MSG_DONTWAIT | MSG_NOSIGNAL) < 0 &&
+          errno != EAGAIN && errno != EWOULDBLOCK)
+        return -1;
+    }
+    if (total_sent >= bytes)
+      break;
+    // the ring is full: wait for the peer to read it
+    if (GetMonotonicTimeUsec() - start_usec > kGepSendTimeoutMs * 1000)
+      return 0;  // timed out
+    if (count == 0)
+      usleep(kShmPollUsec);
+  }
+  return total_sent;
+}
+
+int GepChannel::SendData(const char *buf, int bytes, int pass_fd,
+                         const std::shared_ptr<const std::string> &owner) {
+  // coalesce the plain socket writes
+  int coalesce_bytes = proto_->GetCoalesceBytes();
+  if (coalesce_bytes > 0 && !shm_send_ && !owner && pass_fd < 0) {
+    int64_t delay_usec = proto_->GetCoalesceDelayUsec();
+    int64_t now_usec = GetMonotonicTimeUsec();
+    if (out_buf_.empty())
+      out_flush_usec_ = now_usec + delay_usec;
+    out_buf_.append(buf, bytes);
+    if (out_buf_.length() < (size_t)coalesce_bytes &&
+        (delay_usec <= 0 || now_usec < out_flush_usec_))
+      return bytes;
+    return FlushLocked() < 0 ? -1 : bytes;
+  }
+  // the other writes go after the coalesced ones
+  if (!out_buf_.empty() && FlushLocked() < 0)
+    return -1;
+  return SendDataNow(buf, bytes, pass_fd, owner);
+}
+
+int GepChannel::SendDataNow(const char *buf, int bytes, int pass_fd,
+                            const std::shared_ptr<const std::string> &owner) {
+  int sent;
+  if (shm_send_)
+    sent = SendShmData(buf, bytes);
+  else if (owner)
+    sent = SendZeroCopy(buf, bytes, owner);
+  else if (pass_fd >= 0)
+    sent = socket_interface_->FullSendFd(socket_, (const uint8_t *)buf, bytes,
+                                         pass_fd, kGepSendTimeoutMs);
+  else
+    sent = socket_interface_->FullSend(socket_, (const uint8_t *)buf, bytes,
+                                       kGepSendTimeoutMs);
   if (sent == 0) {
     gep_log(LOG_DEBUG,
-            "%s:send(%i):socket %d was closed by peer",
+            "%s:send(%i):send timed out on socket %d",
             name_.c_str(), id_, socket_);
+    send_timeouts_++;
   } else if (sent == -2) {
     gep_log(LOG_DEBUG,
             "%s:send(%i):socket %d was closed by peer",
@@ -170,48 +1075,214 @@ int GepChannel::SendData(const char *buf, int bytes) {
   } else if (sent == -1) {
     gep_perror(errno, "%s:send(%d):Error-failed sending %d bytes on "
                "socket %d", name_.c_str(), id_, bytes, socket_);
+  } else if (sent == bytes) {
+    send_timeouts_ = 0;
   }
 
   // return the number of bytes sent
   return sent;
 }
 
+int GepChannel::FlushLocked() {
+  if (out_buf_.empty())
+    return 0;
+  std::string data;
+  data.swap(out_buf_);
+  int frames = out_frames_;
+  out_frames_ = 0;
+  // the frames go through the socket even after switching to shared memory
+  // (the switch itself may be one of them)
+  bool shm_send = shm_send_;
+  shm_send_ = false;
+  int sent = SendDataNow(data.data(), data.length(), -1, nullptr);
+  shm_send_ = shm_send;
+  if (sent != (int)data.length()) {
+    // (a timed-out write does not say how much of it went out, so the
+    // frames cannot be retried)
+    gep_log(LOG_ERROR,
+            "%s:send(%i):Error-Only flushed %d/%zu coalesced bytes, "
+            "dropping %d messages",
+            name_.c_str(), id_, sent, data.length(), frames);
+    flow_dropped_ += frames;
+    return -1;
+  }
+  return 0;
+}
+
+int GepChannel::Flush() {
+  // sessions send through the parent
+  if (parent_)
+    return parent_->Flush();
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return FlushLocked();
+}
+
+int GepChannel::FlushCoalesced() {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  if (out_buf_.empty() || proto_->GetCoalesceDelayUsec() <= 0 ||
+      GetMonotonicTimeUsec() < out_flush_usec_)
+    return 0;
+  return FlushLocked();
+}
+
 GepChannel::Result GepChannel::RecvString() {
-  while (len_ >= proto_->GetHdrLen()) {
+  // look for all the complete messages in the buffer
+  frames_.clear();
+  bool mixed_priorities = false;
+  bool error = false;
+  int offset = 0;
+  while (len_ - offset >= (recv_compact_ ? 1 : proto_->GetHdrLen())) {
+    uint8_t *hdr = buf_ + offset;
     uint32_t tag;
     uint32_t value_len;
-    if (!proto_->ScanHeader(buf_, &tag, &value_len)) {
+    int hdr_len = proto_->GetHdrLen();
+    if (recv_compact_) {
+      bool full_tag;
+      hdr_len = GepProtocol::ScanCompactHeader(hdr, len_ - offset, &full_tag,
+                                               &tag, &value_len);
+      if (hdr_len == 0)
+        break;  // wait for the rest of the header
+      if (hdr_len > 0 && !full_tag) {
+        // (the index of the tag in our table)
+        if (tag < recv_tags_.size())
+          tag = recv_tags_[tag];
+        else
+          hdr_len = -1;
+      }
+      if (hdr_len < 0) {
+        gep_log(LOG_ERROR,
+                "%s:recv(%i):Error-Invalid compact header",
+                name_.c_str(), id_);
+        error = true;
+        break;
+      }
+    } else if (!proto_->ScanHeader(hdr, &tag, &value_len)) {
       char tmp[4 * 4 + 1];
-      snprintf_printable(tmp, sizeof(tmp), buf_, 4);
+      snprintf_printable(tmp, sizeof(tmp), hdr, 4);
       gep_log(LOG_ERROR,
               "%s:recv(*):Error-Wrong magic number (%s)",
               name_.c_str(), tmp);
-      len_ = 0;
-      return CMD_ERROR;
+      if (Resync(&offset))
+        continue;
+      error = true;
+      break;
     }
 
     // ensure the value length is ok for GEP
-    if (value_len >= (GepProtocol::kMaxMsgLen - proto_->GetHdrLen())) {
+    uint32_t trailer_len = recv_checksum_ ? GepProtocol::kChecksumLen : 0;
+    if (value_len >=
+        (GepProtocol::kMaxMsgLen - proto_->GetHdrLen() - trailer_len)) {
       gep_log(LOG_ERROR,
               "%s:recv(%i):Error-Value length too large (%" PRIu32
               " >= %" PRIu32 ")",
               name_.c_str(), id_, value_len, GepProtocol::kMaxMsgLen);
-      len_ = 0;
-      return CMD_ERROR;
+      if (Resync(&offset))
+        continue;
+      error = true;
+      break;
     }
+    // (flow control and rate limits use the length of a full header)
     uint32_t msg_len = proto_->GetHdrLen() + value_len;
+    uint32_t frame_len = hdr_len + value_len + trailer_len;
 
     // process fragmented packets
-    if (len_ < msg_len) {
+    if (len_ - offset < frame_len) {
       // value is not complete in command buffer, wait for more
       gep_log(LOG_DEBUG,
               "%s:recv(%i):Command is fragmented (recv %i bytes)",
-              name_.c_str(), id_, len_);
-      return CMD_FRAGMENTED;
+              name_.c_str(), id_, len_ - offset);
+      break;
+    }
+
+    // check the frame before trusting any of it
+    if (trailer_len > 0 &&
+        Crc32c(0, hdr, hdr_len + value_len) != UINT32(hdr + frame_len - 4)) {
+      checksum_errors_++;
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-Wrong frame checksum (%" PRIu32 " bytes)",
+              name_.c_str(), id_, value_len);
+      if (Resync(&offset))
+        continue;
+      error = true;
+      break;
     }
 
     // receive the packet
-    uint8_t *value = buf_ + proto_->GetOffsetValue();
+    uint8_t *value = hdr + hdr_len;
+
+    // once the peer switches to shared memory, the rest of the socket data
+    // are wake-ups
+    bool shm_switch = tag == GepProtocol::kTagShm && !shm_recv_ &&
+        value_len >= 1 && (value[0] == kShmAccept || value[0] == kShmSwitch);
+    // and once it switches to compact headers, the rest of the frames use
+    // them
+    if (tag == GepProtocol::kTagHeader && !recv_compact_ &&
+        proto_->IsCompactHeader() && value_len >= 1 &&
+        (value[0] == kHeaderAccept || value[0] == kHeaderSwitch))
+      recv_compact_ = true;
+    // (and checksums)
+    if (tag == GepProtocol::kTagChecksum && !recv_checksum_ &&
+        proto_->IsChecksum() && value_len >= 1 &&
+        (value[0] == kChecksumAccept || value[0] == kChecksumSwitch))
+      recv_checksum_ = true;
+
+    // delta-encoded messages, message objects, memfd messages, chunks, and
+    // session frames count as the tag they carry for load shedding and
+    // rate limiting
+    uint32_t msg_tag = GetMessageTag(tag, value_len, value);
+    int priority = GetMessagePriority(tag, value_len, value, msg_tag);
+    // (while the messages of a batch count one by one)
+    int64_t batch_wait_usec = 0;
+    if (msg_tag == GepProtocol::kTagBatch) {
+      int batch_len = FilterBatch(tag, value_len, value, &priority,
+                                  &batch_wait_usec);
+      if (batch_len < 0) {
+        error = true;
+        break;
+      }
+      value_len = batch_len;
+    }
+
+    // shed low-priority messages (before unpacking them)
+    if (shed_callback_ && !GepProtocol::IsControlTag(msg_tag)) {
+      if (shed_callback_(msg_tag, priority)) {
+        DropPayload(tag, value_len, value);
+        GrantCredit(CarriesMessage(tag) ? msg_len : 0);
+        offset += frame_len;
+        continue;
+      }
+    }
+
+    // apply the inbound rate limits
+    GepRateLimitPolicy::Action action = GepRateLimitPolicy::ACTION_PAUSE;
+    int64_t wait_usec = GepProtocol::IsControlTag(msg_tag) ? 0 :
+        CheckRateLimit(msg_tag, msg_len, &action, false);
+    if (wait_usec > 0) {
+      rate_limited_++;
+      if (action == GepRateLimitPolicy::ACTION_PAUSE) {
+        // keep the rest of the data in the buffer until it fits
+        gep_log(LOG_DEBUG,
+                "%s:recv(%i):Over the rate limit, pausing for %" PRId64
+                " usecs",
+                name_.c_str(), id_, wait_usec);
+        recv_paused_until_usec_ = GetMonotonicTimeUsec() + wait_usec;
+        break;
+      } else if (action == GepRateLimitPolicy::ACTION_DROP) {
+        gep_log(LOG_DEBUG,
+                "%s:recv(%i):Over the rate limit, dropping message (%i bytes)",
+                name_.c_str(), id_, msg_len);
+        DropPayload(tag, value_len, value);
+        GrantCredit(CarriesMessage(tag) ? msg_len : 0);
+        offset += frame_len;
+        continue;
+      }
+      gep_log(LOG_WARNING,
+              "%s:recv(%i):Error-Over the rate limit, disconnecting",
+              name_.c_str(), id_);
+      error = true;
+      break;
+    }
+
     if (gep_log_get_level() >= LOG_DEBUG) {
       char tmp[value_len * 4 + 1];
       snprintf_printable(tmp, sizeof(tmp), value, value_len);
@@ -223,88 +1294,783 @@ GepChannel::Result GepChannel::RecvString() {
               tag_string, value_len, tmp);
     }
 
-    // unpack and recv the message
-    Result ret = RecvTLV(tag, value_len, value);
-    if (!IsRecoverable(ret))
-      return ret;
-
-    // process remaining data
-    int remain = len_ - msg_len;
-    if (remain) {
-      // copy left-over to the beginning of the buffer
-      memmove(buf_, buf_ + msg_len, remain);
+    // (frames carrying a message sort as its tag)
+    Frame frame = {tag, value_len, msg_len, static_cast<int>(value - buf_),
+                   priority, TakeRecvFd(tag, offset)};
+    if (!frames_.empty() && frame.priority != frames_.back().priority)
+      mixed_priorities = true;
+    frames_.push_back(frame);
+    offset += frame_len;
+    if (shm_switch) {
+      offset = len_;
+      break;
+    }
+    // (a batch over the rate limits pauses the frames after it)
+    if (batch_wait_usec > 0) {
       gep_log(LOG_DEBUG,
-              "%s:recv(%i):Fragmented command (left %d bytes)",
-              name_.c_str(), id_, len_);
+              "%s:recv(%i):Batch over the rate limit, pausing for %" PRId64
+              " usecs",
+              name_.c_str(), id_, batch_wait_usec);
+      recv_paused_until_usec_ = GetMonotonicTimeUsec() + batch_wait_usec;
+      break;
     }
-    len_ = remain;
   }
-  return len_ ? CMD_FRAGMENTED : CMD_OK;
-}
 
-int GepChannel::SendString(uint32_t tag, const std::string &s) {
-  // send the TLV
-  const char *value = s.c_str();
-  int value_len = s.length();
+  // run higher-priority messages first
+  if (mixed_priorities) {
+    std::stable_sort(frames_.begin(), frames_.end(),
+                     [](const Frame &a, const Frame &b) {
+                       return a.priority > b.priority;
+                     });
+  }
+
+  // unpack and recv the messages
+  for (int i = 0; i < frames_.size(); ++i) {
+    const Frame &frame = frames_[i];
+    recv_credit_len_ = CarriesMessage(frame.tag) ? frame.msg_len : 0;
+    recv_fd_ = frame.fd;
+    Result ret = RecvTLV(frame.tag, frame.value_len, buf_ + frame.offset);
+    GrantCredit(recv_credit_len_);
+    recv_credit_len_ = 0;
+    if (recv_fd_ >= 0)
+      close(recv_fd_);
+    recv_fd_ = -1;
+    if (!IsRecoverable(ret)) {
+      for (++i; i < frames_.size(); ++i) {
+        if (frames_[i].fd >= 0)
+          close(frames_[i].fd);
+      }
+      ReleaseRecvFds(len_);
+      len_ = 0;
+      return ret;
+    }
+  }
+  if (error) {
+    ReleaseRecvFds(len_);
+    len_ = 0;
+    return CMD_ERROR;
+  }
+
+  // process remaining data
+  int remain = len_ - offset;
+  ReleaseRecvFds(offset);
+  if (remain && offset) {
+    // copy left-over to the beginning of the buffer
+    memmove(buf_, buf_ + offset, remain);
+    gep_log(LOG_DEBUG,
+            "%s:recv(%i):Fragmented command (left %d bytes)",
+            name_.c_str(), id_, remain);
+  }
+  len_ = remain;
+  return len_ ? CMD_FRAGMENTED : CMD_OK;
+}
+
+int GepChannel::SendHeaderOp(uint8_t op,
+                             const std::map<uint32_t, int> &peer_index) {
+  std::string value(1, op);
+  if (op != kHeaderSwitch) {
+    // our table: the peer refers to our tags by their index in it
+    recv_tags_.clear();
+    for (const auto &entry : *ops_) {
+      recv_tags_.push_back(entry.first);
+      AppendUint32(&value, entry.first);
+    }
+  }
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  if (SendTLVLocked(GepProtocol::kTagHeader, value.length(),
+                    value.data()) < 0)
+    return -1;
+  // the accept and the switch are the last full headers we send
+  if (op != kHeaderOffer) {
+    send_tag_index_ = peer_index;
+    send_compact_ = true;
+  }
+  return 0;
+}
+
+GepChannel::Result GepChannel::RecvHeader(int value_len,
+                                          const uint8_t *value) {
+  uint8_t op = value_len >= 1 ? value[0] : 0;
+  if (op == kHeaderSwitch)
+    return CMD_OK;
+  if ((op != kHeaderOffer && op != kHeaderAccept) ||
+      (value_len - 1) % 4 != 0) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid header negotiation (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  // servers without compact headers ignore the offer
+  if (!proto_->IsCompactHeader())
+    return CMD_OK;
+  std::map<uint32_t, int> peer_index;
+  for (int i = 1; i + 4 <= value_len; i += 4)
+    peer_index.emplace(UINT32(value + i), (i - 1) / 4);
+  gep_log(LOG_DEBUG,
+          "%s(%i):using compact headers",
+          name_.c_str(), id_);
+  if (SendHeaderOp(op == kHeaderOffer ? kHeaderAccept : kHeaderSwitch,
+                   peer_index) < 0)
+    return CMD_ERROR;
+  return CMD_OK;
+}
+
+int GepChannel::SendChecksumOp(uint8_t op) {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  if (SendTLVLocked(GepProtocol::kTagChecksum, sizeof(op),
+                    (const char *)&op) < 0)
+    return -1;
+  // the accept and the switch are the last frames we send without them
+  if (op != kChecksumOffer)
+    send_checksum_ = true;
+  return 0;
+}
+
+GepChannel::Result GepChannel::RecvChecksum(int value_len,
+                                            const uint8_t *value) {
+  uint8_t op = value_len >= 1 ? value[0] : 0;
+  if (op == kChecksumSwitch)
+    return CMD_OK;
+  if (op != kChecksumOffer && op != kChecksumAccept) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid checksum negotiation (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  // servers without checksums ignore the offer
+  if (!proto_->IsChecksum())
+    return CMD_OK;
+  gep_log(LOG_DEBUG,
+          "%s(%i):using frame checksums",
+          name_.c_str(), id_);
+  if (SendChecksumOp(op == kChecksumOffer ? kChecksumAccept :
+                     kChecksumSwitch) < 0)
+    return CMD_ERROR;
+  return CMD_OK;
+}
+
+bool GepChannel::Resync(int *offset) {
+  // (compact headers have no magic number to look for)
+  if (!proto_->IsResync() || recv_compact_)
+    return false;
+  // skip the bad header, up to the next one that may be valid
+  int start = *offset + 1;
+  int skipped = 1 + proto_->FindHeader(buf_ + start, len_ - start);
+  *offset += skipped;
+  resyncs_++;
+  gep_log(LOG_WARNING,
+          "%s:recv(%i):Skipped %d bytes to resynchronize the stream",
+          name_.c_str(), id_, skipped);
+  return true;
+}
+
+int GepChannel::SendString(uint32_t tag, const std::string &s) {
+  return SendValue(tag, s, nullptr);
+}
+
+int GepChannel::SendBuffer(uint32_t tag,
+                           const std::shared_ptr<const std::string> &s) {
+  return SendValue(tag, *s, s);
+}
+
+int GepChannel::SendValue(uint32_t tag, const std::string &s,
+                          const std::shared_ptr<const std::string> &owner) {
+  // datagram tags skip the connection when they fit in a datagram
+  if (proto_->IsDatagramTag(tag)) {
+    int ret = SendDatagram(tag, s);
+    if (ret <= 0)
+      return ret;
+  }
+  // large messages go through a memfd
+  int threshold = proto_->GetMemfdThreshold();
+  if (threshold > 0 && s.length() >= (size_t)threshold && proto_->IsUnix() &&
+      !GepProtocol::IsControlTag(tag) && !IsSharedMemory() && !parent_)
+    return SendMemfd(tag, s);
+  // so do the messages that could block the channel for long
+  if (s.length() > GepProtocol::kChunkBytes &&
+      !GepProtocol::IsControlTag(tag) && proto_->GetMaxMessageSize(tag) > 0)
+    return SendChunked(tag, s);
+  // send the TLV
+  const char *value = s.c_str();
+  int value_len = s.length();
+  // large messages kept alive by the caller can skip the socket copy
+  int zerocopy_threshold = proto_->GetZeroCopyThreshold();
+  if (owner && zerocopy_threshold > 0 && value_len >= zerocopy_threshold &&
+      !GepProtocol::IsControlTag(tag))
+    return SendTLV(tag, value_len, value, -1, owner);
   // return the total number of bytes sent
   return SendTLV(tag, value_len, value);
 }
 
-GepChannel::Result GepChannel::RecvTLV(uint32_t tag, int value_len,
-                                       const uint8_t *value) {
+int GepChannel::SendBatch(const std::vector<const GepProtobufMessage *> &msgs) {
+  std::vector<std::pair<uint32_t, std::string>> values(msgs.size());
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    values[i].first = proto_->GetTag(msgs[i]);
+    if (!proto_->Serialize(*msgs[i], &values[i].second)) {
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-%s:serializing message",
+              name_.c_str(), id_, __func__);
+      return -1;
+    }
+  }
+  return SendBatch(values);
+}
+
+// The value of a batch frame is a sequence of messages, each one as:
+//   tag (4 bytes), length (4), serialized message
+int GepChannel::SendBatch(
+    const std::vector<std::pair<uint32_t, std::string>> &values) {
+  std::string batch;
+  const std::pair<uint32_t, std::string> *first = nullptr;
+  int num_batched = 0;
+  auto flush = [&]() {
+    int ret = 0;
+    // (a batch of one is just a message)
+    if (num_batched == 1)
+      ret = SendString(first->first, first->second);
+    else if (num_batched > 1)
+      ret = SendString(GepProtocol::kTagBatch, batch);
+    batch.clear();
+    num_batched = 0;
+    return ret;
+  };
+  for (const auto &value : values) {
+    // the peer would drop the messages it does not handle
+    if (!IsInterested(value.first))
+      continue;
+    size_t item_len = kBatchItemHdrLen + value.second.length();
+    // batches do not hold back the other messages for longer than a chunk
+    if (batch.length() + item_len > GepProtocol::kChunkBytes &&
+        flush() < 0)
+      return -1;
+    // and larger messages go on their own (chunked if needed)
+    if (item_len > GepProtocol::kChunkBytes) {
+      if (SendString(value.first, value.second) < 0)
+        return -1;
+      continue;
+    }
+    if (num_batched == 0)
+      first = &value;
+    AppendUint32(&batch, value.first);
+    AppendUint32(&batch, value.second.length());
+    batch += value.second;
+    num_batched++;
+  }
+  return flush();
+}
+
+// The value of a delta-encoded message is:
+//   tag (4 bytes), flags (4), seq (4), base_seq (4), key length (4), key,
+// followed by either the serialized message (keyframes), or the number of
+// changed fields (4), their numbers (4 each), and the serialized diff.
+// seq numbers the messages of each (tag, key), and base_seq is the message
+// the delta applies to.
+int GepChannel::SendDelta(uint32_t tag, const std::string &key,
+                          const GepProtobufMessage &msg, const std::string &s) {
+#ifdef GEP_LITE
+  // delta encoding needs reflection
+  return SendString(tag, s);
+#else
+  std::lock_guard<std::mutex> lock_guard(delta_sent_lock_);
+  auto id = std::make_pair(tag, key);
+  DeltaState &state = delta_sent_[id];
+  if (!state.msg)
+    state.msg.reset(proto_->GetMessage(tag));
+  if (!state.msg) {
+    delta_sent_.erase(id);
+    return SendString(tag, s);
+  }
+
+  bool keyframe = state.count == 0 ||
+      state.count >= proto_->GetKeyframeInterval(tag);
+  std::string payload;
+  if (!keyframe) {
+    std::vector<int> fields;
+    std::unique_ptr<GepProtobufMessage> diff(proto_->GetMessage(tag));
+    DeltaEncode(*state.msg, msg, &fields, diff.get());
+    AppendUint32(&payload, fields.size());
+    for (int field : fields)
+      AppendUint32(&payload, field);
+    std::string diff_str;
+    // send a keyframe when the delta is not worth it
+    if (!proto_->Serialize(*diff, &diff_str) ||
+        payload.length() + diff_str.length() >= s.length())
+      keyframe = true;
+    else
+      payload += diff_str;
+  }
+
+  std::string value;
+  AppendUint32(&value, tag);
+  AppendUint32(&value, keyframe ? kDeltaKeyframe : 0);
+  AppendUint32(&value, state.seq + 1);
+  AppendUint32(&value, state.seq);
+  AppendUint32(&value, key.length());
+  value += key;
+  value += keyframe ? s : payload;
+  if (SendString(GepProtocol::kTagDelta, value) < 0) {
+    // the peer may not have the message: start again with a keyframe
+    delta_sent_.erase(id);
+    return -1;
+  }
+  state.msg->CopyFrom(msg);
+  state.seq++;
+  state.count = keyframe ? 1 : state.count + 1;
+  return 0;
+#endif
+}
+
+GepChannel::Result GepChannel::RecvDelta(int value_len, const uint8_t *value) {
+#ifdef GEP_LITE
+  gep_log(LOG_WARNING,
+          "%s:recv(%i):Error-Unsupported delta-encoded message (%d bytes)",
+          name_.c_str(), id_, value_len);
+  return CMD_DROPPED;
+#else
+  if (value_len < kDeltaHdrLen ||
+      UINT32(value + 16) > (uint32_t)(value_len - kDeltaHdrLen)) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid delta-encoded message (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  uint32_t tag = UINT32(value);
+  uint32_t flags = UINT32(value + 4);
+  uint32_t seq = UINT32(value + 8);
+  uint32_t base_seq = UINT32(value + 12);
+  uint32_t key_len = UINT32(value + 16);
+  std::string key((const char *)value + kDeltaHdrLen, key_len);
+  const uint8_t *payload = value + kDeltaHdrLen + key_len;
+  int payload_len = value_len - kDeltaHdrLen - key_len;
+
   char tag_string[kMaxTagString];
   proto_->TagString(tag, tag_string, kMaxTagString);
   auto iter = ops_->find(tag);
-  if (iter != ops_->end()) {
-    GepProtobufMessage *msg = proto_->GetMessage(tag);
-    gep_log(LOG_DEBUG,
-            "%s:recv(%i):Received message with tag [%s] (%d value bytes)",
+  if (iter == ops_->end()) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unsupported tag [%s] (%d bytes)",
             name_.c_str(), id_, tag_string, value_len);
-    std::string value_str((const char *)value, (size_t)value_len);
-    if (!proto_->Unserialize(value_str, msg)) {
-      char tmp[value_len * 4];
-      snprintf_printable(tmp, value_len * 4, value, value_len);
-      gep_log(LOG_WARNING,
-              "%s:recv(%i):Error-Unpackable message with tag [%s] (%d bytes) "
-              "[%s]",
-              name_.c_str(), id_, tag_string, len_, tmp);
-      delete msg;
-      return CMD_ERROR;
-    }
-    bool ret = iter->second(*msg, this);
-    if (!ret) {
+    return CMD_DROPPED;
+  }
+
+  // rebuild the full message
+  DeltaState &state = delta_recv_[std::make_pair(tag, key)];
+  std::unique_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+  std::vector<int> fields;
+  if (!(flags & kDeltaKeyframe)) {
+    if (!state.msg || state.seq != base_seq) {
       gep_log(LOG_WARNING,
-              "%s:recv(%i):callback error [%s]",
+              "%s:recv(%i):Error-Out-of-sync delta for tag [%s], waiting "
+              "for a keyframe",
               name_.c_str(), id_, tag_string);
+      return CMD_DROPPED;
     }
-    delete msg;
-  } else {
+    uint32_t num_fields = payload_len >= 4 ? UINT32(payload) : 0;
+    if (payload_len < 4 || num_fields > (uint32_t)(payload_len - 4) / 4) {
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-Invalid delta for tag [%s] (%d bytes)",
+              name_.c_str(), id_, tag_string, value_len);
+      return CMD_ERROR;
+    }
+    for (uint32_t i = 0; i < num_fields; ++i)
+      fields.push_back(UINT32(payload + 4 + 4 * i));
+    payload += 4 + 4 * num_fields;
+    payload_len -= 4 + 4 * num_fields;
+  }
+  std::string payload_str((const char *)payload, (size_t)payload_len);
+  if (!msg || !proto_->Unserialize(payload_str, msg.get())) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unpackable delta for tag [%s] (%d bytes)",
+            name_.c_str(), id_, tag_string, value_len);
+    return CMD_ERROR;
+  }
+  if (flags & kDeltaKeyframe)
+    state.msg = std::move(msg);
+  else
+    DeltaApply(fields, *msg, state.msg.get());
+  state.seq = seq;
+
+  // executors get their own copy of the message
+  const GepVFTEntry &entry = iter->second;
+  if (!entry.executor.empty()) {
+    std::string s;
+    proto_->Serialize(*state.msg, &s);
+    return RecvTLV(tag, s.length(), (const uint8_t *)s.data());
+  }
+  if (!entry.callback(*state.msg, this)) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):callback error [%s]",
+            name_.c_str(), id_, tag_string);
+  }
+  return CMD_OK;
+#endif
+}
+
+GepChannel::Result GepChannel::RecvTLV(uint32_t tag, int value_len,
+                                       const uint8_t *value) {
+  if (GepProtocol::IsControlTag(tag))
+    return RecvControl(tag, value_len, value);
+
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  auto iter = ops_->find(tag);
+  if (iter == ops_->end()) {
     gep_log(LOG_WARNING,
             "%s:recv(%i):Error-Unsupported tag [%s] (%d bytes)",
             name_.c_str(), id_, tag_string, len_);
     return CMD_DROPPED;
   }
 
+  gep_log(LOG_DEBUG,
+          "%s:recv(%i):Received message with tag [%s] (%d value bytes)",
+          name_.c_str(), id_, tag_string, value_len);
+  const GepVFTEntry &entry = iter->second;
+  if (!entry.executor.empty()) {
+    const GepExecutor *executor = proto_->GetExecutor(entry.executor);
+    if (executor != nullptr) {
+      PostTLV(*executor, tag, entry.callback, value_len, value);
+      return CMD_OK;
+    }
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Unknown executor [%s] for tag [%s], running inline",
+            name_.c_str(), id_, entry.executor.c_str(), tag_string);
+  }
+  std::string value_str((const char *)value, (size_t)value_len);
+  return RunCallback(tag, entry.callback, value_str);
+}
+
+GepChannel::Result GepChannel::RecvControl(uint32_t tag, int value_len,
+                                           const uint8_t *value) {
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  gep_log(LOG_DEBUG,
+          "%s:recv(%i):Received control message [%s] (%d value bytes)",
+          name_.c_str(), id_, tag_string, value_len);
+  if (tag == GepProtocol::kTagInterest) {
+    std::lock_guard<std::mutex> lock_guard(peer_tags_lock_);
+    peer_tags_valid_ = true;
+    peer_tags_.clear();
+    for (int i = 0; i + 4 <= value_len; i += 4)
+      peer_tags_.insert(UINT32(value + i));
+    return CMD_OK;
+  }
+  if (tag == GepProtocol::kTagDelta)
+    return RecvDelta(value_len, value);
+  if (tag == GepProtocol::kTagBatch)
+    return RecvBatch(value_len, value);
+  if (tag == GepProtocol::kTagCredit) {
+    if (value_len < 8) {
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-Invalid credit message (%d bytes)",
+              name_.c_str(), id_, value_len);
+      return CMD_ERROR;
+    }
+    RecvCredit(UINT32(value), UINT32(value + 4));
+    return CMD_OK;
+  }
+  if (tag == GepProtocol::kTagShm)
+    return RecvShm(value_len, value);
+  if (tag == GepProtocol::kTagObject)
+    return RecvObject(value_len, value);
+  if (tag == GepProtocol::kTagMemfd)
+    return RecvMemfd(value_len, value);
+  if (tag == GepProtocol::kTagChunk)
+    return RecvChunk(value_len, value);
+  if (tag == GepProtocol::kTagSessionMsg)
+    return RecvSessionMsg(value_len, value);
+  if (tag == GepProtocol::kTagHeader)
+    return RecvHeader(value_len, value);
+  if (tag == GepProtocol::kTagChecksum)
+    return RecvChecksum(value_len, value);
+  std::string value_str((const char *)value, (size_t)value_len);
+  if (control_callback_ && control_callback_(this, tag, value_str))
+    return CMD_OK;
+  gep_log(LOG_WARNING,
+          "%s:recv(%i):Error-Unsupported control message [%s] (%d bytes)",
+          name_.c_str(), id_, tag_string, value_len);
+  return CMD_DROPPED;
+}
+
+GepChannel::Result GepChannel::RunCallback(uint32_t tag,
+                                           const GepCallback &callback,
+                                           const std::string &value_str) {
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  std::unique_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+  if (!proto_->Unserialize(value_str, msg.get())) {
+    int value_len = value_str.length();
+    char tmp[value_len * 4 + 1];
+    snprintf_printable(tmp, sizeof(tmp),
+                       (const uint8_t *)value_str.data(), value_len);
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unpackable message with tag [%s] (%d bytes) "
+            "[%s]",
+            name_.c_str(), id_, tag_string, value_len, tmp);
+    return CMD_ERROR;
+  }
+  bool ret = callback(*msg, this);
+  if (!ret) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):callback error [%s]",
+            name_.c_str(), id_, tag_string);
+  }
   return CMD_OK;
 }
 
+void GepChannel::PostTLV(const GepExecutor &executor, uint32_t tag,
+                         const GepCallback &callback, int value_len,
+                         const uint8_t *value) {
+  // the recv buffer gets reused, so the task needs its own copy of the value
+  std::shared_ptr<std::string> value_str(
+      new std::string((const char *)value, (size_t)value_len));
+  // note that the callback is owned by the VFT, which outlives the channel
+  const GepCallback *callback_ptr = &callback;
+  PostTask(executor, [this, tag, callback_ptr, value_str]() {
+    // an unpackable message cannot reset the connection from here
+    RunCallback(tag, *callback_ptr, *value_str);
+  });
+}
+
+void GepChannel::PostTask(const GepExecutor &executor,
+                          const std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock_guard(pending_tasks_lock_);
+    pending_tasks_++;
+  }
+  // the credits are granted once the task completes
+  int credit_len = recv_credit_len_;
+  recv_credit_len_ = 0;
+  executor([this, task, credit_len]() {
+    task();
+    GrantCredit(credit_len);
+    std::lock_guard<std::mutex> lock_guard(pending_tasks_lock_);
+    if (--pending_tasks_ == 0)
+      pending_tasks_cv_.notify_all();
+  });
+}
+
+int GepChannel::GetPendingTasks() {
+  std::lock_guard<std::mutex> lock_guard(pending_tasks_lock_);
+  return pending_tasks_;
+}
+
+void GepChannel::WaitForTasks() {
+  std::unique_lock<std::mutex> lock(pending_tasks_lock_);
+  pending_tasks_cv_.wait(lock, [this]() { return pending_tasks_ == 0; });
+}
+
 // Send a message with the given message tag and optional value[value_len]
 //  to the GEP client.
 // Returns number of bytes sent, -1 for error.
-int GepChannel::SendTLV(uint32_t tag, int value_len, const char *value) {
+int GepChannel::SendTLV(uint32_t tag, int value_len, const char *value,
+                        int pass_fd,
+                        const std::shared_ptr<const std::string> &owner) {
+  // sessions send through the connection of their parent
+  if (parent_) {
+    std::string frame;
+    AppendUint32(&frame, session_id_);
+    AppendUint32(&frame, tag);
+    if (value)
+      frame.append(value, value_len);
+    return parent_->SendTLV(GepProtocol::kTagSessionMsg, frame.length(),
+                            frame.data());
+  }
+  // control messages go ahead of the bulk chunks waiting for the socket
+  bool control = proto_->HasBulkTags() &&
+      !IsBulkFrame(tag, value_len, value);
+  if (control)
+    control_waiting_++;
   // mutex is held for all this function to ensure header and data are
   // sent consecutively
   std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  if (control) {
+    std::lock_guard<std::mutex> control_lock_guard(control_lock_);
+    if (--control_waiting_ == 0)
+      control_cv_.notify_all();
+  }
+  // queue the message if there are no credits for it (or other messages
+  // are waiting for them)
+  if (proto_->IsFlowControlled() && CarriesMessage(tag) &&
+      (!flow_queue_.empty() || !HasCredit(proto_->GetHdrLen() + value_len))) {
+    if (flow_queue_.size() >= kMaxQueued) {
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-Too many messages waiting for credits",
+              name_.c_str(), id_);
+      return -1;
+    }
+    if (pass_fd >= 0) {
+      int fd = fcntl(pass_fd, F_DUPFD_CLOEXEC, 0);
+      if (fd < 0) {
+        gep_perror(errno, "%s:send(%i):Error-cannot keep descriptor-",
+                   name_.c_str(), id_);
+        return -1;
+      }
+      flow_fds_.push_back(fd);
+    }
+    flow_queue_.emplace_back(tag, value ? std::string(value, value_len) :
+                             std::string());
+    return 0;
+  }
+  if (proto_->IsFlowControlled() && CarriesMessage(tag)) {
+    flow_msgs_++;
+    flow_bytes_ += proto_->GetHdrLen() + value_len;
+  }
+  if (!slow_policy_.IsEnabled())
+    return SendTLVLocked(tag, value_len, value, pass_fd, owner);
+
+  int64_t start_usec = GetMonotonicTimeUsec();
+  int ret = SendTLVLocked(tag, value_len, value, pass_fd, owner);
+  UpdateSlow(GetMonotonicTimeUsec() - start_usec);
+  return ret;
+}
+
+bool GepChannel::IsBulkFrame(uint32_t tag, int value_len,
+                             const char *value) {
+  // (chunks of session messages travel in session frames)
+  if (tag == GepProtocol::kTagSessionMsg && value_len >= 8)
+    tag = UINT32((const uint8_t *)value + 4);
+  return tag == GepProtocol::kTagChunk;
+}
+
+bool GepChannel::CarriesMessage(uint32_t tag) {
+  // delta-encoded messages, message objects, memfd messages, chunks,
+  // session frames, and batches carry protocol messages
+  return !GepProtocol::IsControlTag(tag) || tag == GepProtocol::kTagDelta ||
+      tag == GepProtocol::kTagObject || tag == GepProtocol::kTagMemfd ||
+      tag == GepProtocol::kTagChunk || tag == GepProtocol::kTagSessionMsg ||
+      tag == GepProtocol::kTagBatch;
+}
+
+uint32_t GepChannel::GetMessageTag(uint32_t tag, int value_len,
+                                   const uint8_t *value) {
+  if (tag == GepProtocol::kTagSessionMsg)
+    return value_len >= 8 ?
+        GetMessageTag(UINT32(value + 4), value_len - 8, value + 8) : tag;
+  if (CarriesMessage(tag) && GepProtocol::IsControlTag(tag) &&
+      tag != GepProtocol::kTagBatch && value_len >= 4)
+    return UINT32(value);
+  return tag;
+}
+
+int GepChannel::GetMessagePriority(uint32_t tag, int value_len,
+                                   const uint8_t *value, uint32_t msg_tag) {
+  // (the messages of a session use its GepVFT)
+  const GepVFT *ops = ops_;
+  std::shared_ptr<GepChannel> session;
+  if (tag == GepProtocol::kTagSessionMsg && value_len >= 8) {
+    session = GetSession(UINT32(value));
+    if (session)
+      ops = session->ops_;
+  }
+  auto iter = ops->find(msg_tag);
+  return iter != ops->end() ? iter->second.priority : kGepPriorityNormal;
+}
+
+bool GepChannel::HasCredit(int msg_len) {
+  int window_msgs = proto_->GetFlowWindowMsgs();
+  int window_bytes = proto_->GetFlowWindowBytes();
+  if (window_msgs > 0 && flow_msgs_ >= window_msgs)
+    return false;
+  // the receiver grants the credits back before using half of the window,
+  // so a message larger than that only needs half of the window
+  if (window_bytes > 0 &&
+      window_bytes - flow_bytes_ < std::min(msg_len, window_bytes / 2))
+    return false;
+  return true;
+}
+
+int GepChannel::GetNumQueued() {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  return flow_queue_.size();
+}
+
+void GepChannel::RecvCredit(uint32_t msgs, uint32_t bytes) {
+  std::lock_guard<std::mutex> lock_guard(socket_lock_);
+  flow_msgs_ = std::max<int64_t>(0, flow_msgs_ - (int64_t)msgs);
+  flow_bytes_ = std::max<int64_t>(0, flow_bytes_ - (int64_t)bytes);
+  while (!flow_queue_.empty()) {
+    const std::pair<uint32_t, std::string> &front = flow_queue_.front();
+    int msg_len = proto_->GetHdrLen() + front.second.length();
+    if (!HasCredit(msg_len))
+      break;
+    flow_msgs_++;
+    flow_bytes_ += msg_len;
+    int fd = -1;
+    if (front.first == GepProtocol::kTagMemfd && !flow_fds_.empty()) {
+      fd = flow_fds_.front();
+      flow_fds_.pop_front();
+    }
+    int ret = SendTLVLocked(front.first, front.second.length(),
+                            front.second.data(), fd);
+    if (fd >= 0)
+      close(fd);
+    flow_queue_.pop_front();
+    if (ret < 0) {
+      // the message is lost: give its credit back, and leave the rest
+      // queued (Close() drops them)
+      flow_msgs_--;
+      flow_bytes_ -= msg_len;
+      flow_dropped_++;
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-cannot send message waiting for credits "
+              "(%i bytes)",
+              name_.c_str(), id_, msg_len);
+      break;
+    }
+  }
+}
 
+void GepChannel::GrantCredit(int msg_len) {
+  // the credits are for the frames of the connection
+  if (parent_)
+    return parent_->GrantCredit(msg_len);
+  int window_msgs = proto_->GetFlowWindowMsgs();
+  int window_bytes = proto_->GetFlowWindowBytes();
+  if (msg_len <= 0 || (window_msgs <= 0 && window_bytes <= 0))
+    return;
+  uint8_t value[8];
+  {
+    // grant the credits in batches of half a window
+    std::lock_guard<std::mutex> lock_guard(credit_lock_);
+    credit_msgs_++;
+    credit_bytes_ += msg_len;
+    if ((window_msgs <= 0 || credit_msgs_ < (window_msgs + 1) / 2) &&
+        (window_bytes <= 0 || credit_bytes_ < (window_bytes + 1) / 2))
+      return;
+    SET_UINT32(value, credit_msgs_);
+    SET_UINT32(value + 4, credit_bytes_);
+    credit_msgs_ = 0;
+    credit_bytes_ = 0;
+  }
+  SendTLV(GepProtocol::kTagCredit, sizeof(value),
+          reinterpret_cast<const char *>(value));
+}
+
+int GepChannel::SendTLVLocked(uint32_t tag, int value_len,
+                              const char *value, int pass_fd,
+                              const std::shared_ptr<const std::string> &owner) {
   if (!value) value_len = 0;
   char tag_string[kMaxTagString];
   proto_->TagString(tag, tag_string, kMaxTagString);
+  if (pass_fd >= 0 && shm_send_) {
+    gep_log(LOG_ERROR,
+            "%s:send(%i):Error-cannot pass descriptors through shared memory",
+            name_.c_str(), id_);
+    return -1;
+  }
 
-  // send protocol header
+  // send protocol header (the descriptor goes with its first byte)
   int hdr_len = proto_->GetHdrLen();
-  char buf[hdr_len];
-  proto_->PrintHeader(tag, value_len, reinterpret_cast<uint8_t *>(buf));
-  int ret1 = SendData(buf, hdr_len);
+  char buf[hdr_len];  // (compact headers are shorter)
+  if (send_compact_) {
+    auto it = send_tag_index_.find(tag);
+    hdr_len = GepProtocol::PrintCompactHeader(
+        tag, it != send_tag_index_.end() ? it->second : -1, value_len,
+        reinterpret_cast<uint8_t *>(buf));
+  } else {
+    proto_->PrintHeader(tag, value_len, reinterpret_cast<uint8_t *>(buf));
+  }
+  int ret1 = SendData(buf, hdr_len, pass_fd);
   if (ret1 != hdr_len) {
     gep_log(LOG_ERROR,
             "%s:send(%i):Error-Only sent %d/%d hdr bytes to host",
@@ -316,26 +2082,58 @@ int GepChannel::SendTLV(uint32_t tag, int value_len, const char *value) {
           name_.c_str(), id_, tag_string, ret1, hdr_len + value_len);
 
   // check if there is a value to send
-  if (value_len <= 0)
-    return 0;
+  if (value_len > 0) {
+    // send value
+    int ret2 = SendData(value, value_len, -1, owner);
+    if (ret2 != value_len) {
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-Only sent %d/%d data bytes to host",
+              name_.c_str(), id_, ret2, value_len);
+      return -1;
+    }
+    gep_log(LOG_DEBUG,
+            "%s:send(%i):sent message:%s, %d/%d bytes",
+            name_.c_str(), id_, tag_string, ret2,
+            hdr_len + value_len);
+  }
 
-  // send value
-  int ret2 = SendData(value, value_len);
-  if (ret2 != value_len) {
-    gep_log(LOG_ERROR,
-            "%s:send(%i):Error-Only sent %d/%d data bytes to host",
-            name_.c_str(), id_, ret2, value_len);
-    return -1;
+  // send checksum (of the header and the value)
+  if (send_checksum_) {
+    uint8_t trailer[GepProtocol::kChecksumLen];
+    uint32_t crc = Crc32c(0, reinterpret_cast<uint8_t *>(buf), hdr_len);
+    crc = Crc32c(crc, reinterpret_cast<const uint8_t *>(value), value_len);
+    SET_UINT32(trailer, crc);
+    int ret3 = SendData(reinterpret_cast<const char *>(trailer),
+                        sizeof(trailer));
+    if (ret3 != sizeof(trailer)) {
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-Only sent %d/%d checksum bytes to host",
+              name_.c_str(), id_, ret3, (int)sizeof(trailer));
+      return -1;
+    }
+  }
+  if (!out_buf_.empty()) {
+    out_frames_++;
+    // control frames (credits, negotiations) do not wait in the buffer, as
+    // the peer may be waiting for them
+    if (!CarriesMessage(tag) && FlushLocked() < 0)
+      return -1;
   }
-  gep_log(LOG_DEBUG,
-          "%s:send(%i):sent message:%s, %d/%d bytes",
-          name_.c_str(), id_, tag_string, ret2,
-          hdr_len + value_len);
   // return error code
   return 0;
 }
 
 int GepChannel::SendMessage(const GepProtobufMessage &msg) {
+  uint32_t tag = proto_->GetTag(&msg);
+  std::string key;
+  bool delta = proto_->GetDeltaKey(tag, msg, &key);
+  bool conflated = !delta && proto_->GetConflationKey(tag, msg, &key);
+  // in-process peers can take the message object itself
+  if (!delta && !conflated) {
+    int ret = SendObject(tag, msg);
+    if (ret <= 0)
+      return ret;
+  }
   // serialize the message
   std::string s;
   if (!proto_->Serialize(msg, &s)) {
@@ -345,5 +2143,710 @@ int GepChannel::SendMessage(const GepProtobufMessage &msg) {
     return -1;
   }
   // send the string
-  return SendString(proto_->GetTag(&msg), s);
+  if (delta)
+    return SendDelta(tag, key, msg, s);
+  if (conflated)
+    return SendConflated(tag, key, s);
+  int threshold = proto_->GetZeroCopyThreshold();
+  if (threshold > 0 && s.length() >= (size_t)threshold)
+    return SendBuffer(tag, std::make_shared<std::string>(std::move(s)));
+  return SendString(tag, s);
+}
+
+int GepChannel::SendObject(uint32_t tag, const GepProtobufMessage &msg) {
+  if (!proto_->IsPassingObjects() || !IsInProcess())
+    return 1;
+  // the caller keeps its message
+  std::shared_ptr<GepProtobufMessage> copy(msg.New());
+  copy->CheckTypeAndMergeFrom(msg);
+  uint32_t seq;
+  {
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    if (!shm_send_ || !shm_->IsLocal())
+      return 1;
+    seq = object_seq_;
+    if (!shm_->PutObject(seq, copy))
+      return 1;
+    object_seq_++;
+  }
+  std::string value;
+  AppendUint32(&value, tag);
+  AppendUint32(&value, seq);
+  int ret = SendString(GepProtocol::kTagObject, value);
+  if (ret != 0) {
+    // the peer will never ask for it
+    std::lock_guard<std::mutex> lock_guard(socket_lock_);
+    if (shm_ != nullptr)
+      shm_->ReclaimObject(seq);
+    return -1;
+  }
+  return 0;
+}
+
+GepChannel::Result GepChannel::RecvObject(int value_len,
+                                          const uint8_t *value) {
+  if (value_len < 8) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid message object (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  uint32_t tag = UINT32(value);
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  // no lock: shm_ only changes in the recv thread
+  std::shared_ptr<GepProtobufMessage> msg;
+  if (shm_ != nullptr) {
+    msg = std::static_pointer_cast<GepProtobufMessage>(
+        shm_->TakeObject(UINT32(value + 4)));
+  }
+  if (!msg) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Missing message object with tag [%s]",
+            name_.c_str(), id_, tag_string);
+    return CMD_ERROR;
+  }
+  auto iter = ops_->find(tag);
+  if (iter == ops_->end()) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unsupported tag [%s] (message object)",
+            name_.c_str(), id_, tag_string);
+    return CMD_DROPPED;
+  }
+
+  return DispatchMessage(tag, iter->second, msg);
+}
+
+GepChannel::Result GepChannel::DispatchMessage(
+    uint32_t tag, const GepVFTEntry &entry,
+    const std::shared_ptr<GepProtobufMessage> &msg) {
+  // note that the callback is owned by the VFT, which outlives the channel
+  const GepCallback *callback_ptr = &entry.callback;
+  auto run = [this, tag, callback_ptr, msg]() {
+    if (!(*callback_ptr)(*msg, this)) {
+      char tag_str[kMaxTagString];
+      proto_->TagString(tag, tag_str, kMaxTagString);
+      gep_log(LOG_WARNING,
+              "%s:recv(%i):callback error [%s]",
+              name_.c_str(), id_, tag_str);
+    }
+  };
+  if (!entry.executor.empty()) {
+    const GepExecutor *executor = proto_->GetExecutor(entry.executor);
+    if (executor != nullptr) {
+      PostTask(*executor, run);
+      return CMD_OK;
+    }
+    char tag_string[kMaxTagString];
+    proto_->TagString(tag, tag_string, kMaxTagString);
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Unknown executor [%s] for tag [%s], running inline",
+            name_.c_str(), id_, entry.executor.c_str(), tag_string);
+  }
+  run();
+  return CMD_OK;
+}
+
+int GepChannel::FilterBatch(uint32_t tag, int value_len, uint8_t *value,
+                            int *priority, int64_t *wait_usec) {
+  // (the batch of a session frame follows its id and tag)
+  int batch_offset = tag == GepProtocol::kTagSessionMsg ? 8 : 0;
+  uint8_t *batch = value + batch_offset;
+  int batch_len = value_len - batch_offset;
+  bool kept_any = false;
+  int kept_len = 0;
+  int offset = 0;
+  while (batch_len - offset >= kBatchItemHdrLen) {
+    uint32_t item_tag = UINT32(batch + offset);
+    // (RecvBatch() rejects the invalid items)
+    if (UINT32(batch + offset + 4) >
+        (uint32_t)(batch_len - offset - kBatchItemHdrLen) ||
+        GepProtocol::IsControlTag(item_tag))
+      break;
+    int item_len = kBatchItemHdrLen + UINT32(batch + offset + 4);
+    int item_priority = GetMessagePriority(tag, value_len, value, item_tag);
+    bool keep = !shed_callback_ || !shed_callback_(item_tag, item_priority);
+    GepRateLimitPolicy::Action action = GepRateLimitPolicy::ACTION_PAUSE;
+    // (the batch is already here, so the pause is for the frames after it)
+    int64_t item_wait_usec = keep ?
+        CheckRateLimit(item_tag, item_len, &action, true) : 0;
+    if (item_wait_usec > 0) {
+      rate_limited_++;
+      if (action == GepRateLimitPolicy::ACTION_PAUSE) {
+        *wait_usec = std::max(*wait_usec, item_wait_usec);
+      } else if (action == GepRateLimitPolicy::ACTION_DROP) {
+        gep_log(LOG_DEBUG,
+                "%s:recv(%i):Over the rate limit, dropping batched message "
+                "(%i bytes)",
+                name_.c_str(), id_, item_len);
+        keep = false;
+      } else {
+        gep_log(LOG_WARNING,
+                "%s:recv(%i):Error-Over the rate limit, disconnecting",
+                name_.c_str(), id_);
+        return -1;
+      }
+    }
+    if (keep) {
+      memmove(batch + kept_len, batch + offset, item_len);
+      kept_len += item_len;
+      *priority = kept_any ? std::max(*priority, item_priority) :
+          item_priority;
+      kept_any = true;
+    }
+    offset += item_len;
+  }
+  // (keep the rest as is)
+  memmove(batch + kept_len, batch + offset, batch_len - offset);
+  kept_len += batch_len - offset;
+  return batch_offset + kept_len;
+}
+
+GepChannel::Result GepChannel::RecvBatch(int value_len,
+                                         const uint8_t *value) {
+  struct Item {
+    uint32_t tag;
+    int value_len;
+    const uint8_t *value;
+  };
+  std::vector<Item> items;
+  for (int offset = 0; offset < value_len; ) {
+    if (value_len - offset < kBatchItemHdrLen ||
+        UINT32(value + offset + 4) >
+        (uint32_t)(value_len - offset - kBatchItemHdrLen) ||
+        GepProtocol::IsControlTag(UINT32(value + offset))) {
+      gep_log(LOG_ERROR,
+              "%s:recv(%i):Error-Invalid batch (%d bytes)",
+              name_.c_str(), id_, value_len);
+      return CMD_ERROR;
+    }
+    Item item = {UINT32(value + offset), (int)UINT32(value + offset + 4),
+                 value + offset + kBatchItemHdrLen};
+    items.push_back(item);
+    offset += kBatchItemHdrLen + item.value_len;
+  }
+
+  std::set<uint32_t> dispatched;  // tags with a batch callback
+  for (size_t i = 0; i < items.size(); ++i) {
+    uint32_t tag = items[i].tag;
+    auto iter = ops_->find(tag);
+    if (iter == ops_->end() || !iter->second.batch_callback) {
+      Result ret = RecvTLV(tag, items[i].value_len, items[i].value);
+      if (!IsRecoverable(ret))
+        return ret;
+      continue;
+    }
+    // the first message of a tag takes the rest of them along
+    if (!dispatched.insert(tag).second)
+      continue;
+    std::vector<std::shared_ptr<GepProtobufMessage>> msgs;
+    for (size_t j = i; j < items.size(); ++j) {
+      if (items[j].tag != tag)
+        continue;
+      std::shared_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+      std::string value_str((const char *)items[j].value,
+                            (size_t)items[j].value_len);
+      if (!proto_->Unserialize(value_str, msg.get())) {
+        char tag_string[kMaxTagString];
+        proto_->TagString(tag, tag_string, kMaxTagString);
+        gep_log(LOG_WARNING,
+                "%s:recv(%i):Error-Unpackable message with tag [%s] (%d "
+                "bytes)",
+                name_.c_str(), id_, tag_string, items[j].value_len);
+        return CMD_ERROR;
+      }
+      msgs.push_back(msg);
+    }
+    DispatchBatch(tag, iter->second, msgs);
+  }
+  return CMD_OK;
+}
+
+GepChannel::Result GepChannel::DispatchBatch(
+    uint32_t tag, const GepVFTEntry &entry,
+    const std::vector<std::shared_ptr<GepProtobufMessage>> &msgs) {
+  // note that the callback is owned by the VFT, which outlives the channel
+  const GepBatchCallback *callback_ptr = &entry.batch_callback;
+  auto run = [this, tag, callback_ptr, msgs]() {
+    std::vector<const GepProtobufMessage *> batch;
+    batch.reserve(msgs.size());
+    for (const auto &msg : msgs)
+      batch.push_back(msg.get());
+    if (!(*callback_ptr)(batch, this)) {
+      char tag_str[kMaxTagString];
+      proto_->TagString(tag, tag_str, kMaxTagString);
+      gep_log(LOG_WARNING,
+              "%s:recv(%i):callback error [%s]",
+              name_.c_str(), id_, tag_str);
+    }
+  };
+  if (!entry.executor.empty()) {
+    const GepExecutor *executor = proto_->GetExecutor(entry.executor);
+    if (executor != nullptr) {
+      PostTask(*executor, run);
+      return CMD_OK;
+    }
+    char tag_string[kMaxTagString];
+    proto_->TagString(tag, tag_string, kMaxTagString);
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Unknown executor [%s] for tag [%s], running inline",
+            name_.c_str(), id_, entry.executor.c_str(), tag_string);
+  }
+  run();
+  return CMD_OK;
+}
+
+// The memfd is sealed before passing it, so that the receiver can parse
+// it in place.
+int GepChannel::SendMemfd(uint32_t tag, const std::string &s) {
+  if (s.length() > INT_MAX) {
+    gep_log(LOG_ERROR,
+            "%s:send(%i):Error-Message too large (%zu bytes)",
+            name_.c_str(), id_, s.length());
+    return -1;
+  }
+  int fd = memfd_create("gep", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    gep_perror(errno, "%s:send(%i):Error-cannot create memfd-",
+               name_.c_str(), id_);
+    return -1;
+  }
+  size_t total = 0;
+  while (total < s.length()) {
+    ssize_t bytes = write(fd, s.data() + total, s.length() - total);
+    if (bytes < 0 && errno == EINTR)
+      continue;
+    if (bytes <= 0) {
+      gep_perror(errno, "%s:send(%i):Error-cannot write memfd-",
+                 name_.c_str(), id_);
+      close(fd);
+      return -1;
+    }
+    total += bytes;
+  }
+  if (fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+    gep_perror(errno, "%s:send(%i):Error-cannot seal memfd-",
+               name_.c_str(), id_);
+    close(fd);
+    return -1;
+  }
+  std::string value;
+  AppendUint32(&value, tag);
+  AppendUint32(&value, s.length());
+  int ret = SendTLV(GepProtocol::kTagMemfd, value.length(), value.data(), fd);
+  close(fd);
+  return ret;
+}
+
+GepChannel::Result GepChannel::RecvMemfd(int value_len,
+                                         const uint8_t *value) {
+  if (value_len < 8 || recv_fd_ < 0) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid memfd message (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  uint32_t tag = UINT32(value);
+  uint32_t len = UINT32(value + 4);
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  auto iter = ops_->find(tag);
+  if (iter == ops_->end()) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unsupported tag [%s] (%" PRIu32
+            " bytes in memfd)",
+            name_.c_str(), id_, tag_string, len);
+    return CMD_DROPPED;
+  }
+
+  // the peer must not be able to change the data while we parse them
+  const int kSeals = F_SEAL_SHRINK | F_SEAL_WRITE;
+  int seals = fcntl(recv_fd_, F_GET_SEALS);
+  struct stat st;
+  if (seals < 0 || (seals & kSeals) != kSeals ||
+      fstat(recv_fd_, &st) < 0 || st.st_size < (off_t)len) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid memfd for tag [%s]",
+            name_.c_str(), id_, tag_string);
+    return CMD_ERROR;
+  }
+  std::shared_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+  bool ok = false;
+  if (msg && len == 0) {
+    ok = proto_->Unserialize((const uint8_t *)"", 0, msg.get());
+  } else if (msg) {
+    void *addr = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, recv_fd_, 0);
+    if (addr == MAP_FAILED) {
+      gep_perror(errno, "%s:recv(%i):Error-cannot map memfd-",
+                 name_.c_str(), id_);
+      return CMD_ERROR;
+    }
+    ok = proto_->Unserialize(static_cast<const uint8_t *>(addr), len,
+                             msg.get());
+    munmap(addr, len);
+  }
+  if (!ok) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unpackable message with tag [%s] (%" PRIu32
+            " bytes in memfd)",
+            name_.c_str(), id_, tag_string, len);
+    return CMD_ERROR;
+  }
+  gep_log(LOG_DEBUG,
+          "%s:recv(%i):Received message with tag [%s] (%" PRIu32
+          " bytes in memfd)",
+          name_.c_str(), id_, tag_string, len);
+  return DispatchMessage(tag, iter->second, msg);
+}
+
+void GepChannel::OpenDatagramSocket(const struct sockaddr_storage &addr,
+                                    socklen_t addr_len) {
+  // the datagram tags go through the connection if anything fails
+  int sock = socket_interface_->Socket(proto_->GetDomain(), SOCK_DGRAM, 0);
+  if (sock < 0) {
+    gep_perror(errno, "%s(%i):Error-cannot open datagram socket-",
+               name_.c_str(), id_);
+    return;
+  }
+  // only take datagrams from the server
+  int port;
+  if (connect(sock, (const struct sockaddr *)&addr, addr_len) < 0 ||
+      socket_interface_->SetNonBlocking(name_.c_str(), sock) < 0 ||
+      socket_interface_->GetPort(name_.c_str(), sock, &port) < 0) {
+    gep_perror(errno, "%s(%i):Error-cannot set up datagram socket %d-",
+               name_.c_str(), id_, sock);
+    close(sock);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+    datagram_socket_ = sock;
+    datagram_owned_ = true;
+    datagram_addr_ = addr;
+    datagram_addr_len_ = addr_len;
+  }
+  uint8_t value[4];
+  SET_UINT32(value, port);
+  SendString(GepProtocol::kTagDatagramPort,
+             std::string(reinterpret_cast<const char *>(value), sizeof(value)));
+}
+
+void GepChannel::SetDatagramPeer(int socket,
+                                 const struct sockaddr_storage &addr,
+                                 socklen_t addr_len) {
+  std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+  if (datagram_owned_)
+    close(datagram_socket_);
+  datagram_socket_ = socket;
+  datagram_owned_ = false;
+  datagram_addr_ = addr;
+  datagram_addr_len_ = addr_len;
+}
+
+int GepChannel::GetDatagramSocket() {
+  std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+  return datagram_socket_;
+}
+
+GepDatagramStats GepChannel::GetDatagramStats() {
+  std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+  return datagram_stats_;
+}
+
+int GepChannel::SendDatagram(uint32_t tag, const std::string &s) {
+  int hdr_len = proto_->GetHdrLen();
+  int value_len = 8 + s.length();
+  if (hdr_len + value_len > (int)GepProtocol::kMaxDatagramLen)
+    return 1;
+  std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+  if (datagram_socket_ < 0)
+    return 1;
+  uint8_t buf[GepProtocol::kMaxDatagramLen];
+  proto_->PrintHeader(GepProtocol::kTagDatagram, value_len, buf);
+  SET_UINT32(buf + hdr_len, datagram_seq_);
+  SET_UINT32(buf + hdr_len + 4, tag);
+  memcpy(buf + hdr_len + 8, s.data(), s.length());
+  datagram_seq_++;
+  if (sendto(datagram_socket_, buf, hdr_len + value_len, MSG_DONTWAIT,
+             (const struct sockaddr *)&datagram_addr_,
+             datagram_addr_len_) < 0) {
+    // datagrams that do not fit in the socket buffer, or that the peer
+    // did not take, are lost, as they would be in the network
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS ||
+        errno == ECONNREFUSED)
+      return 0;
+    gep_perror(errno, "%s:send(%i):Error-cannot send datagram on socket %d-",
+               name_.c_str(), id_, datagram_socket_);
+    return -1;
+  }
+  datagram_stats_.sent++;
+  return 0;
+}
+
+void GepChannel::RecvDatagrams() {
+  uint8_t buf[GepProtocol::kMaxDatagramLen];
+  // (the rest keeps the socket readable for the next loop)
+  for (int i = 0; i < GepProtocol::kMaxDatagramsPerLoop; ++i) {
+    int sock = GetDatagramSocket();
+    if (sock < 0)
+      return;
+    ssize_t len = recv(sock, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0) {
+      // (refused datagrams report an error too)
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED)
+        gep_perror(errno, "%s:recv(%i):Error-cannot receive datagram on "
+                   "socket %d-", name_.c_str(), id_, sock);
+      if (errno != ECONNREFUSED)
+        return;
+      continue;
+    }
+    RecvDatagram(buf, len);
+  }
+}
+
+void GepChannel::RecvDatagram(uint8_t *buf, int len) {
+  int hdr_len = proto_->GetHdrLen();
+  uint32_t frame_tag;
+  uint32_t value_len;
+  if (len < hdr_len + 8 ||
+      !proto_->ScanHeader(buf, &frame_tag, &value_len) ||
+      frame_tag != GepProtocol::kTagDatagram ||
+      value_len != (uint32_t)(len - hdr_len)) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Invalid datagram (%d bytes)",
+            name_.c_str(), id_, len);
+    return;
+  }
+  const uint8_t *value = buf + hdr_len;
+  uint32_t seq = UINT32(value);
+  uint32_t tag = UINT32(value + 4);
+  {
+    // count the gaps in the sequence numbers, and fill them with the late
+    // datagrams
+    std::lock_guard<std::mutex> lock_guard(datagram_lock_);
+    int32_t gap = (int32_t)(seq - datagram_next_seq_);
+    if (datagram_stats_.received == 0 || gap >= 0) {
+      if (datagram_stats_.received > 0)
+        datagram_stats_.lost += gap;
+      datagram_next_seq_ = seq + 1;
+    } else {
+      datagram_stats_.reordered++;
+      if (datagram_stats_.lost > 0)
+        datagram_stats_.lost--;
+    }
+    datagram_stats_.received++;
+  }
+
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  auto iter = ops_->find(tag);
+  if (iter == ops_->end()) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unsupported datagram tag [%s] (%d bytes)",
+            name_.c_str(), id_, tag_string, len);
+    return;
+  }
+  if (shed_callback_ && shed_callback_(tag, iter->second.priority))
+    return;
+  // apply the inbound rate limits (there is no stream to pause or close,
+  // so datagrams over the limits are always dropped)
+  GepRateLimitPolicy::Action action = GepRateLimitPolicy::ACTION_DROP;
+  if (CheckRateLimit(tag, len, &action, false) > 0) {
+    rate_limited_++;
+    gep_log(LOG_DEBUG,
+            "%s:recv(%i):Over the rate limit, dropping datagram [%s] "
+            "(%d bytes)",
+            name_.c_str(), id_, tag_string, len);
+    return;
+  }
+  std::shared_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+  if (!msg || !proto_->Unserialize(value + 8, value_len - 8, msg.get())) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unpackable datagram with tag [%s] (%d bytes)",
+            name_.c_str(), id_, tag_string, len);
+    return;
+  }
+  DispatchMessage(tag, iter->second, msg);
+}
+
+int GepChannel::SendChunked(uint32_t tag, const std::string &s) {
+  int max_bytes = proto_->GetMaxMessageSize(tag);
+  if (s.length() > (size_t)max_bytes) {
+    gep_log(LOG_ERROR,
+            "%s:send(%i):Error-Message too large (%zu > %d bytes)",
+            name_.c_str(), id_, s.length(), max_bytes);
+    return -1;
+  }
+  uint32_t stream_id = chunk_stream_id_++;
+  size_t chunk_bytes = GepProtocol::kChunkBytes;
+  bool bulk = proto_->IsBulkTag(tag);
+  for (size_t offset = 0; offset < s.length(); offset += chunk_bytes) {
+    std::string value;
+    AppendUint32(&value, tag);
+    AppendUint32(&value, stream_id);
+    AppendUint32(&value, s.length());
+    AppendUint32(&value, offset);
+    value.append(s, offset, chunk_bytes);
+    // each chunk takes the socket separately, so other messages can go
+    // in between
+    if (bulk && !WaitForBulkTurn()) {
+      gep_log(LOG_ERROR,
+              "%s:send(%i):Error-Bulk lane stalled (%zu of %zu bytes sent)",
+              name_.c_str(), id_, offset, s.length());
+      return -1;
+    }
+    if (SendString(GepProtocol::kTagChunk, value) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+bool GepChannel::WaitForBulkTurn() {
+  if (parent_)
+    return parent_->WaitForBulkTurn();
+  int64_t max_usec = GetMonotonicTimeUsec() + msecs_to_usecs(kBulkWaitMs);
+  while (true) {
+    {
+      // let the control messages go first
+      std::unique_lock<std::mutex> control_lock(control_lock_);
+      int64_t wait_usec = max_usec - GetMonotonicTimeUsec();
+      if (wait_usec <= 0 ||
+          !control_cv_.wait_for(control_lock,
+                                std::chrono::microseconds(wait_usec),
+                                [this]() { return control_waiting_ == 0; }))
+        return false;
+    }
+    if (!IsOpenSocket())
+      return false;
+    // and keep the socket queue short, so they do not wait there either
+    // (the kernel tells nobody when it drains: poll it)
+    int bytes = GetQueuedBytes();
+    if (bytes < proto_->GetBulkQueueBytes())
+      return true;
+    if (GetMonotonicTimeUsec() > max_usec)
+      return false;
+    usleep(kBulkPollUsec);
+  }
+}
+
+GepChannel::Result GepChannel::RecvChunk(int value_len,
+                                         const uint8_t *value) {
+  if (value_len < 16) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Invalid chunk (%d bytes)",
+            name_.c_str(), id_, value_len);
+    return CMD_ERROR;
+  }
+  uint32_t tag = UINT32(value);
+  uint32_t stream_id = UINT32(value + 4);
+  uint32_t total = UINT32(value + 8);
+  uint32_t offset = UINT32(value + 12);
+  const char *data = (const char *)value + 16;
+  int data_len = value_len - 16;
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+
+  auto iter = chunks_.find(stream_id);
+  if (offset == 0) {
+    // first chunk: check the message before keeping any of it
+    int max_bytes = proto_->GetMaxMessageSize(tag);
+    if (ops_->find(tag) == ops_->end() || max_bytes <= 0 ||
+        total > (uint32_t)max_bytes) {
+      gep_log(LOG_WARNING,
+              "%s:recv(%i):Error-Unsupported chunked message with tag [%s] "
+              "(%" PRIu32 " bytes)",
+              name_.c_str(), id_, tag_string, total);
+      if (iter != chunks_.end())
+        chunks_.erase(iter);
+      return CMD_DROPPED;
+    }
+    if (iter == chunks_.end() && chunks_.size() >= (size_t)kMaxChunkStreams) {
+      gep_log(LOG_WARNING,
+              "%s:recv(%i):Error-Too many chunked messages, dropping one",
+              name_.c_str(), id_);
+      chunks_.erase(chunks_.begin());
+    }
+    ChunkStream &stream = chunks_[stream_id];
+    stream.tag = tag;
+    stream.total = total;
+    stream.data.clear();
+    stream.data.reserve(total);
+    iter = chunks_.find(stream_id);
+  } else if (iter == chunks_.end() || iter->second.tag != tag ||
+             iter->second.total != total ||
+             iter->second.data.length() != offset) {
+    // the rest of a dropped message
+    gep_log(LOG_DEBUG,
+            "%s:recv(%i):Dropping chunk of message with tag [%s]",
+            name_.c_str(), id_, tag_string);
+    if (iter != chunks_.end())
+      chunks_.erase(iter);
+    return CMD_DROPPED;
+  }
+
+  ChunkStream &stream = iter->second;
+  if (stream.data.length() + data_len > stream.total) {
+    gep_log(LOG_ERROR,
+            "%s:recv(%i):Error-Chunk beyond the end of message with tag [%s]",
+            name_.c_str(), id_, tag_string);
+    chunks_.erase(iter);
+    return CMD_ERROR;
+  }
+  stream.data.append(data, data_len);
+  if (stream.data.length() < stream.total)
+    return CMD_OK;
+
+  // the message is complete
+  std::shared_ptr<GepProtobufMessage> msg(proto_->GetMessage(tag));
+  bool ok = msg && proto_->Unserialize(
+      (const uint8_t *)stream.data.data(), stream.data.length(), msg.get());
+  chunks_.erase(iter);
+  if (!ok) {
+    gep_log(LOG_WARNING,
+            "%s:recv(%i):Error-Unpackable chunked message with tag [%s] "
+            "(%" PRIu32 " bytes)",
+            name_.c_str(), id_, tag_string, total);
+    return CMD_ERROR;
+  }
+  gep_log(LOG_DEBUG,
+          "%s:recv(%i):Received chunked message with tag [%s] (%" PRIu32
+          " bytes)",
+          name_.c_str(), id_, tag_string, total);
+  return DispatchMessage(tag, ops_->find(tag)->second, msg);
+}
+
+int GepChannel::TakeRecvFd(uint32_t tag, int offset) {
+  // only a memfd frame carries one, passed with its first byte: the rest
+  // are stray
+  int fd = -1;
+  while (!recv_fds_.empty() && recv_fds_.front().first <= offset) {
+    if (fd < 0 && tag == GepProtocol::kTagMemfd &&
+        recv_fds_.front().first == offset)
+      fd = recv_fds_.front().second;
+    else
+      close(recv_fds_.front().second);
+    recv_fds_.pop_front();
+  }
+  return fd;
+}
+
+void GepChannel::ReleaseRecvFds(int offset) {
+  while (!recv_fds_.empty() && recv_fds_.front().first < offset) {
+    close(recv_fds_.front().second);
+    recv_fds_.pop_front();
+  }
+  for (auto &entry : recv_fds_)
+    entry.first -= offset;
+}
+
+void GepChannel::DropPayload(uint32_t tag, int value_len,
+                             const uint8_t *value) {
+  // frees the object slot for the sender
+  if (tag == GepProtocol::kTagObject && value_len >= 8 && shm_ != nullptr)
+    shm_->TakeObject(UINT32(value + 4));
+  // the rest of a chunked message is useless
+  if (tag == GepProtocol::kTagChunk && value_len >= 8)
+    chunks_.erase(UINT32(value + 4));
+  // (a memfd is closed with the stray descriptors)
 }
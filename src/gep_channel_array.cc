@@ -13,18 +13,22 @@
 
 #include "gep_channel_array.h"
 
-#include <algorithm>  // for max
+#include <algorithm>  // for max, min
+#include <condition_variable>  // for condition_variable
 #include <errno.h>  // for errno
+#include <inttypes.h>  // for PRId64
 #include <ext/alloc_traits.h>
 #include <netinet/in.h>  // for sockaddr_in, htons, etc
 #include <string.h>  // for memset
 #include <sys/socket.h>  // for AF_INET, accept, bind, etc
+#include <sys/stat.h>  // for stat, S_ISSOCK
 #include <unistd.h>  // for close
 
 #include "gep_channel.h"  // for GepChannel
 #include "gep_common.h"  // for GepProtobufMessage
 #include "gep_server.h"  // for GepChannel
 #include "socket_interface.h"  // for SocketInterface
+#include "thread_pool.h"  // for ThreadPool
 #include "utils.h"  // for gep_log, gep_perror, etc
 
 using namespace libgep_utils;
@@ -39,7 +43,14 @@ GepChannelArray::GepChannelArray(const std::string &name, GepServer *server,
      context_(context),
      max_channels_(max_channels),
      last_channel_id_(0),
-     server_socket_(-1) {
+     overloaded_(false),
+     shed_priority_(kGepPriorityNormal),
+     overload_start_usec_(0),
+     cpu_sample_usec_(0),
+     cpu_sample_thread_usec_(0),
+     cpu_usage_(0),
+     server_socket_(-1),
+     datagram_socket_(-1) {
   socket_interface_ = new SocketInterface();
 }
 
@@ -47,6 +58,15 @@ GepChannelArray::~GepChannelArray() {
   delete socket_interface_;
 }
 
+void GepChannelArray::UnlinkUnixSocket() {
+  // only remove sockets, in case the path is wrong
+  struct stat st;
+  const char *path = proto_->GetUnixPath().c_str();
+  if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode) && unlink(path) < 0)
+    gep_perror(errno, "%s(*):Error-cannot remove socket %s-", name_.c_str(),
+               path);
+}
+
 void GepChannelArray::ClearGepChannelVector() {
   Stop();
 }
@@ -54,7 +74,8 @@ void GepChannelArray::ClearGepChannelVector() {
 int GepChannelArray::OpenServerSocket() {
   int sock_fd;
 
-  if ((sock_fd = socket_interface_->Socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+  if ((sock_fd = socket_interface_->Socket(proto_->GetDomain(), SOCK_STREAM,
+                                           0)) == -1) {
     gep_perror(errno, "%s(*):Error-opening socket failed-", name_.c_str());
     return -1;
   }
@@ -65,18 +86,24 @@ int GepChannelArray::OpenServerSocket() {
   }
 
   socket_interface_->SetNonBlocking(name_.c_str(), sock_fd);
-  socket_interface_->SetNoDelay(name_.c_str(), sock_fd);
-  socket_interface_->SetPriority(name_.c_str(), sock_fd, 4);
+  if (!proto_->IsUnix())
+    socket_interface_->SetNoDelay(name_.c_str(), sock_fd);
+  socket_interface_->SetPriority(name_.c_str(), sock_fd,
+                                 proto_->GetSocketPriority());
 
-  struct sockaddr_in serveraddr;
-  serveraddr.sin_family = AF_INET;
   // restrict to local address
-  serveraddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-  serveraddr.sin_port = htons(proto_->GetPort());
-  memset(&(serveraddr.sin_zero), '\0', 8);
+  struct sockaddr_storage serveraddr;
+  socklen_t serveraddr_len = proto_->GetSockAddr(&serveraddr);
+  if (serveraddr_len == 0) {
+    close(sock_fd);
+    return -1;
+  }
+  // remove any stale socket left by a previous server
+  if (proto_->IsUnix() && !proto_->IsAbstractUnix())
+    UnlinkUnixSocket();
 
   if (socket_interface_->Bind(sock_fd, (struct sockaddr*)&serveraddr,
-                             sizeof(serveraddr)) == -1) {
+                             serveraddr_len) == -1) {
     gep_perror(errno, "%s(*):Error-bind service socket-", name_.c_str());
     close(sock_fd);
     return -1;
@@ -89,7 +116,7 @@ int GepChannelArray::OpenServerSocket() {
     return -1;
   }
 
-  if (proto_->GetPort() == 0) {
+  if (!proto_->IsUnix() && proto_->GetPort() == 0) {
     // port was dynamically assigned, get it and save it
     int port;
     if (socket_interface_->GetPort(name_.c_str(), sock_fd, &port) < 0) {
@@ -101,9 +128,38 @@ int GepChannelArray::OpenServerSocket() {
 
   server_socket_ = sock_fd;
   gep_log(LOG_DEBUG,
-          "%s(*):open control socket %d on port %d.",
-          name_.c_str(), sock_fd, proto_->GetPort());
+          "%s(*):open control socket %d on %s.",
+          name_.c_str(), sock_fd, proto_->AddressString().c_str());
 
+  if (proto_->UsesDatagrams() && OpenDatagramSocket() < 0) {
+    close(server_socket_);
+    server_socket_ = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int GepChannelArray::OpenDatagramSocket() {
+  int sock_fd = socket_interface_->Socket(proto_->GetDomain(), SOCK_DGRAM, 0);
+  if (sock_fd == -1) {
+    gep_perror(errno, "%s(*):Error-opening datagram socket failed-",
+               name_.c_str());
+    return -1;
+  }
+  // same address (and port number) as the service socket
+  struct sockaddr_storage serveraddr;
+  socklen_t serveraddr_len = proto_->GetSockAddr(&serveraddr);
+  if (socket_interface_->SetNonBlocking(name_.c_str(), sock_fd) < 0 ||
+      socket_interface_->Bind(sock_fd, (struct sockaddr*)&serveraddr,
+                              serveraddr_len) == -1) {
+    gep_perror(errno, "%s(*):Error-bind datagram socket-", name_.c_str());
+    close(sock_fd);
+    return -1;
+  }
+  datagram_socket_ = sock_fd;
+  gep_log(LOG_DEBUG,
+          "%s(*):open datagram socket %d on %s.",
+          name_.c_str(), sock_fd, proto_->AddressString().c_str());
   return 0;
 }
 
@@ -115,6 +171,12 @@ int GepChannelArray::Stop() {
             name_.c_str(), server_socket_);
     close(server_socket_);
     server_socket_ = -1;
+    if (proto_->IsUnix() && !proto_->IsAbstractUnix())
+      UnlinkUnixSocket();
+  }
+  if (datagram_socket_ >= 0) {
+    close(datagram_socket_);
+    datagram_socket_ = -1;
   }
 
   // Delete all GepChannel's
@@ -122,6 +184,12 @@ int GepChannelArray::Stop() {
     server_->DelClient(gep_channel_ptr->GetId());
   }
   gep_channel_vector_.clear();
+  subscriptions_.clear();
+  datagram_peers_.clear();
+  {
+    std::lock_guard<std::mutex> slow_lock(slow_lock_);
+    slow_ids_.clear();
+  }
 
   return 0;
 }
@@ -134,21 +202,164 @@ int GepChannelArray::AddChannel(int socket) {
     return -1;
   }
   int id = last_channel_id_++;
-  gep_channel_vector_.push_back(std::shared_ptr<GepChannel>(
-      new GepChannel(id, "gep_channel", proto_, ops_, context_, socket)));
+  std::shared_ptr<GepChannel> gep_channel_ptr(
+      new GepChannel(id, "gep_channel", proto_, ops_, context_, socket));
+  gep_channel_ptr->SetControlCallback(
+      [this](GepChannel *channel, uint32_t tag, const std::string &value) {
+        return RecvControl(channel, tag, value);
+      });
+  gep_channel_ptr->SetSlowConsumerPolicy(slow_policy_);
+  gep_channel_ptr->SetRateLimitPolicy(rate_policy_);
+  gep_channel_ptr->SetShedCallback([this](uint32_t tag, int priority) {
+    return ShedMessage(tag, priority, true);
+  });
+  gep_channel_vector_.push_back(gep_channel_ptr);
   gep_log(LOG_DEBUG,
           "%s(%d):add GEP channel using socket %d",
           name_.c_str(), id, socket);
+  // bring the new client up to date
+  for (const auto &entry : snapshot_) {
+    if (gep_channel_ptr->SendString(entry.first.first, entry.second) < 0) {
+      gep_log(LOG_WARNING,
+              "%s(%d):Error-cannot replay the snapshot cache",
+              name_.c_str(), id);
+      break;
+    }
+  }
   server_->AddClient(id);
   return 0;
 }
 
+bool GepChannelArray::AddSession(GepChannel *parent,
+                                 const std::string &value) {
+  if (value.length() < 4 || parent->IsSession())
+    return false;
+  uint32_t session = UINT32((const uint8_t *)value.data());
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  std::shared_ptr<GepChannel> parent_ptr;
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr.get() == parent)
+      parent_ptr = gep_channel_ptr;
+    else if (gep_channel_ptr->GetParent().get() == parent &&
+             gep_channel_ptr->GetSessionId() == session)
+      return true;  // already open
+  }
+  if (!parent_ptr)
+    return false;
+  if (gep_channel_vector_.size() >= max_channels_) {
+    gep_log(LOG_ERROR,
+            "%s(%d):Error-Too many clients for session %" PRIu32,
+            name_.c_str(), parent->GetId(), session);
+    return false;
+  }
+  int id = last_channel_id_++;
+  std::shared_ptr<GepChannel> gep_channel_ptr(
+      new GepChannel(id, "gep_channel", proto_, ops_, context_));
+  gep_channel_ptr->SetParent(parent_ptr, session);
+  gep_channel_ptr->SetControlCallback(
+      [this](GepChannel *channel, uint32_t tag, const std::string &value) {
+        return RecvControl(channel, tag, value);
+      });
+  gep_channel_ptr->SetShedCallback([this](uint32_t tag, int priority) {
+    return ShedMessage(tag, priority, true);
+  });
+  parent->AddSession(session, gep_channel_ptr);
+  gep_channel_vector_.push_back(gep_channel_ptr);
+  gep_log(LOG_DEBUG,
+          "%s(%d):add GEP channel for session %" PRIu32 " of client %d",
+          name_.c_str(), id, session, parent->GetId());
+  for (const auto &entry : snapshot_) {
+    if (gep_channel_ptr->SendString(entry.first.first, entry.second) < 0) {
+      gep_log(LOG_WARNING,
+              "%s(%d):Error-cannot replay the snapshot cache",
+              name_.c_str(), id);
+      break;
+    }
+  }
+  server_->AddClient(id);
+  return true;
+}
+
+bool GepChannelArray::DelSession(GepChannel *parent,
+                                 const std::string &value) {
+  if (value.length() < 4)
+    return false;
+  uint32_t session = UINT32((const uint8_t *)value.data());
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr->GetParent().get() == parent &&
+        gep_channel_ptr->GetSessionId() == session) {
+      // (a copy, as the vector entry goes away)
+      std::shared_ptr<GepChannel> channel = gep_channel_ptr;
+      DelChannel(channel);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool GepChannelArray::AddDatagramPeer(GepChannel *channel,
+                                      const std::string &value) {
+  if (value.length() < 4 || channel->IsSession() || datagram_socket_ < 0)
+    return false;
+  // the client UDP socket has the address of its connection
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(channel->GetSocket(), (struct sockaddr *)&addr,
+                  &addr_len) < 0 || addr.ss_family != AF_INET) {
+    gep_perror(errno, "%s(%d):Error-cannot get the client address-",
+               name_.c_str(), channel->GetId());
+    return false;
+  }
+  ((struct sockaddr_in *)&addr)->sin_port =
+      htons(UINT32((const uint8_t *)value.data()));
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr.get() == channel) {
+      channel->SetDatagramPeer(datagram_socket_, addr, addr_len);
+      datagram_peers_[std::string((const char *)&addr, addr_len)] =
+          gep_channel_ptr;
+      return true;
+    }
+  }
+  return false;
+}
+
+void GepChannelArray::RecvDatagrams() {
+  uint8_t buf[GepProtocol::kMaxDatagramLen];
+  // (the rest keeps the socket readable for the next loop, so a flood does
+  // not hold the service thread)
+  for (int i = 0; i < GepProtocol::kMaxDatagramsPerLoop; ++i) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+    ssize_t len = recvfrom(datagram_socket_, buf, sizeof(buf), MSG_DONTWAIT,
+                           (struct sockaddr *)&addr, &addr_len);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        gep_perror(errno, "%s(*):Error-cannot receive datagram-",
+                   name_.c_str());
+      return;
+    }
+    std::shared_ptr<GepChannel> channel;
+    {
+      std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+      auto iter = datagram_peers_.find(
+          std::string((const char *)&addr, addr_len));
+      if (iter != datagram_peers_.end())
+        channel = iter->second.lock();
+    }
+    // (datagrams from unknown senders are dropped)
+    if (channel)
+      channel->RecvDatagram(buf, len);
+  }
+}
+
 int GepChannelArray::AcceptConnection() {
   int new_socket;
-  struct sockaddr clientaddr;
-  socklen_t addrlen = sizeof(struct sockaddr_in);
-  if ((new_socket = socket_interface_->Accept(server_socket_, &clientaddr,
-                                              &addrlen)) == -1) {
+  struct sockaddr_storage clientaddr;
+  socklen_t addrlen = sizeof(clientaddr);
+  if ((new_socket = socket_interface_->Accept(
+           server_socket_, (struct sockaddr *)&clientaddr, &addrlen)) == -1) {
     gep_perror(errno, "%s(*):ERROR accepting new connection using "
                 "socket %d", name_.c_str(), new_socket);
     return -1;
@@ -159,36 +370,594 @@ int GepChannelArray::AcceptConnection() {
           "%s(*):socket %d accepted connection from %s using socket %d",
           name_.c_str(), server_socket_, peer_ip, new_socket);
   socket_interface_->SetNonBlocking(name_.c_str(), new_socket);
-  socket_interface_->SetNoDelay(name_.c_str(), new_socket);
-  socket_interface_->SetPriority(name_.c_str(), new_socket, 4);
+  if (!proto_->IsUnix())
+    socket_interface_->SetNoDelay(name_.c_str(), new_socket);
+  socket_interface_->SetPriority(name_.c_str(), new_socket,
+                                 proto_->GetSocketPriority());
   AddChannel(new_socket);
   return 0;
 }
 
 // Returns -1 if any of the channels fails, 0 otherwise
 int GepChannelArray::SendMessage(const GepProtobufMessage &msg) {
+  return SendMessage(msg, nullptr);
+}
+
+int GepChannelArray::SendMessage(const GepProtobufMessage &msg,
+                                 GepSendResults *results) {
   std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
-  // send the message to all open GepChannel's
+  // select the open GepChannel's that handle the message
+  uint32_t tag = proto_->GetTag(&msg);
+  std::vector<std::shared_ptr<GepChannel>> channels;
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr->IsOpenSocket() && gep_channel_ptr->IsInterested(tag))
+      channels.push_back(gep_channel_ptr);
+  }
+  if (channels.empty() && snapshot_tags_.count(tag) == 0)
+    return 0;
+
+  OutMessage out(msg);
+  int prepared = PrepareMessage(&out);
+  if (prepared != 0)
+    return prepared < 0 ? -1 : 0;
+  KeepSnapshot(out);
+  if (channels.empty())
+    return 0;
+
+  // send the message to all of them
+  std::vector<int> status(channels.size(), 0);
+  SendToChannels(channels,
+                 [this, &out](const std::shared_ptr<GepChannel> &channel) {
+                   return SendToChannel(channel, out);
+                 },
+                 &status);
   int ret = 0;
+  for (int i = 0; i < channels.size(); ++i) {
+    if (status[i] < 0)
+      ret = -1;
+    if (results != nullptr)
+      (*results)[channels[i]->GetId()] = status[i];
+  }
+  return ret;
+}
+
+int GepChannelArray::PrepareMessage(OutMessage *out) {
+  out->tag = proto_->GetTag(&out->msg);
+  // shed low-priority messages before serializing them
+  if (ShedMessage(out->tag, proto_->GetTagPriority(out->tag), false))
+    return 1;
+  if (!proto_->Serialize(out->msg, out->s.get())) {
+    gep_log(LOG_ERROR,
+            "%s(*):Error-serializing message", name_.c_str());
+    return -1;
+  }
+  out->delta = proto_->GetDeltaKey(out->tag, out->msg, &out->key);
+  if (!out->delta)
+    out->conflated = proto_->GetConflationKey(out->tag, out->msg, &out->key);
+  return 0;
+}
+
+void GepChannelArray::KeepSnapshot(const OutMessage &out) {
+  auto snapshot_iter = snapshot_tags_.find(out.tag);
+  if (snapshot_iter == snapshot_tags_.end())
+    return;
+  std::string key;
+  if (snapshot_iter->second)
+    key = snapshot_iter->second(out.msg);
+  snapshot_[std::make_pair(out.tag, key)] = *out.s;
+}
+
+int GepChannelArray::PrepareBatch(
+    const std::vector<const GepProtobufMessage *> &msgs, OutBatch *batch) {
+  for (const GepProtobufMessage *msg : msgs) {
+    std::unique_ptr<OutMessage> out(new OutMessage(*msg));
+    int prepared = PrepareMessage(out.get());
+    if (prepared < 0)
+      return -1;
+    if (prepared > 0)
+      continue;
+    // (batched messages skip delta encoding and conflation)
+    out->delta = false;
+    out->conflated = false;
+    batch->values.emplace_back(out->tag, *out->s);
+    batch->outs.push_back(std::move(out));
+  }
+  return 0;
+}
+
+void GepChannelArray::SendToChannels(
+    const std::vector<std::shared_ptr<GepChannel>> &channels,
+    const std::function<int(const std::shared_ptr<GepChannel> &)> &send,
+    std::vector<int> *status) {
+  if (channels.empty())
+    return;
+  // split the channels in contiguous shards, one per sender thread
+  int num_shards = 1;
+  if (send_pool_)
+    num_shards = std::min<int>(send_pool_->GetNumThreads() + 1,
+                               channels.size());
+  int shard_size = (channels.size() + num_shards - 1) / num_shards;
+  auto send_shard = [&](int shard) {
+    int end = std::min<int>((shard + 1) * shard_size, channels.size());
+    for (int i = shard * shard_size; i < end; ++i)
+      (*status)[i] = send(channels[i]);
+  };
+
+  // the caller thread sends the first shard, the pool the rest
+  std::mutex pending_lock;
+  std::condition_variable pending_cv;
+  int pending = num_shards - 1;
+  for (int shard = 1; shard < num_shards; ++shard) {
+    send_pool_->Post([&, shard]() {
+      send_shard(shard);
+      std::lock_guard<std::mutex> pending_lock_guard(pending_lock);
+      if (--pending == 0)
+        pending_cv.notify_all();
+    });
+  }
+  send_shard(0);
+  std::unique_lock<std::mutex> pending_lock_guard(pending_lock);
+  pending_cv.wait(pending_lock_guard, [&]() { return pending == 0; });
+}
+
+void GepChannelArray::SetSendThreads(int num_threads) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  if (num_threads <= 1)
+    send_pool_.reset();
+  else
+    send_pool_.reset(new ThreadPool(num_threads - 1));
+}
+
+int GepChannelArray::GetSendThreads() {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  return send_pool_ ? send_pool_->GetNumThreads() + 1 : 1;
+}
+
+void GepChannelArray::SetSlowConsumerPolicy(
+    const GepSlowConsumerPolicy &policy) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  slow_policy_ = policy;
+  if (policy.action == GepSlowConsumerPolicy::ACTION_BACKGROUND &&
+      !background_pool_)
+    background_pool_.reset(new ThreadPool(1));
+  for (auto &gep_channel_ptr : gep_channel_vector_)
+    gep_channel_ptr->SetSlowConsumerPolicy(policy);
+  std::lock_guard<std::mutex> slow_lock(slow_lock_);
+  slow_ids_.clear();
+}
+
+void GepChannelArray::SetRateLimitPolicy(const GepRateLimitPolicy &policy) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  rate_policy_ = policy;
+  for (auto &gep_channel_ptr : gep_channel_vector_)
+    gep_channel_ptr->SetRateLimitPolicy(policy);
+}
+
+int64_t GepChannelArray::ResumeChannels() {
+  std::vector<std::shared_ptr<GepChannel>> channels;
+  {
+    std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+    for (auto &gep_channel_ptr : gep_channel_vector_) {
+      if (gep_channel_ptr->IsRecvPaused())
+        channels.push_back(gep_channel_ptr);
+    }
+  }
+
+  int64_t resume_usec = 0;
+  for (auto &gep_channel_ptr : channels) {
+    if (gep_channel_ptr->ResumeRecv() < 0) {
+      DelChannel(gep_channel_ptr);
+      continue;
+    }
+    // the channel may have been paused again
+    int64_t usec = gep_channel_ptr->GetRecvPausedUsec();
+    if (gep_channel_ptr->IsRecvPaused() && (resume_usec == 0 ||
+                                            usec < resume_usec))
+      resume_usec = std::max(usec, (int64_t)1);
+  }
+  return resume_usec;
+}
+
+void GepChannelArray::SetOverloadPolicy(const GepOverloadPolicy &policy) {
+  std::lock_guard<std::mutex> overload_lock(overload_lock_);
+  overload_policy_ = policy;
+  shed_priority_ = policy.min_priority;
+  overloaded_ = false;
+}
+
+void GepChannelArray::UpdateOverload(int64_t loop_lag_usec) {
+  GepOverloadPolicy policy;
+  {
+    std::lock_guard<std::mutex> overload_lock(overload_lock_);
+    policy = overload_policy_;
+  }
+  if (!policy.IsEnabled())
+    return;
+
+  // messages waiting for their executors
+  int pending_tasks = 0;
+  if (policy.max_pending_tasks > 0) {
+    std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+    for (auto &gep_channel_ptr : gep_channel_vector_)
+      pending_tasks += gep_channel_ptr->GetPendingTasks();
+  }
+
+  // CPU usage of the service thread
+  int64_t now_usec = GetMonotonicTimeUsec();
+  if (policy.max_cpu_usage > 0 &&
+      now_usec - cpu_sample_usec_ >= kCpuSampleUsec) {
+    int64_t thread_usec = GetThreadCpuTimeUsec();
+    if (cpu_sample_usec_ > 0) {
+      cpu_usage_ = (double)(thread_usec - cpu_sample_thread_usec_) /
+          (now_usec - cpu_sample_usec_);
+    }
+    cpu_sample_usec_ = now_usec;
+    cpu_sample_thread_usec_ = thread_usec;
+  }
+
+  // use some hysteresis to avoid flapping around the thresholds
+  bool overloaded = overloaded_;
+  double scale = overloaded ? 0.5 : 1.0;
+  bool over =
+      (policy.max_loop_lag_usec > 0 &&
+       loop_lag_usec > policy.max_loop_lag_usec * scale) ||
+      (policy.max_pending_tasks > 0 &&
+       pending_tasks > policy.max_pending_tasks * scale) ||
+      (policy.max_cpu_usage > 0 && cpu_usage_ > policy.max_cpu_usage * scale);
+  if (!overloaded)
+    overloaded = over;
+  else
+    overloaded = over || now_usec - overload_start_usec_ < policy.hold_usec;
+  if (overloaded == overloaded_)
+    return;
+  {
+    std::lock_guard<std::mutex> overload_lock(overload_lock_);
+    overload_start_usec_ = now_usec;
+    overloaded_ = overloaded;
+  }
+  gep_log(LOG_WARNING,
+          "%s(*):server is %s (loop lag: %" PRId64 " usecs, pending tasks: "
+          "%d, cpu usage: %.2f)",
+          name_.c_str(), overloaded ? "overloaded" : "no longer overloaded",
+          loop_lag_usec, pending_tasks, cpu_usage_);
+  server_->Overloaded(overloaded);
+}
+
+std::map<uint32_t, GepShedCounters> GepChannelArray::GetShedCounters() {
+  std::lock_guard<std::mutex> overload_lock(overload_lock_);
+  return shed_counters_;
+}
+
+bool GepChannelArray::ShedMessage(uint32_t tag, int priority, bool inbound) {
+  if (!overloaded_ || priority >= shed_priority_ ||
+      GepProtocol::IsControlTag(tag))
+    return false;
+  char tag_string[kMaxTagString];
+  proto_->TagString(tag, tag_string, kMaxTagString);
+  gep_log(LOG_DEBUG,
+          "%s(*):shedding %s message with tag [%s]",
+          name_.c_str(), inbound ? "incoming" : "outgoing", tag_string);
+  std::lock_guard<std::mutex> overload_lock(overload_lock_);
+  GepShedCounters &counters = shed_counters_[tag];
+  if (inbound)
+    counters.inbound++;
+  else
+    counters.outbound++;
+  return true;
+}
+
+void GepChannelArray::CheckSlowChannels() {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  if (!slow_policy_.IsEnabled())
+    return;
   for (auto &gep_channel_ptr : gep_channel_vector_) {
-    if (gep_channel_ptr->IsOpenSocket())
-      if (gep_channel_ptr->SendMessage(msg) < 0)
+    if (gep_channel_ptr->IsSlow())
+      UpdateSlowChannel(gep_channel_ptr);
+  }
+}
+
+int GepChannelArray::SendToChannel(const std::shared_ptr<GepChannel> &channel,
+                                   const OutMessage &out) {
+  if (slow_policy_.IsEnabled() && UpdateSlowChannel(channel)) {
+    switch (slow_policy_.action) {
+      case GepSlowConsumerPolicy::ACTION_NONE:
+        break;
+      case GepSlowConsumerPolicy::ACTION_DROP:
+      case GepSlowConsumerPolicy::ACTION_DISCONNECT:
+        return -1;
+      case GepSlowConsumerPolicy::ACTION_CONFLATE:
+        // a delta only makes sense right after the previous message
+        if (out.delta)
+          return -1;
+        channel->Conflate(out.tag, out.key, *out.s);
+        return 0;
+      case GepSlowConsumerPolicy::ACTION_BACKGROUND:
+        if (out.delta)
+          return -1;
+        return PostBackground(channel, out.tag, *out.s);
+    }
+  }
+
+  int ret;
+  if (out.delta)
+    ret = channel->SendDelta(out.tag, out.key, out.msg, *out.s);
+  else if (out.conflated)
+    ret = channel->SendConflated(out.tag, out.key, *out.s);
+  else if ((ret = channel->SendObject(out.tag, out.msg)) > 0)
+    ret = channel->SendBuffer(out.tag, out.s);
+  if (slow_policy_.IsEnabled())
+    UpdateSlowChannel(channel);
+  return ret;
+}
+
+int GepChannelArray::SendBatchToChannel(
+    const std::shared_ptr<GepChannel> &channel, const OutBatch &batch) {
+  if (slow_policy_.IsEnabled() && UpdateSlowChannel(channel) &&
+      slow_policy_.action != GepSlowConsumerPolicy::ACTION_NONE) {
+    // the policy handles the messages one by one
+    int ret = 0;
+    for (const auto &out : batch.outs) {
+      if (channel->IsInterested(out->tag) &&
+          SendToChannel(channel, *out) < 0)
         ret = -1;
+    }
+    return ret;
   }
+  int ret = channel->SendBatch(batch.values);
+  if (slow_policy_.IsEnabled())
+    UpdateSlowChannel(channel);
   return ret;
 }
 
+bool GepChannelArray::UpdateSlowChannel(
+    const std::shared_ptr<GepChannel> &channel) {
+  int id = channel->GetId();
+  bool slow;
+  {
+    std::lock_guard<std::mutex> slow_lock(slow_lock_);
+    if (slow_ids_.count(id) == 0) {
+      if (!channel->IsSlow())
+        return false;
+      slow_ids_.insert(id);
+      slow = true;
+    } else {
+      // a channel stays in the background lane until the lane drains
+      auto iter = background_sends_.find(id);
+      if (iter != background_sends_.end() || channel->CheckSlow())
+        return true;
+      slow_ids_.erase(id);
+      slow = false;
+    }
+  }
+
+  gep_log(LOG_WARNING,
+          "%s(%d):client is %s",
+          name_.c_str(), id, slow ? "slow" : "no longer slow");
+  if (slow) {
+    if (slow_policy_.action == GepSlowConsumerPolicy::ACTION_DISCONNECT)
+      // the service thread removes the channel once it sees it closed
+      channel->Shutdown();
+  } else {
+    channel->FlushConflated();
+  }
+  server_->SlowClient(id, slow);
+  return slow;
+}
+
+int GepChannelArray::PostBackground(const std::shared_ptr<GepChannel> &channel,
+                                    uint32_t tag, const std::string &s) {
+  int id = channel->GetId();
+  {
+    std::lock_guard<std::mutex> slow_lock(slow_lock_);
+    int &pending = background_sends_[id];
+    if (pending >= kMaxBackgroundSends) {
+      gep_log(LOG_WARNING,
+              "%s(%d):Error-background lane is full",
+              name_.c_str(), id);
+      return -1;
+    }
+    pending++;
+  }
+  // the caller owns the serialized message, so the task needs its own copy
+  std::shared_ptr<std::string> value(new std::string(s));
+  background_pool_->Post([this, channel, id, tag, value]() {
+    channel->SendString(tag, *value);
+    std::lock_guard<std::mutex> slow_lock(slow_lock_);
+    auto iter = background_sends_.find(id);
+    if (--iter->second == 0)
+      background_sends_.erase(iter);
+  });
+  return 0;
+}
+
+void GepChannelArray::SetSnapshot(uint32_t tag, const GepMessageKey &key) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  snapshot_tags_[tag] = key;
+}
+
+int GepChannelArray::DelSnapshot(uint32_t tag, const std::string &key) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  return snapshot_.erase(std::make_pair(tag, key)) > 0 ? 0 : -1;
+}
+
+void GepChannelArray::ClearSnapshot() {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  snapshot_.clear();
+}
+
+int GepChannelArray::GetSnapshotSize() {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  return snapshot_.size();
+}
+
 // Returns -1 if the message couldn't be sent, 0 otherwise
 int GepChannelArray::SendMessage(const GepProtobufMessage &msg, int id) {
   std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
   // send the message to a specific GepChannel's
   for (auto &gep_channel_ptr : gep_channel_vector_) {
-    if (gep_channel_ptr->IsOpenSocket() && id == gep_channel_ptr->GetId())
-      return gep_channel_ptr->SendMessage(msg);
+    if (gep_channel_ptr->IsOpenSocket() && id == gep_channel_ptr->GetId()) {
+      // the client would drop a message it does not handle
+      if (!gep_channel_ptr->IsInterested(proto_->GetTag(&msg)))
+        return 0;
+      OutMessage out(msg);
+      int prepared = PrepareMessage(&out);
+      if (prepared != 0)
+        return prepared < 0 ? -1 : 0;
+      return SendToChannel(gep_channel_ptr, out);
+    }
+  }
+  return -1;
+}
+
+// Returns -1 if any of the channels fails, 0 otherwise
+int GepChannelArray::SendBatch(
+    const std::vector<const GepProtobufMessage *> &msgs) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  std::vector<std::shared_ptr<GepChannel>> channels;
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr->IsOpenSocket())
+      channels.push_back(gep_channel_ptr);
+  }
+  if (channels.empty() && snapshot_tags_.empty())
+    return 0;
+
+  OutBatch batch;
+  if (PrepareBatch(msgs, &batch) < 0)
+    return -1;
+  for (const auto &out : batch.outs)
+    KeepSnapshot(*out);
+  if (channels.empty() || batch.outs.empty())
+    return 0;
+
+  std::vector<int> status(channels.size(), 0);
+  SendToChannels(channels,
+                 [this, &batch](const std::shared_ptr<GepChannel> &channel) {
+                   return SendBatchToChannel(channel, batch);
+                 },
+                 &status);
+  for (int i = 0; i < channels.size(); ++i) {
+    if (status[i] < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int GepChannelArray::SendBatch(
+    const std::vector<const GepProtobufMessage *> &msgs, int id) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr->IsOpenSocket() && id == gep_channel_ptr->GetId()) {
+      OutBatch batch;
+      if (PrepareBatch(msgs, &batch) < 0)
+        return -1;
+      if (batch.outs.empty())
+        return 0;
+      return SendBatchToChannel(gep_channel_ptr, batch);
+    }
+  }
+  return -1;
+}
+
+bool GepChannelArray::RecvControl(GepChannel *channel, uint32_t tag,
+                                  const std::string &value) {
+  switch (tag) {
+    case GepProtocol::kTagSubscribe:
+      return Subscribe(channel->GetId(), value) == 0;
+    case GepProtocol::kTagUnsubscribe:
+      return Unsubscribe(channel->GetId(), value) == 0;
+    case GepProtocol::kTagSessionOpen:
+      return AddSession(channel, value);
+    case GepProtocol::kTagSessionClose:
+      return DelSession(channel, value);
+    case GepProtocol::kTagDatagramPort:
+      return AddDatagramPeer(channel, value);
+  }
+  return false;
+}
+
+int GepChannelArray::Subscribe(int id, const std::string &topic) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (id == gep_channel_ptr->GetId()) {
+      subscriptions_[topic].insert(id);
+      gep_log(LOG_DEBUG,
+              "%s(%d):subscribed to topic \"%s\"",
+              name_.c_str(), id, topic.c_str());
+      return 0;
+    }
   }
   return -1;
 }
 
+int GepChannelArray::Unsubscribe(int id, const std::string &topic) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  auto iter = subscriptions_.find(topic);
+  if (iter == subscriptions_.end() || iter->second.erase(id) == 0)
+    return -1;
+  if (iter->second.empty())
+    subscriptions_.erase(iter);
+  gep_log(LOG_DEBUG,
+          "%s(%d):unsubscribed from topic \"%s\"",
+          name_.c_str(), id, topic.c_str());
+  return 0;
+}
+
+int GepChannelArray::GetNumSubscribers(const std::string &topic) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  auto iter = subscriptions_.find(topic);
+  if (iter == subscriptions_.end())
+    return 0;
+  return iter->second.size();
+}
+
+void GepChannelArray::DelSubscriptions(int id) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto iter = subscriptions_.begin(); iter != subscriptions_.end(); ) {
+    iter->second.erase(id);
+    if (iter->second.empty())
+      iter = subscriptions_.erase(iter);
+    else
+      ++iter;
+  }
+}
+
+// Returns -1 if any of the subscribers fails, 0 otherwise
+int GepChannelArray::Publish(const std::string &topic,
+                             const GepProtobufMessage &msg) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  auto iter = subscriptions_.find(topic);
+  if (iter == subscriptions_.end())
+    return 0;
+  const std::set<int> &ids = iter->second;
+
+  // serialize the message only once
+  OutMessage out(msg);
+  int prepared = PrepareMessage(&out);
+  if (prepared != 0)
+    return prepared < 0 ? -1 : 0;
+  uint32_t tag = out.tag;
+
+  // send the message to all the subscribed GepChannel's
+  std::vector<std::shared_ptr<GepChannel>> channels;
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (ids.count(gep_channel_ptr->GetId()) > 0 &&
+        gep_channel_ptr->IsOpenSocket() &&
+        gep_channel_ptr->IsInterested(tag))
+      channels.push_back(gep_channel_ptr);
+  }
+  std::vector<int> status(channels.size(), 0);
+  SendToChannels(channels,
+                 [this, &out](const std::shared_ptr<GepChannel> &channel) {
+                   return SendToChannel(channel, out);
+                 },
+                 &status);
+  for (int i = 0; i < channels.size(); ++i) {
+    if (status[i] < 0)
+      return -1;
+  }
+  return 0;
+}
+
 int GepChannelArray::GetVectorSize() {
   std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
   return gep_channel_vector_.size();
@@ -204,9 +973,25 @@ int GepChannelArray::GetClientId(int i) {
   return gep_channel_vector_[i]->GetId();
 }
 
+std::shared_ptr<GepChannel> GepChannelArray::GetGepChannel(int id) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (id == gep_channel_ptr->GetId())
+      return gep_channel_ptr;
+  }
+  return nullptr;
+}
+
 void GepChannelArray::GetVectorReadFds(int *max_fds, fd_set *read_fds) {
   std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  if (datagram_socket_ >= 0) {
+    FD_SET(datagram_socket_, read_fds);
+    *max_fds = std::max(datagram_socket_, *max_fds);
+  }
   for (const auto &gep_channel_ptr : gep_channel_vector_) {
+    // sessions are read by their parent
+    if (gep_channel_ptr->IsSession())
+      continue;
     int socket = gep_channel_ptr->GetSocket();
     if (socket < 0) {
       gep_log(LOG_ERROR,
@@ -214,12 +999,60 @@ void GepChannelArray::GetVectorReadFds(int *max_fds, fd_set *read_fds) {
               name_.c_str(), gep_channel_ptr->GetId());
       continue;
     }
+    // paused clients are not read until ResumeChannels()
+    if (gep_channel_ptr->IsRecvPaused())
+      continue;
     FD_SET(socket, read_fds);
     *max_fds = std::max(socket, *max_fds);
   }
 }
 
+void GepChannelArray::GetVectorWriteFds(int *max_fds, fd_set *write_fds) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  for (const auto &gep_channel_ptr : gep_channel_vector_) {
+    int socket = gep_channel_ptr->GetSocket();
+    if (socket < 0 || !gep_channel_ptr->HasPendingData())
+      continue;
+    FD_SET(socket, write_fds);
+    *max_fds = std::max(socket, *max_fds);
+  }
+}
+
+void GepChannelArray::SendData(fd_set *write_fds) {
+  // select the writable channels
+  std::vector<std::shared_ptr<GepChannel>> channels;
+  {
+    std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+    for (auto &gep_channel_ptr : gep_channel_vector_) {
+      int socket = gep_channel_ptr->GetSocket();
+      if (socket >= 0 && FD_ISSET(socket, write_fds))
+        channels.push_back(gep_channel_ptr);
+    }
+  }
+
+  // write their pending messages
+  for (auto &gep_channel_ptr : channels)
+    gep_channel_ptr->FlushConflated();
+
+  // and the coalesced frames that are due (of any channel)
+  if (proto_->GetCoalesceBytes() <= 0)
+    return;
+  channels.clear();
+  {
+    std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+    for (auto &gep_channel_ptr : gep_channel_vector_) {
+      if (gep_channel_ptr->GetSocket() >= 0)
+        channels.push_back(gep_channel_ptr);
+    }
+  }
+  for (auto &gep_channel_ptr : channels)
+    gep_channel_ptr->FlushCoalesced();
+}
+
 void GepChannelArray::RecvData(fd_set *read_fds) {
+  if (datagram_socket_ >= 0 && FD_ISSET(datagram_socket_, read_fds))
+    RecvDatagrams();
+
   // select any open channel
   std::shared_ptr<GepChannel> used_gep_channel_ptr = nullptr;
   {
@@ -241,18 +1074,43 @@ void GepChannelArray::RecvData(fd_set *read_fds) {
   int ret = used_gep_channel_ptr->RecvData();
 
   //   * check for timeout
-  if (ret < 0) {
-    std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
-    // ensure the gep_channel still exists before deleting it
-    for (auto it = gep_channel_vector_.begin();
-         it != gep_channel_vector_.end(); ) {
-      std::shared_ptr<GepChannel> gep_channel_ptr = *it;
-      if (used_gep_channel_ptr == gep_channel_ptr) {
-        server_->DelClient((*it)->GetId());
-        it = gep_channel_vector_.erase(it);
-        break;
-      }
+  if (ret < 0)
+    DelChannel(used_gep_channel_ptr);
+}
+
+void GepChannelArray::DelChannel(const std::shared_ptr<GepChannel> &channel) {
+  std::lock_guard<std::recursive_mutex> lock(gep_channel_vector_lock_);
+  // the sessions of a client go away with it
+  std::vector<std::shared_ptr<GepChannel>> sessions;
+  for (auto &gep_channel_ptr : gep_channel_vector_) {
+    if (gep_channel_ptr->GetParent() == channel)
+      sessions.push_back(gep_channel_ptr);
+  }
+  for (auto &session : sessions)
+    DelChannel(session);
+  if (channel->IsSession())
+    channel->GetParent()->DelSession(channel->GetSessionId());
+  for (auto it = datagram_peers_.begin(); it != datagram_peers_.end(); ) {
+    std::shared_ptr<GepChannel> peer = it->second.lock();
+    if (!peer || peer == channel)
+      it = datagram_peers_.erase(it);
+    else
       ++it;
+  }
+  // ensure the gep_channel still exists before deleting it
+  for (auto it = gep_channel_vector_.begin();
+       it != gep_channel_vector_.end(); ) {
+    std::shared_ptr<GepChannel> gep_channel_ptr = *it;
+    if (channel == gep_channel_ptr) {
+      DelSubscriptions((*it)->GetId());
+      {
+        std::lock_guard<std::mutex> slow_lock(slow_lock_);
+        slow_ids_.erase((*it)->GetId());
+      }
+      server_->DelClient((*it)->GetId());
+      it = gep_channel_vector_.erase(it);
+      break;
     }
+    ++it;
   }
 }
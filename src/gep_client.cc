@@ -13,6 +13,7 @@
 
 #include "gep_client.h"
 
+#include <algorithm>  // for max
 #include <errno.h>  // for errno, EINTR
 #include <stdint.h>  // for int64_t, uint32_t
 #include <stdio.h>  // for NULL
@@ -38,13 +39,15 @@ GepClient::GepClient(const std::string &name, void *context,
       proto_(proto),
       ops_(ops),
       thread_ctrl_(false),
-      reconnect_count_(0) {
-  gep_channel_ = new GepChannel(0, name_, proto_, ops_, context_);
+      reconnect_count_(0),
+      last_session_id_(0) {
+  gep_channel_.reset(new GepChannel(0, name_, proto_, ops_, context_));
 }
 
 GepClient::~GepClient() {
-  // close and free the GEP channel
-  delete gep_channel_;
+  // close and free the GEP channels
+  sessions_.clear();
+  gep_channel_.reset();
   delete proto_;
 }
 
@@ -55,6 +58,8 @@ int GepClient::Start() {
             name_.c_str());
     return -1;
   }
+  SendSubscriptions();
+  SendSessions();
 
   thread_ctrl_ = true;
   thread_ = std::thread(&GepClient::RunThread, this);
@@ -87,6 +92,8 @@ void GepClient::Reconnect() {
   } else {
     gep_log(LOG_WARNING,
             "%s(*):reconnected.", name_.c_str());
+    SendSubscriptions();
+    SendSessions();
     reconnect_count_++;
   }
 }
@@ -95,9 +102,111 @@ int GepClient::Send(const GepProtobufMessage &msg) {
   return gep_channel_->SendMessage(msg);
 }
 
+int GepClient::SendBatch(
+    const std::vector<const GepProtobufMessage *> &msgs) {
+  return gep_channel_->SendBatch(msgs);
+}
+
+int GepClient::Subscribe(const std::string &topic) {
+  std::lock_guard<std::mutex> lock(topics_lock_);
+  topics_.insert(topic);
+  if (!gep_channel_->IsOpenSocket())
+    return 0;  // will be sent when connected
+  return gep_channel_->SendString(GepProtocol::kTagSubscribe, topic);
+}
+
+int GepClient::Unsubscribe(const std::string &topic) {
+  std::lock_guard<std::mutex> lock(topics_lock_);
+  if (topics_.erase(topic) == 0)
+    return -1;
+  if (!gep_channel_->IsOpenSocket())
+    return 0;
+  return gep_channel_->SendString(GepProtocol::kTagUnsubscribe, topic);
+}
+
+void GepClient::SendSubscriptions() {
+  std::lock_guard<std::mutex> lock(topics_lock_);
+  for (const auto &topic : topics_) {
+    if (gep_channel_->SendString(GepProtocol::kTagSubscribe, topic) < 0) {
+      gep_log(LOG_ERROR,
+              "%s(*):cannot subscribe to topic \"%s\".",
+              name_.c_str(), topic.c_str());
+    }
+  }
+}
+
+int GepClient::AddSession(void *context, const GepVFT *ops) {
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  int id = ++last_session_id_;
+  std::shared_ptr<GepChannel> session(
+      new GepChannel(id, name_, proto_, ops, context));
+  session->SetParent(gep_channel_, id);
+  gep_channel_->AddSession(id, session);
+  sessions_[id] = session;
+  if (!gep_channel_->IsOpenSocket())
+    return id;  // will be opened when connected
+  if (OpenSession(session) < 0) {
+    gep_channel_->DelSession(id);
+    sessions_.erase(id);
+    return -1;
+  }
+  return id;
+}
+
+int GepClient::DelSession(int session) {
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  if (sessions_.erase(session) == 0)
+    return -1;
+  gep_channel_->DelSession(session);
+  if (!gep_channel_->IsOpenSocket())
+    return 0;
+  uint8_t value[4];
+  SET_UINT32(value, session);
+  return gep_channel_->SendString(
+      GepProtocol::kTagSessionClose,
+      std::string(reinterpret_cast<const char *>(value), sizeof(value)));
+}
+
+int GepClient::Send(const GepProtobufMessage &msg, int session) {
+  // (the copy keeps the channel alive against a concurrent DelSession())
+  std::shared_ptr<GepChannel> channel = GetSession(session);
+  if (!channel)
+    return -1;
+  return channel->SendMessage(msg);
+}
+
+std::shared_ptr<GepChannel> GepClient::GetSession(int session) {
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  auto iter = sessions_.find(session);
+  return iter != sessions_.end() ? iter->second : nullptr;
+}
+
+int GepClient::OpenSession(const std::shared_ptr<GepChannel> &session) {
+  uint8_t value[4];
+  SET_UINT32(value, session->GetSessionId());
+  if (gep_channel_->SendString(
+          GepProtocol::kTagSessionOpen,
+          std::string(reinterpret_cast<const char *>(value),
+                      sizeof(value))) < 0) {
+    gep_log(LOG_ERROR,
+            "%s(*):cannot open session %d.",
+            name_.c_str(), session->GetId());
+    return -1;
+  }
+  // let the server know which messages the session handles
+  return session->SendInterest();
+}
+
+void GepClient::SendSessions() {
+  std::lock_guard<std::mutex> lock(sessions_lock_);
+  for (const auto &entry : sessions_)
+    OpenSession(entry.second);
+}
+
 void GepClient::RunThread() {
   int max_fds;
   fd_set read_fds;
+  fd_set write_fds;
   pid_t tid = syscall(__NR_gettid);
 
   gep_log(LOG_DEBUG,
@@ -112,14 +221,34 @@ void GepClient::RunThread() {
       continue;
     }
     FD_ZERO(&read_fds);
-    FD_SET(socket, &read_fds);
+    // a paused recv is not read until ResumeRecv()
+    if (!gep_channel_->IsRecvPaused())
+      FD_SET(socket, &read_fds);
+    FD_ZERO(&write_fds);
+    if (gep_channel_->HasPendingData())
+      FD_SET(socket, &write_fds);
     max_fds = socket;
+    int datagram_socket = gep_channel_->GetDatagramSocket();
+    if (datagram_socket >= 0) {
+      FD_SET(datagram_socket, &read_fds);
+      max_fds = std::max(max_fds, datagram_socket);
+    }
 
     // Calculate the select timeout.
     int64_t select_timeout_usec = proto_->GetSelectTimeoutUsec();
+    // (coalesced frames wait for us at most the coalescing delay)
+    int64_t coalesce_delay_usec = proto_->GetCoalesceDelayUsec();
+    if (proto_->GetCoalesceBytes() > 0 && coalesce_delay_usec > 0)
+      select_timeout_usec = std::min(select_timeout_usec, coalesce_delay_usec);
+    // (and a paused recv until it is due)
+    if (gep_channel_->IsRecvPaused())
+      select_timeout_usec = std::min(
+          select_timeout_usec,
+          std::max(gep_channel_->GetRecvPausedUsec(), (int64_t)1));
 
     struct timeval select_timeout = usecs_to_timeval(select_timeout_usec);
-    int status = select(max_fds + 1, &read_fds, NULL, NULL, &select_timeout);
+    int status = select(max_fds + 1, &read_fds, &write_fds, NULL,
+                        &select_timeout);
     if (status < 0 && errno != EINTR) {
       gep_perror(errno, "%s(*):Error-service socket select-",
                    name_.c_str());
@@ -128,9 +257,21 @@ void GepClient::RunThread() {
 
     if (!GetThreadCtrl()) break;
 
+    // Write any pending (conflated) messages
+    if (FD_ISSET(socket, &write_fds))
+      gep_channel_->FlushConflated();
+    // and the coalesced frames that are due
+    gep_channel_->FlushCoalesced();
+
+    // Handle incoming datagrams
+    if (datagram_socket >= 0 && FD_ISSET(datagram_socket, &read_fds))
+      gep_channel_->RecvDatagrams();
+
     // Handle incoming requests from the server and check for timeout
-    if (FD_ISSET(socket, &read_fds)) {
-      int res = gep_channel_->RecvData();
+    // (including the ones left by a paused recv)
+    if (FD_ISSET(socket, &read_fds) || gep_channel_->IsRecvPaused()) {
+      int res = gep_channel_->IsRecvPaused() ? gep_channel_->ResumeRecv() :
+          gep_channel_->RecvData();
       if (res < 0) {
         // on any receive error, toss the existing connection and try to
         // reconnect
@@ -12,8 +12,14 @@
 
 #include "gep_protocol.h"
 
+#include <algorithm>  // for min
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>  // for Array...
 #include <google/protobuf/text_format.h>  // for TextFormat
-#include <netinet/in.h>  // for htonl
+#include <limits.h>  // for INT_MAX
+#include <netinet/in.h>  // for htonl, sockaddr_in, INADDR_LOOPBACK
+#include <stddef.h>  // for offsetof
+#include <string.h>  // for memchr, memcmp, memset, memcpy
+#include <sys/un.h>  // for sockaddr_un
 
 #include "gep_common.h"  // for GepProtobufMessage
 #include "utils.h"  // for SET_UINT32, UINT32, snprintf_printable
@@ -22,11 +28,44 @@ using namespace libgep_utils;
 
 const int64_t kDefaultSelectTimeUsec = secs_to_usecs(1);
 
+constexpr uint32_t GepProtocol::kTagSubscribe;
+constexpr uint32_t GepProtocol::kTagUnsubscribe;
+constexpr uint32_t GepProtocol::kTagInterest;
+constexpr uint32_t GepProtocol::kTagDelta;
+constexpr uint32_t GepProtocol::kTagCredit;
+constexpr uint32_t GepProtocol::kTagShm;
+constexpr uint32_t GepProtocol::kTagObject;
+constexpr uint32_t GepProtocol::kTagMemfd;
+constexpr uint32_t GepProtocol::kTagChunk;
+constexpr uint32_t GepProtocol::kTagSessionOpen;
+constexpr uint32_t GepProtocol::kTagSessionClose;
+constexpr uint32_t GepProtocol::kTagSessionMsg;
+constexpr uint32_t GepProtocol::kTagDatagram;
+constexpr uint32_t GepProtocol::kTagDatagramPort;
+constexpr uint32_t GepProtocol::kTagHeader;
+constexpr uint32_t GepProtocol::kTagChecksum;
+constexpr uint32_t GepProtocol::kTagBatch;
+
 GepProtocol::GepProtocol(int port)
     : port_(port),
       mode_(kMode),
       magic_(kMagic),
-      select_timeout_usec_(kDefaultSelectTimeUsec) {
+      select_timeout_usec_(kDefaultSelectTimeUsec),
+      flow_window_msgs_(0),
+      flow_window_bytes_(0),
+      shm_ring_bytes_(0),
+      inproc_ring_bytes_(0),
+      pass_objects_(false),
+      memfd_threshold_(0),
+      zerocopy_threshold_(0),
+      max_msg_size_(0),
+      bulk_queue_bytes_(kDefaultBulkQueueBytes),
+      socket_priority_(kDefaultSocketPriority),
+      resync_(false),
+      compact_header_(false),
+      checksum_(false),
+      coalesce_bytes_(0),
+      coalesce_delay_usec_(0) {
 }
 
 GepProtocol::~GepProtocol() {
@@ -43,6 +82,138 @@ void GepProtocol::SetSelectTimeoutUsec(int64_t select_timeout_usec) {
   select_timeout_usec_ = select_timeout_usec;
 }
 
+void GepProtocol::SetExecutor(const std::string &name,
+                              const GepExecutor &executor) {
+  executors_[name] = executor;
+}
+
+const GepExecutor *GepProtocol::GetExecutor(const std::string &name) const {
+  auto iter = executors_.find(name);
+  if (iter == executors_.end())
+    return nullptr;
+  return &iter->second;
+}
+
+void GepProtocol::SetConflation(uint32_t tag, const GepMessageKey &key) {
+  conflations_[tag] = key;
+}
+
+bool GepProtocol::GetConflationKey(uint32_t tag, const GepProtobufMessage &msg,
+                                   std::string *key) const {
+  auto iter = conflations_.find(tag);
+  if (iter == conflations_.end())
+    return false;
+  if (iter->second)
+    *key = iter->second(msg);
+  else
+    key->clear();
+  return true;
+}
+
+socklen_t GepProtocol::GetSockAddr(struct sockaddr_storage *addr) const {
+  memset(addr, 0, sizeof(*addr));
+  if (!IsUnix()) {
+    struct sockaddr_in *saddr = (struct sockaddr_in *)addr;
+    saddr->sin_family = AF_INET;
+    saddr->sin_port = htons(port_);
+    // Use INADDR_LOOPBACK for both sides: Servers only accept calls from
+    // the localhost, and clients connect to it.
+    saddr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return sizeof(*saddr);
+  }
+  struct sockaddr_un *saddr = (struct sockaddr_un *)addr;
+  saddr->sun_family = AF_UNIX;
+  // keep the final '\0' for file system paths
+  if (unix_path_.length() >= sizeof(saddr->sun_path)) {
+    gep_log(LOG_ERROR, "proto(*):Error-Unix path too long (%s)",
+            unix_path_.c_str());
+    return 0;
+  }
+  memcpy(saddr->sun_path, unix_path_.data(), unix_path_.length());
+  if (!IsAbstractUnix())
+    return sizeof(*saddr);
+  // abstract names start with '\0', and are not '\0'-terminated
+  saddr->sun_path[0] = '\0';
+  return offsetof(struct sockaddr_un, sun_path) + unix_path_.length();
+}
+
+std::string GepProtocol::AddressString() const {
+  if (IsUnix())
+    return "unix:" + unix_path_;
+  return "port " + std::to_string(port_);
+}
+
+void GepProtocol::SetFlowControl(int window_msgs, int window_bytes) {
+  flow_window_msgs_ = window_msgs;
+  flow_window_bytes_ = window_bytes;
+}
+
+void GepProtocol::SetCoalescing(int bytes, int64_t delay_usec) {
+  coalesce_bytes_ = bytes;
+  coalesce_delay_usec_ = delay_usec;
+}
+
+void GepProtocol::SetInProcess(int ring_bytes, bool pass_objects) {
+  inproc_ring_bytes_ = ring_bytes;
+  pass_objects_ = pass_objects;
+}
+
+void GepProtocol::SetMaxMessageSize(uint32_t tag, int max_bytes) {
+  tag_max_msg_sizes_[tag] = max_bytes;
+}
+
+int GepProtocol::GetMaxMessageSize(uint32_t tag) const {
+  auto iter = tag_max_msg_sizes_.find(tag);
+  int max_bytes = iter != tag_max_msg_sizes_.end() ? iter->second :
+      max_msg_size_;
+  // bulk messages are always chunked
+  if (max_bytes <= 0 && IsBulkTag(tag))
+    return kMaxMsgLen;
+  return max_bytes;
+}
+
+void GepProtocol::SetTagPriority(uint32_t tag, int priority) {
+  priorities_[tag] = priority;
+}
+
+int GepProtocol::GetTagPriority(uint32_t tag) const {
+  auto iter = priorities_.find(tag);
+  if (iter == priorities_.end())
+    return kGepPriorityNormal;
+  return iter->second;
+}
+
+int GepProtocol::SetDelta(uint32_t tag, const GepMessageKey &key,
+                          int keyframe_interval) {
+#ifdef GEP_LITE
+  gep_log(LOG_ERROR, "Error-delta encoding needs protobuf reflection");
+  return -1;
+#else
+  DeltaConfig config = {key, keyframe_interval};
+  deltas_[tag] = config;
+  return 0;
+#endif
+}
+
+bool GepProtocol::GetDeltaKey(uint32_t tag, const GepProtobufMessage &msg,
+                              std::string *key) const {
+  auto iter = deltas_.find(tag);
+  if (iter == deltas_.end())
+    return false;
+  if (iter->second.key)
+    *key = iter->second.key(msg);
+  else
+    key->clear();
+  return true;
+}
+
+int GepProtocol::GetKeyframeInterval(uint32_t tag) const {
+  auto iter = deltas_.find(tag);
+  if (iter == deltas_.end())
+    return kDefaultKeyframeInterval;
+  return iter->second.keyframe_interval;
+}
+
 bool GepProtocol::ScanHeader(uint8_t *buf, uint32_t *tag, uint32_t *value_len) {
   // read TL in TLV
   uint32_t magic = UINT32(buf + kOffsetMagic);
@@ -53,6 +224,97 @@ bool GepProtocol::ScanHeader(uint8_t *buf, uint32_t *tag, uint32_t *value_len) {
   return (magic == magic_);
 }
 
+int GepProtocol::FindHeader(const uint8_t *buf, int len) const {
+  uint8_t magic[4];
+  SET_UINT32(magic, magic_);
+  int offset = 0;
+  while (offset < len) {
+    // look for the first byte of the magic number (memchr() is vectorized)
+    const uint8_t *p = (const uint8_t *)memchr(buf + offset, magic[0],
+                                               len - offset);
+    if (p == nullptr)
+      return len;
+    offset = p - buf;
+    int avail = len - offset;
+    if (avail < (int)kHdrLen) {
+      // the header may continue in the data not received yet
+      if (memcmp(p, magic, std::min(avail, 4)) == 0)
+        return offset;
+    } else if (memcmp(p, magic, 4) == 0 &&
+               UINT32(p + kOffsetLen) < kMaxMsgLen - kHdrLen) {
+      return offset;
+    }
+    offset++;
+  }
+  return len;
+}
+
+// appends a varint (7 bits per byte, least significant first, with the
+// top bit set in all the bytes but the last one)
+static int PrintVarint(uint32_t value, uint8_t *buf) {
+  int len = 0;
+  while (value >= 0x80) {
+    buf[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  buf[len++] = (uint8_t)value;
+  return len;
+}
+
+// scans a varint of up to 5 bytes. Returns its length, 0 if it is not
+// complete, or -1 if it is too long
+static int ScanVarint(const uint8_t *buf, int len, uint32_t *value) {
+  *value = 0;
+  for (int i = 0; i < 5; ++i) {
+    if (i >= len)
+      return 0;
+    *value |= (uint32_t)(buf[i] & 0x7f) << (7 * i);
+    if ((buf[i] & 0x80) == 0)
+      return i + 1;
+  }
+  return -1;
+}
+
+int GepProtocol::PrintCompactHeader(uint32_t tag, int index,
+                                    uint32_t value_len, uint8_t *buf) {
+  int len = 1;
+  if (index < 0) {
+    buf[0] = kCompactFullTag;
+    SET_UINT32(buf + len, tag);
+    len += 4;
+  } else {
+    buf[0] = 0;
+    len += PrintVarint(index, buf + len);
+  }
+  return len + PrintVarint(value_len, buf + len);
+}
+
+int GepProtocol::ScanCompactHeader(const uint8_t *buf, int len,
+                                   bool *full_tag, uint32_t *tag,
+                                   uint32_t *value_len) {
+  if (len < 1)
+    return 0;
+  if ((buf[0] & ~kCompactFullTag) != 0)
+    return -1;
+  *full_tag = (buf[0] & kCompactFullTag) != 0;
+  int offset = 1;
+  if (*full_tag) {
+    if (len < offset + 4)
+      return 0;
+    *tag = UINT32(buf + offset);
+    offset += 4;
+  } else {
+    int ret = ScanVarint(buf + offset, len - offset, tag);
+    if (ret <= 0)
+      return ret;
+    offset += ret;
+  }
+  int ret = ScanVarint(buf + offset, len - offset, value_len);
+  if (ret <= 0)
+    return ret;
+  return offset + ret;
+}
+
 void GepProtocol::PrintHeader(uint32_t tag, uint32_t value_len, uint8_t *buf) {
   SET_UINT32(buf + kOffsetMagic, magic_);
   SET_UINT32(buf + kOffsetTag, tag);
@@ -85,3 +347,19 @@ bool GepProtocol::Unserialize(const std::string &s, GepProtobufMessage *msg) {
   }
 #endif
 }
+
+bool GepProtocol::Unserialize(const uint8_t *buf, size_t len,
+                              GepProtobufMessage *msg) {
+  if (len > INT_MAX)
+    return false;
+#ifndef GEP_LITE
+  if (mode_ == MODE_TEXT) {
+    google::protobuf::io::ArrayInputStream stream(buf, len);
+    return google::protobuf::TextFormat::Parse(&stream, msg);
+  } else {  // mode_ == MODE_BINARY
+#endif
+    return msg->ParseFromArray(buf, len);
+#ifndef GEP_LITE
+  }
+#endif
+}
@@ -13,6 +13,7 @@
 
 #include "gep_server.h"
 
+#include <algorithm>  // for min
 #include <errno.h>  // for errno, EINTR
 #include <stdint.h>  // for int64_t
 #include <stdio.h>  // for NULL
@@ -70,6 +71,7 @@ void GepServer::Stop() {
 void GepServer::RunThread() {
   int max_fds;
   fd_set read_fds;
+  fd_set write_fds;
   pid_t tid = syscall(__NR_gettid);
 
   gep_log(LOG_DEBUG,
@@ -85,16 +87,29 @@ void GepServer::RunThread() {
   }
 
   while (GetThreadCtrl()) {
+    // resume the clients paused by the rate limits (the paused ones are
+    // not read)
+    int64_t resume_usec = gep_channel_array_->ResumeChannels();
+
     FD_ZERO(&read_fds);
     FD_SET(server_socket, &read_fds);
     max_fds = server_socket;
     gep_channel_array_->GetVectorReadFds(&max_fds, &read_fds);
+    FD_ZERO(&write_fds);
+    gep_channel_array_->GetVectorWriteFds(&max_fds, &write_fds);
 
     // Calculate the select timeout.
     int64_t select_timeout_usec = proto_->GetSelectTimeoutUsec();
+    if (resume_usec > 0)
+      select_timeout_usec = std::min(select_timeout_usec, resume_usec);
+    // (coalesced frames wait for us at most the coalescing delay)
+    int64_t coalesce_delay_usec = proto_->GetCoalesceDelayUsec();
+    if (proto_->GetCoalesceBytes() > 0 && coalesce_delay_usec > 0)
+      select_timeout_usec = std::min(select_timeout_usec, coalesce_delay_usec);
     struct timeval select_timeout = usecs_to_timeval(select_timeout_usec);
 
-    int status = select(max_fds + 1, &read_fds, NULL, NULL, &select_timeout);
+    int status = select(max_fds + 1, &read_fds, &write_fds, NULL,
+                        &select_timeout);
     if (status < 0 && errno != EINTR) {
       gep_perror(errno, "%s(*):Error-service socket select-",
                    name_.c_str());
@@ -102,10 +117,20 @@ void GepServer::RunThread() {
     }
 
     if (!GetThreadCtrl()) break;
+    int64_t wakeup_usec = GetMonotonicTimeUsec();
 
     // process all inputs
     gep_channel_array_->RecvData(&read_fds);
 
+    // write any pending outputs
+    gep_channel_array_->SendData(&write_fds);
+
+    // let slow clients recover
+    gep_channel_array_->CheckSlowChannels();
+
+    // shed low-priority messages if the service thread falls behind
+    gep_channel_array_->UpdateOverload(GetMonotonicTimeUsec() - wakeup_usec);
+
     if (!GetThreadCtrl()) break;
 
     // accept new GEP channel connections (from GEP clients)
@@ -126,3 +151,46 @@ int GepServer::Send(const GepProtobufMessage &msg) {
 int GepServer::Send(const GepProtobufMessage &msg, int id) {
   return gep_channel_array_->SendMessage(msg, id);
 }
+
+int GepServer::SendBatch(
+    const std::vector<const GepProtobufMessage *> &msgs) {
+  return gep_channel_array_->SendBatch(msgs);
+}
+
+int GepServer::SendBatch(const std::vector<const GepProtobufMessage *> &msgs,
+                         int id) {
+  return gep_channel_array_->SendBatch(msgs, id);
+}
+
+int GepServer::Publish(const std::string &topic,
+                       const GepProtobufMessage &msg) {
+  return gep_channel_array_->Publish(topic, msg);
+}
+
+int GepServer::Subscribe(int id, const std::string &topic) {
+  return gep_channel_array_->Subscribe(id, topic);
+}
+
+int GepServer::Unsubscribe(int id, const std::string &topic) {
+  return gep_channel_array_->Unsubscribe(id, topic);
+}
+
+int GepServer::GetNumSubscribers(const std::string &topic) {
+  return gep_channel_array_->GetNumSubscribers(topic);
+}
+
+void GepServer::SetSlowConsumerPolicy(const GepSlowConsumerPolicy &policy) {
+  gep_channel_array_->SetSlowConsumerPolicy(policy);
+}
+
+void GepServer::SetRateLimitPolicy(const GepRateLimitPolicy &policy) {
+  gep_channel_array_->SetRateLimitPolicy(policy);
+}
+
+void GepServer::SetOverloadPolicy(const GepOverloadPolicy &policy) {
+  gep_channel_array_->SetOverloadPolicy(policy);
+}
+
+void GepServer::SetSnapshot(uint32_t tag, const GepMessageKey &key) {
+  gep_channel_array_->SetSnapshot(tag, key);
+}
@@ -5,6 +5,7 @@
 
 #include <stddef.h>
 #include <stdint.h>  // for int64_t
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 
@@ -30,6 +31,12 @@ class RawSocketInterface {
   virtual ssize_t Send(int sockfd, const void *buf, size_t len, int flags) {
     return send(sockfd, buf, len, flags);
   }
+  virtual ssize_t SendMsg(int sockfd, const struct msghdr *msg, int flags) {
+    return sendmsg(sockfd, msg, flags);
+  }
+  virtual ssize_t RecvMsg(int sockfd, struct msghdr *msg, int flags) {
+    return recvmsg(sockfd, msg, flags);
+  }
   virtual int Select(int nfds, fd_set *readfds, fd_set *writefds,
                      fd_set *exceptfds, struct timeval *timeout) {
     return select(nfds, readfds, writefds, exceptfds, timeout);
@@ -50,6 +57,9 @@ class RawSocketInterface {
                           socklen_t *addrlen) {
     return getpeername(sockfd, addr, addrlen);
   }
+  virtual int Ioctl(int fd, unsigned long request, int *arg) {
+    return ioctl(fd, request, arg);
+  }
 };
 
 #endif  // _RAW_SOCKET_INTERFACE_H_
@@ -0,0 +1,360 @@
+// Copyright Google Inc. Apache 2.0.
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "shm_transport.h"
+
+#include <algorithm>  // for min
+#include <atomic>  // for atomic
+#include <errno.h>  // for errno
+#include <fcntl.h>  // for O_CREAT, O_RDWR, etc
+#include <new>  // for placement new
+#include <random>  // for random_device
+#include <string.h>  // for memcpy
+#include <sys/mman.h>  // for mmap, munmap, shm_open, shm_unlink
+#include <sys/stat.h>  // for fstat
+#include <unistd.h>  // for close, ftruncate, getpid
+
+#include "utils.h"  // for gep_log, gep_perror
+
+using namespace libgep_utils;
+
+namespace {
+
+const uint32_t kShmMagic = 0x6773686d;  // "gshm"
+const int kMinRingBytes = 4096;
+const int kMaxRingBytes = 64 * 1024 * 1024;
+// object slots per direction (in-process segments)
+const int kNumObjectSlots = 1024;
+
+// rounds the ring size up to a power of 2, so positions can be masked
+int GetRingSize(int ring_bytes) {
+  int size = kMinRingBytes;
+  while (size < ring_bytes && size < kMaxRingBytes)
+    size *= 2;
+  return size;
+}
+
+}  // namespace
+
+// The ring positions only grow: (tail - head) is the number of bytes
+// in the ring. Each of them gets its own cache line, as they are
+// written by different processes.
+struct ShmTransport::Ring {
+  alignas(64) std::atomic<uint64_t> head;
+  alignas(64) std::atomic<uint64_t> tail;
+  // set by the reader while it polls the ring (no wake-ups needed)
+  alignas(64) std::atomic<uint32_t> polling;
+};
+
+struct ShmTransport::Header {
+  uint32_t magic;
+  uint32_t ring_bytes;
+  // the creator writes to rings[0], and the opener to rings[1]
+  Ring rings[2];
+};
+
+// A mapping of the segment, plus the object slots of in-process segments
+// (kNumObjectSlots per direction). Each slot owns the object it holds.
+struct ShmTransport::Segment {
+  struct Object {
+    uint32_t seq;
+    std::shared_ptr<void> obj;
+  };
+
+  Segment(void *segment_addr, size_t segment_size, bool local)
+      : addr(segment_addr), size(segment_size) {
+    if (!local)
+      return;
+    objects.reset(new std::atomic<Object *>[2 * kNumObjectSlots]);
+    for (int i = 0; i < 2 * kNumObjectSlots; ++i)
+      objects[i] = nullptr;
+  }
+  ~Segment() {
+    if (objects) {
+      for (int i = 0; i < 2 * kNumObjectSlots; ++i)
+        delete objects[i].load();
+    }
+    munmap(addr, size);
+  }
+
+  void *addr;
+  size_t size;
+  std::unique_ptr<std::atomic<Object *>[]> objects;
+};
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "shared memory rings need lock-free 64-bit atomics");
+
+std::mutex ShmTransport::local_lock_;
+std::map<std::string, std::weak_ptr<ShmTransport::Segment>>
+    ShmTransport::local_segments_;
+
+ShmTransport::ShmTransport(const std::string &name, bool owner, bool local,
+                           const std::shared_ptr<Segment> &segment)
+    : name_(name),
+      owner_(owner),
+      local_(local),
+      segment_(segment),
+      hdr_(static_cast<Header *>(segment->addr)) {
+  ring_bytes_ = hdr_->ring_bytes;
+  tx_index_ = owner ? 0 : 1;
+  tx_ = &hdr_->rings[tx_index_];
+  tx_data_ = GetRingData(tx_index_);
+  rx_ = &hdr_->rings[1 - tx_index_];
+  rx_data_ = GetRingData(1 - tx_index_);
+}
+
+ShmTransport::~ShmTransport() {
+  if (owner_)
+    Unlink();
+}
+
+size_t ShmTransport::GetSegmentSize(int ring_bytes) {
+  return sizeof(Header) + 2 * (size_t)ring_bytes;
+}
+
+void ShmTransport::InitHeader(void *addr, int ring_bytes) {
+  Header *hdr = new (addr) Header();
+  hdr->magic = kShmMagic;
+  hdr->ring_bytes = ring_bytes;
+  for (Ring &ring : hdr->rings) {
+    ring.head = 0;
+    ring.tail = 0;
+    ring.polling = 0;
+  }
+}
+
+uint8_t *ShmTransport::GetRingData(int ring) const {
+  return static_cast<uint8_t *>(segment_->addr) + sizeof(Header) +
+      ring * (size_t)ring_bytes_;
+}
+
+ShmTransport *ShmTransport::Create(const std::string &name, int ring_bytes) {
+  ring_bytes = GetRingSize(ring_bytes);
+  size_t size = GetSegmentSize(ring_bytes);
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    gep_perror(errno, "shm(*):Error-cannot create segment %s-", name.c_str());
+    return nullptr;
+  }
+  if (ftruncate(fd, size) < 0) {
+    gep_perror(errno, "shm(*):Error-cannot size segment %s-", name.c_str());
+    close(fd);
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    gep_perror(errno, "shm(*):Error-cannot map segment %s-", name.c_str());
+    shm_unlink(name.c_str());
+    return nullptr;
+  }
+  InitHeader(addr, ring_bytes);
+  return new ShmTransport(name, true, false,
+                          std::make_shared<Segment>(addr, size, false));
+}
+
+ShmTransport *ShmTransport::Open(const std::string &name, int ring_bytes,
+                                 int max_ring_bytes) {
+  ring_bytes = GetRingSize(ring_bytes);
+  if (ring_bytes > GetRingSize(max_ring_bytes)) {
+    gep_log(LOG_ERROR, "shm(*):Error-segment %s too large (%d bytes)",
+            name.c_str(), ring_bytes);
+    return nullptr;
+  }
+  size_t size = GetSegmentSize(ring_bytes);
+  int fd = shm_open(name.c_str(), O_RDWR, 0);
+  if (fd < 0) {
+    gep_perror(errno, "shm(*):Error-cannot open segment %s-", name.c_str());
+    return nullptr;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size != size) {
+    gep_log(LOG_ERROR, "shm(*):Error-wrong size for segment %s",
+            name.c_str());
+    close(fd);
+    return nullptr;
+  }
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    gep_perror(errno, "shm(*):Error-cannot map segment %s-", name.c_str());
+    return nullptr;
+  }
+  Header *hdr = static_cast<Header *>(addr);
+  if (hdr->magic != kShmMagic || hdr->ring_bytes != (uint32_t)ring_bytes) {
+    gep_log(LOG_ERROR, "shm(*):Error-invalid segment %s", name.c_str());
+    munmap(addr, size);
+    return nullptr;
+  }
+  return new ShmTransport(name, false, false,
+                          std::make_shared<Segment>(addr, size, false));
+}
+
+ShmTransport *ShmTransport::CreateLocal(int ring_bytes) {
+  // a peer in another process must not find a segment of its own with
+  // the same name
+  static std::atomic<int> num_segments(0);
+  std::random_device random;
+  std::string name = "local." + std::to_string(getpid()) + "." +
+      std::to_string(num_segments++) + "." + std::to_string(random());
+  ring_bytes = GetRingSize(ring_bytes);
+  size_t size = GetSegmentSize(ring_bytes);
+  void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr == MAP_FAILED) {
+    gep_perror(errno, "shm(*):Error-cannot map segment %s-", name.c_str());
+    return nullptr;
+  }
+  InitHeader(addr, ring_bytes);
+  std::shared_ptr<Segment> segment =
+      std::make_shared<Segment>(addr, size, true);
+  {
+    std::lock_guard<std::mutex> lock_guard(local_lock_);
+    local_segments_[name] = segment;
+  }
+  return new ShmTransport(name, true, true, segment);
+}
+
+ShmTransport *ShmTransport::OpenLocal(const std::string &name,
+                                      int ring_bytes) {
+  std::shared_ptr<Segment> segment;
+  {
+    std::lock_guard<std::mutex> lock_guard(local_lock_);
+    auto iter = local_segments_.find(name);
+    if (iter != local_segments_.end())
+      segment = iter->second.lock();
+  }
+  if (!segment) {
+    // the peer is in another process
+    gep_log(LOG_DEBUG, "shm(*):no in-process segment %s", name.c_str());
+    return nullptr;
+  }
+  Header *hdr = static_cast<Header *>(segment->addr);
+  if (hdr->ring_bytes != (uint32_t)GetRingSize(ring_bytes)) {
+    gep_log(LOG_ERROR, "shm(*):Error-invalid segment %s", name.c_str());
+    return nullptr;
+  }
+  return new ShmTransport(name, false, true, segment);
+}
+
+void ShmTransport::Unlink() {
+  if (!name_.empty()) {
+    if (local_) {
+      std::lock_guard<std::mutex> lock_guard(local_lock_);
+      local_segments_.erase(name_);
+    } else {
+      shm_unlink(name_.c_str());
+    }
+  }
+  name_.clear();
+}
+
+int ShmTransport::Write(const void *buf, int size, bool *wake) {
+  *wake = false;
+  // we are the only writer of tail
+  uint64_t tail = tx_->tail.load(std::memory_order_relaxed);
+  uint64_t head = tx_->head.load(std::memory_order_acquire);
+  if (tail - head > (uint64_t)ring_bytes_) {
+    gep_log(LOG_ERROR, "shm(*):Error-corrupted ring in segment %s",
+            name_.c_str());
+    return -1;
+  }
+  int bytes = std::min<uint64_t>(size, ring_bytes_ - (tail - head));
+  if (bytes <= 0)
+    return 0;
+  int pos = tail & (ring_bytes_ - 1);
+  int first = std::min(bytes, ring_bytes_ - pos);
+  memcpy(tx_data_ + pos, buf, first);
+  memcpy(tx_data_, static_cast<const uint8_t *>(buf) + first, bytes - first);
+  // Both sides store their state before loading the other one's, so
+  // either the reader sees the new tail, or we see that it read the
+  // whole ring without polling it anymore (and may be waiting for a
+  // wake-up).
+  tx_->tail.store(tail + bytes, std::memory_order_seq_cst);
+  *wake = tx_->polling.load(std::memory_order_seq_cst) == 0 &&
+      tx_->head.load(std::memory_order_seq_cst) == tail;
+  return bytes;
+}
+
+int ShmTransport::Read(void *buf, int size) {
+  // we are the only writer of head
+  uint64_t head = rx_->head.load(std::memory_order_relaxed);
+  uint64_t tail = rx_->tail.load(std::memory_order_seq_cst);
+  if (tail - head > (uint64_t)ring_bytes_) {
+    gep_log(LOG_ERROR, "shm(*):Error-corrupted ring in segment %s",
+            name_.c_str());
+    return -1;
+  }
+  int bytes = std::min<uint64_t>(size, tail - head);
+  if (bytes <= 0)
+    return 0;
+  int pos = head & (ring_bytes_ - 1);
+  int first = std::min(bytes, ring_bytes_ - pos);
+  memcpy(buf, rx_data_ + pos, first);
+  memcpy(static_cast<uint8_t *>(buf) + first, rx_data_, bytes - first);
+  rx_->head.store(head + bytes, std::memory_order_seq_cst);
+  return bytes;
+}
+
+void ShmTransport::SetPolling(bool polling) {
+  rx_->polling.store(polling ? 1 : 0, std::memory_order_seq_cst);
+}
+
+int ShmTransport::GetWriteQueued() const {
+  return tx_->tail.load(std::memory_order_relaxed) -
+      tx_->head.load(std::memory_order_acquire);
+}
+
+int ShmTransport::GetWriteSpace() const {
+  return ring_bytes_ - GetWriteQueued();
+}
+
+bool ShmTransport::PutObject(uint32_t seq, const std::shared_ptr<void> &obj) {
+  if (!local_)
+    return false;
+  // we are the only writer of the outgoing slots (the reader only empties
+  // them)
+  std::atomic<Segment::Object *> &slot =
+      segment_->objects[tx_index_ * kNumObjectSlots + seq % kNumObjectSlots];
+  if (slot.load(std::memory_order_acquire) != nullptr)
+    return false;
+  slot.store(new Segment::Object{seq, obj}, std::memory_order_release);
+  return true;
+}
+
+void ShmTransport::ReclaimObject(uint32_t seq) {
+  if (!local_)
+    return;
+  // the peer may be taking it at the same time: whoever empties the slot
+  // owns the object
+  std::atomic<Segment::Object *> &slot =
+      segment_->objects[tx_index_ * kNumObjectSlots + seq % kNumObjectSlots];
+  delete slot.exchange(nullptr, std::memory_order_acq_rel);
+}
+
+std::shared_ptr<void> ShmTransport::TakeObject(uint32_t seq) {
+  if (!local_)
+    return nullptr;
+  std::atomic<Segment::Object *> &slot =
+      segment_->objects[(1 - tx_index_) * kNumObjectSlots +
+                        seq % kNumObjectSlots];
+  Segment::Object *object = slot.exchange(nullptr, std::memory_order_acq_rel);
+  if (object == nullptr)
+    return nullptr;
+  if (object->seq != seq) {
+    // not ours: put it back (unless the writer reused the slot already)
+    Segment::Object *expected = nullptr;
+    if (!slot.compare_exchange_strong(expected, object,
+                                      std::memory_order_acq_rel))
+      delete object;
+    return nullptr;
+  }
+  std::shared_ptr<void> obj = std::move(object->obj);
+  delete object;
+  return obj;
+}
@@ -0,0 +1,108 @@
+// Copyright Google Inc. Apache 2.0.
+
+#ifndef _SRC_SHM_TRANSPORT_H_
+#define _SRC_SHM_TRANSPORT_H_
+
+#include <map>  // for map
+#include <memory>  // for shared_ptr, weak_ptr
+#include <mutex>  // for mutex
+#include <stdint.h>  // for uint32_t, uint64_t
+#include <string>  // for string
+
+// A shared memory segment holding a pair of single-producer,
+// single-consumer byte rings, one per direction. The side that creates
+// the segment (the client) writes to the first ring and reads from the
+// second one, and the side that opens it (the server) does the opposite.
+//
+// The rings carry a byte stream, like a socket. Waking up the reader is
+// left to the caller: Write() reports whether the reader may have seen
+// the ring empty (and stopped reading), which happens only when the
+// write makes an empty ring non-empty.
+//
+// In-process segments live in anonymous memory, and are found by name in
+// a registry of the process. Besides the rings, they have a set of slots
+// per direction to hand objects over to the peer.
+class ShmTransport {
+ public:
+  ~ShmTransport();
+
+  // creates a new segment with rings of (at least) ring_bytes. Returns
+  // nullptr if problems
+  static ShmTransport *Create(const std::string &name, int ring_bytes);
+  // opens the segment created by the peer, refusing rings larger than
+  // max_ring_bytes (rounded up like ring_bytes). Returns nullptr if
+  // problems
+  static ShmTransport *Open(const std::string &name, int ring_bytes,
+                            int max_ring_bytes);
+  // same for in-process segments
+  static ShmTransport *CreateLocal(int ring_bytes);
+  static ShmTransport *OpenLocal(const std::string &name, int ring_bytes);
+
+  // removes the segment name (the mappings stay valid)
+  void Unlink();
+
+  // copies up to size bytes into the outgoing ring. Sets *wake when the
+  // reader needs a wake-up. Returns the number of bytes written (-1 if
+  // the ring is corrupted)
+  int Write(const void *buf, int size, bool *wake);
+  // copies up to size bytes from the incoming ring. Returns the number
+  // of bytes read (0 if the ring is empty, -1 if it is corrupted)
+  int Read(void *buf, int size);
+
+  // Tells the writer whether we are polling the incoming ring, so it does
+  // not need to wake us up. Read the ring again after clearing it.
+  void SetPolling(bool polling);
+
+  // returns the bytes written but not read yet in the outgoing ring
+  int GetWriteQueued() const;
+  // returns the free space in the outgoing ring
+  int GetWriteSpace() const;
+
+  // Object slots (in-process segments only): PutObject() stores an object
+  // in the outgoing slot of seq, before writing the data that refer to it,
+  // and returns false if the slot is still busy. ReclaimObject() empties
+  // it again when those data could not be written. TakeObject() empties
+  // the incoming slot of seq, returning nullptr if it does not hold seq.
+  bool PutObject(uint32_t seq, const std::shared_ptr<void> &obj);
+  void ReclaimObject(uint32_t seq);
+  std::shared_ptr<void> TakeObject(uint32_t seq);
+
+  const std::string &GetName() const { return name_; }
+  int GetRingBytes() const { return ring_bytes_; }
+  bool IsLocal() const { return local_; }
+
+ private:
+  struct Ring;
+  struct Header;
+  struct Segment;
+
+  ShmTransport(const std::string &name, bool owner, bool local,
+               const std::shared_ptr<Segment> &segment);
+  static size_t GetSegmentSize(int ring_bytes);
+  static void InitHeader(void *addr, int ring_bytes);
+  uint8_t *GetRingData(int ring) const;
+
+  std::string name_;
+  // whether we created (and have to unlink) the segment
+  bool owner_;
+  bool local_;
+  // shared by both sides of in-process segments
+  std::shared_ptr<Segment> segment_;
+  int ring_bytes_;
+  Header *hdr_;
+  Ring *tx_;
+  uint8_t *tx_data_;
+  Ring *rx_;
+  uint8_t *rx_data_;
+  int tx_index_;  // index of the outgoing ring (and object slots)
+
+  // in-process segments, by name
+  static std::mutex local_lock_;
+  static std::map<std::string, std::weak_ptr<Segment>> local_segments_;
+
+  // do not copy this object
+  ShmTransport(const ShmTransport&) = delete;  // suppress copy
+  ShmTransport& operator=(const ShmTransport&) = delete;  // suppress assignment
+};
+
+#endif  // _SRC_SHM_TRANSPORT_H_
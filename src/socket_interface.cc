@@ -13,6 +13,8 @@
 #include <arpa/inet.h>  // for inet_ntop
 #include <errno.h>  // for errno, EAGAIN, EWOULDBLOCK
 #include <fcntl.h>  // for fcntl
+#include <linux/errqueue.h>  // for sock_extended_err
+#include <linux/sockios.h>  // for SIOCOUTQ
 #include <netinet/in.h>  // for sockaddr_in, IPPROTO_TCP, etc
 #include <netinet/tcp.h>  // for TCP_NODELAY
 #include <stdint.h>  // for int64_t, uint8_t
@@ -21,6 +23,7 @@
 #include <sys/select.h>  // for FD_SET, FD_ZERO, etc
 #include <sys/socket.h>  // for SOL_SOCKET, etc
 #include <sys/time.h>  // for timeval
+#include <unistd.h>  // for close
 
 #include "raw_socket_interface.h"
 #include "utils.h"
@@ -29,13 +32,65 @@ using namespace libgep_utils;
 
 int SocketInterface::FullSend(int fd, const uint8_t* buf, int size,
                               int64_t timeout_ms) {
+  return FullSendFd(fd, buf, size, -1, timeout_ms);
+}
+
+int SocketInterface::FullSendFd(int fd, const uint8_t* buf, int size,
+                                int pass_fd, int64_t timeout_ms) {
+  return FullSendFlags(fd, buf, size, pass_fd, 0, timeout_ms, nullptr);
+}
+
+int SocketInterface::FullSendZeroCopy(int fd, const uint8_t* buf, int size,
+                                      int64_t timeout_ms, uint32_t *calls) {
+  *calls = 0;
+  return FullSendFlags(fd, buf, size, -1, MSG_ZEROCOPY, timeout_ms, calls);
+}
+
+int SocketInterface::FullSendFlags(int fd, const uint8_t* buf, int size,
+                                   int pass_fd, int flags, int64_t timeout_ms,
+                                   uint32_t *zerocopy_calls) {
   int64_t started_ms = time_manager_->ms_elapse(0);
   int total_sent = 0;
 
   while (total_sent < size) {
-    int count = raw_socket_interface_->Send(fd, buf + total_sent,
-                                            size - total_sent, MSG_DONTWAIT);
+    // use MSG_NOSIGNAL so that a peer closing the connection causes an
+    // error (EPIPE) instead of a SIGPIPE
+    int count;
+    if (pass_fd >= 0 && total_sent == 0) {
+      struct iovec iov;
+      iov.iov_base = const_cast<uint8_t *>(buf);
+      iov.iov_len = size;
+      union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+      } control;
+      memset(&control, 0, sizeof(control));
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control.buf;
+      msg.msg_controllen = sizeof(control.buf);
+      struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+      count = raw_socket_interface_->SendMsg(
+          fd, &msg, flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+    } else {
+      count = raw_socket_interface_->Send(fd, buf + total_sent,
+                                          size - total_sent,
+                                          flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    if (count < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+      // out of memory for pinning pages (optmem_max): copy the rest
+      flags &= ~MSG_ZEROCOPY;
+      continue;
+    }
     if (count > 0) {
+      if (flags & MSG_ZEROCOPY)
+        (*zerocopy_calls)++;
       total_sent += count;
       if (total_sent >= size) {
         break;
@@ -77,6 +132,90 @@ int SocketInterface::FullSend(int fd, const uint8_t* buf, int size,
   return total_sent;
 }
 
+ssize_t SocketInterface::RecvFds(int sockfd, void *buf, size_t len,
+                                 int flags, std::deque<int> *fds) {
+  // a few descriptors per call, so a peer cannot make us drop many
+  const int kMaxFds = 16;
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  union {
+    char buf[CMSG_SPACE(kMaxFds * sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  size_t num_old_fds = fds->size();
+  ssize_t bytes = raw_socket_interface_->RecvMsg(sockfd, &msg,
+                                                 flags | MSG_CMSG_CLOEXEC);
+  if (bytes < 0)
+    return bytes;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (int i = 0; i < num_fds; ++i) {
+      int passed_fd;
+      memcpy(&passed_fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      fds->push_back(passed_fd);
+    }
+  }
+  if (msg.msg_flags & MSG_CTRUNC) {
+    // the kernel dropped some descriptors: the rest no longer match the
+    // frames that carry them
+    gep_log(LOG_ERROR, "socket(%d):Error-dropped passed descriptors",
+            sockfd);
+    while (fds->size() > num_old_fds) {
+      close(fds->back());
+      fds->pop_back();
+    }
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return bytes;
+}
+
+int SocketInterface::RecvZeroCopyCompletions(
+    int sock, const std::function<void(uint32_t, uint32_t, bool)> &done) {
+  int num_ranges = 0;
+  while (true) {
+    union {
+      char buf[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                          sizeof(struct sockaddr_in6))];
+      struct cmsghdr align;
+    } control;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    if (raw_socket_interface_->RecvMsg(sock, &msg,
+                                       MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return num_ranges;
+      return -1;
+    }
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+          !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+        continue;
+      struct sock_extended_err err;
+      memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+      if (err.ee_errno != 0 || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+      // ee_info and ee_data are the first and last calls completed
+      done(err.ee_info, err.ee_data,
+           (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) != 0);
+      num_ranges++;
+    }
+  }
+}
+
 int SocketInterface::SetNonBlocking(const char *log_module, int sock) {
   if (!log_module) log_module = "unknown";
 
@@ -107,6 +246,19 @@ int SocketInterface::SetPriority(const char *log_module, int sock, int prio) {
   return 0;
 }
 
+int SocketInterface::SetZeroCopy(const char *log_module, int sock) {
+  if (!log_module) log_module = "unknown";
+
+  int flags = 1;
+  if (raw_socket_interface_->SetSockOpt(sock, SOL_SOCKET, SO_ZEROCOPY,
+                                        &flags, sizeof(flags)) < 0) {
+    gep_perror(errno, "%s():Error-Cannot set SO_ZEROCOPY on socket (%d)-",
+                 log_module, sock);
+    return -1;
+  }
+  return 0;
+}
+
 int SocketInterface::SetNoDelay(const char *log_module, int sock) {
   if (!log_module) log_module = "unknown";
 
@@ -148,13 +300,41 @@ int SocketInterface::GetPort(const char *log_module, int sock, int *port) {
   return 0;
 }
 
+int SocketInterface::GetSendQueueSize(const char *log_module, int sock,
+                                      int *bytes) {
+  if (!log_module) log_module = "unknown";
+
+  if (raw_socket_interface_->Ioctl(sock, SIOCOUTQ, bytes) < 0) {
+    gep_perror(errno, "%s():Error-Cannot get SIOCOUTQ on socket (%d)-",
+               log_module, sock);
+    return -1;
+  }
+  return 0;
+}
+
+bool SocketInterface::IsWritable(int sock) {
+  struct timeval tv;
+  memset(&tv, 0, sizeof(tv));
+  fd_set write_fds;
+  FD_ZERO(&write_fds);
+  FD_SET(sock, &write_fds);
+  return raw_socket_interface_->Select(sock + 1, NULL, &write_fds, NULL,
+                                       &tv) > 0;
+}
+
 char *SocketInterface::GetPeerIP(int sock, char *buf, int size) {
-  struct sockaddr_in sock_addr;
+  struct sockaddr_storage sock_addr;
   socklen_t sockaddr_size = sizeof(sock_addr);
 
   if (raw_socket_interface_->GetPeerName(sock, (struct sockaddr *)&sock_addr,
                                          &sockaddr_size) == 0) {
-    if (inet_ntop(AF_INET, &sock_addr.sin_addr, buf, size)) {
+    if (sock_addr.ss_family == AF_UNIX) {
+      // Unix domain peers have no address
+      nice_snprintf(buf, size, "%s", "local");
+      return buf;
+    }
+    if (inet_ntop(AF_INET, &((struct sockaddr_in *)&sock_addr)->sin_addr,
+                  buf, size)) {
       return buf;
     } else {
       gep_perror(errno, "util():Error-Cannot determine peer-IP-");
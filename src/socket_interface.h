@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 
+#include <deque>  // for deque
+#include <functional>  // for function
 #include <memory>  // for unique_ptr
 
 #include "raw_socket_interface.h"
@@ -43,10 +45,29 @@ class SocketInterface {
   // -2 if the connection was orderly shutdown
   virtual int FullSend(int fd, const uint8_t* buf, int size,
                        int64_t timeout_ms);
+  // Same as FullSend(), passing the descriptor pass_fd (SCM_RIGHTS) with
+  // the first byte (Unix domain sockets only). A negative pass_fd passes
+  // nothing.
+  virtual int FullSendFd(int fd, const uint8_t* buf, int size, int pass_fd,
+                         int64_t timeout_ms);
+  // Same as FullSend(), using MSG_ZEROCOPY: the kernel may read buf after
+  // returning, until it reports the completion of the send calls (see
+  // RecvZeroCopyCompletions()). Sets *calls to the number of send calls
+  // made with MSG_ZEROCOPY (they are numbered consecutively per socket).
+  virtual int FullSendZeroCopy(int fd, const uint8_t* buf, int size,
+                               int64_t timeout_ms, uint32_t *calls);
+  virtual ssize_t Send(int sockfd, const void *buf, size_t len, int flags) {
+    return raw_socket_interface_->Send(sockfd, buf, len, flags);
+  }
   // TODO(chema): replace with FullRecv()
   virtual ssize_t Recv(int sockfd, void *buf, size_t len, int flags) {
     return raw_socket_interface_->Recv(sockfd, buf, len, flags);
   }
+  // Same as Recv(), appending the descriptors passed with the data
+  // (SCM_RIGHTS) to fds. Fails (with EMSGSIZE) if the kernel dropped some
+  // of them.
+  virtual ssize_t RecvFds(int sockfd, void *buf, size_t len, int flags,
+                          std::deque<int> *fds);
 
   // Sets or gets various settings on the given socket.
   // Returns -1 for error, else 0.
@@ -54,13 +75,30 @@ class SocketInterface {
   virtual int SetPriority(const char *log_module, int sock, int prio);
   virtual int SetNoDelay(const char *log_module, int sock);
   virtual int SetReuseAddr(const char *log_module, int sock);
+  // Enables MSG_ZEROCOPY sends (SO_ZEROCOPY).
+  virtual int SetZeroCopy(const char *log_module, int sock);
   virtual int GetPort(const char *log_module, int sock, int *port);
+  // Gets the number of bytes in the socket send queue (not yet sent or
+  // not yet acknowledged by the peer).
+  virtual int GetSendQueueSize(const char *log_module, int sock, int *bytes);
+  // Returns whether the socket can be written without blocking.
+  virtual bool IsWritable(int sock);
+  // Reads the zero-copy completions in the socket error queue, without
+  // blocking, and calls done(first, last, copied) for each range of send
+  // calls completed (copied tells whether the kernel copied the data
+  // anyway). Returns the number of ranges read, or -1 for error.
+  virtual int RecvZeroCopyCompletions(
+      int sock, const std::function<void(uint32_t, uint32_t, bool)> &done);
   // other socket-related functions
   virtual char *GetPeerIP(int sock, char *buf, int size);
 
  private:
   friend class TestableSocketInterface;
 
+  // FullSendFd() and FullSendZeroCopy()
+  int FullSendFlags(int fd, const uint8_t* buf, int size, int pass_fd,
+                    int flags, int64_t timeout_ms, uint32_t *zerocopy_calls);
+
   std::unique_ptr<RawSocketInterface> raw_socket_interface_;
   std::unique_ptr<TimeManager> time_manager_;
 };
@@ -0,0 +1,48 @@
+// Copyright Google Inc. Apache 2.0.
+
+#include "thread_pool.h"
+
+#include <functional>  // for function
+#include <mutex>  // for mutex, lock_guard, unique_lock
+#include <thread>  // for thread
+#include <utility>  // for move
+
+ThreadPool::ThreadPool(int num_threads)
+    : stop_(false) {
+  for (int i = 0; i < num_threads; ++i)
+    threads_.push_back(std::thread(&ThreadPool::RunThread, this));
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock(tasks_lock_);
+    stop_ = true;
+  }
+  tasks_cv_.notify_all();
+  for (auto &th : threads_)
+    th.join();
+}
+
+void ThreadPool::Post(const std::function<void()> &task) {
+  {
+    std::lock_guard<std::mutex> lock(tasks_lock_);
+    tasks_.push_back(task);
+  }
+  tasks_cv_.notify_one();
+}
+
+void ThreadPool::RunThread() {
+  while (true) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(tasks_lock_);
+      tasks_cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+      // drain the queue before exiting
+      if (tasks_.empty())
+        return;
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
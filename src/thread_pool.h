@@ -0,0 +1,40 @@
+// Copyright Google Inc. Apache 2.0.
+
+#ifndef _SRC_THREAD_POOL_H_
+#define _SRC_THREAD_POOL_H_
+
+#include <condition_variable>  // for condition_variable
+#include <deque>  // for deque
+#include <functional>  // for function
+#include <mutex>  // for mutex
+#include <thread>  // for thread
+#include <vector>  // for vector
+
+// A fixed-size pool of threads running tasks in FIFO order.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads);
+  // runs all the pending tasks, and then joins the threads
+  virtual ~ThreadPool();
+
+  // queues a task to be run by one of the threads
+  void Post(const std::function<void()> &task);
+
+  int GetNumThreads() const { return threads_.size(); }
+
+ private:
+  // default function run by the pool threads
+  void RunThread();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> tasks_;
+  bool stop_;
+  std::mutex tasks_lock_;  // guards tasks_ and stop_
+  std::condition_variable tasks_cv_;
+
+  // do not copy this object
+  ThreadPool(const ThreadPool&) = delete;  // suppress copy
+  ThreadPool& operator=(const ThreadPool&) = delete;  // suppress assignment
+};
+
+#endif  // _SRC_THREAD_POOL_H_
@@ -16,6 +16,12 @@
 #include <string.h>  // for memset, strerror_r
 #include <sys/time.h>  // for timeval, gettimeofday, etc
 #include <time.h>  // for NULL, strftime, tm, etc
+#if defined(__x86_64__)
+#include <nmmintrin.h>  // for _mm_crc32_u64, _mm_crc32_u8
+#elif defined(__aarch64__)
+#include <arm_acle.h>  // for __crc32cd, __crc32cb
+#include <sys/auxv.h>  // for getauxval
+#endif
 #include <string>  // for string, operator==, etc
 
 #include "gep_common.h"  // for GepProtobufMessage
@@ -85,6 +91,18 @@ int64_t GetUnixTimeUsec() {
   return ((int64_t) tv.tv_sec * kUsecsPerSec) + tv.tv_usec;
 }
 
+int64_t GetMonotonicTimeUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((int64_t) ts.tv_sec * kUsecsPerSec) + ts.tv_nsec / kNsecsPerUsec;
+}
+
+int64_t GetThreadCpuTimeUsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ((int64_t) ts.tv_sec * kUsecsPerSec) + ts.tv_nsec / kNsecsPerUsec;
+}
+
 int nice_snprintf(char *str, size_t size, const char *format, ...) {
   va_list ap;
   int bi;
@@ -194,4 +212,74 @@ int snprintf_date(char *buf, int bufsize, const struct timeval *tvin,
   return bi;
 }
 
+// CRC32C (reflected Castagnoli polynomial), a byte at a time
+static uint32_t Crc32cSoftware(uint32_t crc, const uint8_t *data, int len) {
+  static const struct Table {
+    Table() {
+      for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+          crc = (crc >> 1) ^ (0x82f63b78 & (0 - (crc & 1)));
+        entries[i] = crc;
+      }
+    }
+    uint32_t entries[256];
+  } table;
+  for (int i = 0; i < len; ++i)
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t *data, int len) {
+  uint64_t crc64 = crc;
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = crc64;
+  for (; len > 0; ++data, --len)
+    crc = _mm_crc32_u8(crc, *data);
+  return crc;
+}
+
+static bool HasCrc32cHardware() {
+  return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t *data, int len) {
+  for (; len >= 8; data += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    crc = __crc32cd(crc, word);
+  }
+  for (; len > 0; ++data, --len)
+    crc = __crc32cb(crc, *data);
+  return crc;
+}
+
+static bool HasCrc32cHardware() {
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+static uint32_t Crc32cHardware(uint32_t crc, const uint8_t *data, int len) {
+  return Crc32cSoftware(crc, data, len);
+}
+
+static bool HasCrc32cHardware() {
+  return false;
+}
+#endif
+
+uint32_t Crc32c(uint32_t crc, const uint8_t *data, int len) {
+  static const bool hardware = HasCrc32cHardware();
+  crc = ~crc;
+  crc = hardware ? Crc32cHardware(crc, data, len) :
+      Crc32cSoftware(crc, data, len);
+  return ~crc;
+}
+
 }  // namespace libgep_utils
@@ -129,6 +129,13 @@ int64_t GetUnixTimeUsec();
 // Returns the current timestamp as an int64_t (seconds since unix epoch).
 int64_t GetUnixTimeSec();
 
+// Returns a monotonic timestamp as an int64_t (microseconds since an
+// arbitrary point). Use it to measure durations.
+int64_t GetMonotonicTimeUsec();
+
+// Returns the CPU time used by the calling thread (in microseconds).
+int64_t GetThreadCpuTimeUsec();
+
 // Fills the given buffer with a character string of the peer IP address
 // of the given socket. On error it inserts the string "unknown". In both
 // cases it returns a pointer to the beginning of the buffer.
@@ -148,6 +155,11 @@ int snprintf_hex(char *buf, int bufsize, const uint8_t *data, int len);
 // Prints a printable string into a buffer.
 int snprintf_printable(char *buf, int bufsize, const uint8_t *data, int len);
 
+// Returns the CRC32C (Castagnoli) of len bytes, continuing from the CRC of
+// the bytes before them (0 for none). It uses the CPU CRC instructions
+// (SSE4.2 or ARMv8) when there are.
+uint32_t Crc32c(uint32_t crc, const uint8_t *data, int len);
+
 const int kDateStringLen = 64;
 // Prints date (use tv=NULL for current) in a standard format (iso 8601).
 // Set "full" to true to print the whole date, false for a concise version.
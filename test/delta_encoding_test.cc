@@ -0,0 +1,75 @@
+// Copyright Google Inc. Apache 2.0.
+
+#include "delta_encoding.h"
+
+#include <gtest/gtest.h>  // for AssertHelper, TEST, etc
+#include <vector>  // for vector
+
+#include "test.pb.h"  // for Status
+
+using namespace libgep_utils;
+
+
+class DeltaEncodingTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    base_.set_id(1);
+    base_.set_name("a fairly long name that does not change");
+    base_.add_values(1);
+    base_.add_values(2);
+    base_.mutable_command()->set_a(3);
+  }
+
+  Status base_;
+};
+
+TEST_F(DeltaEncodingTest, OnlyChangedFields) {
+  Status msg(base_);
+  msg.set_id(2);
+  msg.add_values(3);
+
+  std::vector<int> fields;
+  Status diff;
+  DeltaEncode(base_, msg, &fields, &diff);
+  std::vector<int> expected_fields = {1, 3};
+  EXPECT_EQ(expected_fields, fields);
+  EXPECT_EQ(2, diff.id());
+  EXPECT_FALSE(diff.has_name());
+  EXPECT_EQ(3, diff.values_size());
+  EXPECT_FALSE(diff.has_command());
+
+  // the delta rebuilds the message
+  Status rebuilt(base_);
+  DeltaApply(fields, diff, &rebuilt);
+  EXPECT_EQ(msg.SerializeAsString(), rebuilt.SerializeAsString());
+}
+
+TEST_F(DeltaEncodingTest, ClearedFields) {
+  Status msg(base_);
+  msg.clear_name();
+  msg.clear_values();
+  msg.mutable_command()->set_b(4);
+
+  std::vector<int> fields;
+  Status diff;
+  DeltaEncode(base_, msg, &fields, &diff);
+  std::vector<int> expected_fields = {2, 3, 4};
+  EXPECT_EQ(expected_fields, fields);
+
+  Status rebuilt(base_);
+  DeltaApply(fields, diff, &rebuilt);
+  EXPECT_EQ(msg.SerializeAsString(), rebuilt.SerializeAsString());
+}
+
+TEST_F(DeltaEncodingTest, NoChanges) {
+  std::vector<int> fields;
+  Status diff;
+  DeltaEncode(base_, base_, &fields, &diff);
+  EXPECT_TRUE(fields.empty());
+  EXPECT_EQ(0, diff.ByteSizeLong());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
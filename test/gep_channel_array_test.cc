@@ -2,9 +2,15 @@
 
 #include "gep_channel_array.h"
 
+#include <map>  // for map
+#include <memory>  // for unique_ptr
+#include <netinet/in.h>  // for sockaddr_in, htonl, htons
+#include <sys/socket.h>  // for socket, connect, recv
 #include <unistd.h>  // for socklen_t, ssize_t
+#include <vector>  // for vector
 
 #include "gep_channel_array.h"  // for GepChannelArray
+#include "gep_client.h"  // for GepClient
 #include "gep_protocol.h"  // for GepProtocol
 #include "gep_test_lib.h"  // for TestServer, GepTest
 #include "gtest/gtest.h"  // for EXPECT_EQ, TEST_F
@@ -55,6 +61,47 @@ class FailingSocketInterface : public SocketInterface {
 };
 
 class GepChannelArrayTest : public GepTest {
+ protected:
+  // connects a client that does not read anything. Returns its socket
+  // (and its client id in id).
+  int ConnectSlowClient(int *id) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    // a small receive buffer fills up quickly
+    int rcvbuf = 4096;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_in saddr;
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(server_->GetPort());
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    EXPECT_EQ(0, connect(sock, (struct sockaddr *)&saddr, sizeof(saddr)));
+    EXPECT_TRUE(WaitForTrue([=]() { return server_->GetNumClients() == 2; }));
+    *id = server_->ids_.back();
+    return sock;
+  }
+
+  // broadcasts messages until the slow client is detected
+  bool FillSlowClient() {
+    GepChannelArray *gca = server_->GetGepChannelArray();
+    for (int i = 0; i < 100000 && server_->num_slow_clients_ == 0; ++i)
+      gca->SendMessage(command3_);
+    return server_->num_slow_clients_ == 1;
+  }
+
+  // reads from the slow client until it recovers
+  bool DrainSlowClient(int sock) {
+    return WaitForTrue([=]() {
+      char buf[4096];
+      while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+      return server_->num_slow_clients_ == 0;
+    });
+  }
+
+  GepSlowConsumerPolicy GetPolicy(GepSlowConsumerPolicy::Action action) {
+    GepSlowConsumerPolicy policy;
+    policy.max_queued_bytes = 4096;
+    policy.action = action;
+    return policy;
+  }
 };
 
 TEST_F(GepChannelArrayTest, FailingSendSocket) {
@@ -100,6 +147,221 @@ TEST_F(GepChannelArrayTest, FailingSendSocket) {
   gca->SetSocketInterface(old_socket_interface);
 }
 
+TEST_F(GepChannelArrayTest, ParallelBroadcast) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  EXPECT_EQ(1, gca->GetSendThreads());
+  gca->SetSendThreads(3);
+  EXPECT_EQ(3, gca->GetSendThreads());
+
+  // add some more clients
+  const int kNumClients = 5;
+  std::vector<std::unique_ptr<GepClient>> clients;
+  for (int i = 1; i < kNumClients; ++i) {
+    TestProtocol *proto = new TestProtocol(server_->GetPort());
+    proto->SetSelectTimeoutUsec(msecs_to_usecs(10));
+    clients.push_back(std::unique_ptr<GepClient>(new GepClient(
+        "gep_test_client", context_, proto, &kGepTestOps)));
+    EXPECT_EQ(0, clients.back()->Start());
+  }
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumClients() == kNumClients;
+  }));
+
+  // broadcast a message
+  GepSendResults results;
+  EXPECT_EQ(0, gca->SendMessage(command3_, &results));
+  EXPECT_EQ(kNumClients, results.size());
+  for (const auto &result : results)
+    EXPECT_EQ(0, result.second) << "client " << result.first;
+  EXPECT_TRUE(WaitForSync(kNumClients));
+
+  // go back to sequential sends
+  gca->SetSendThreads(1);
+  EXPECT_EQ(0, gca->SendMessage(command3_));
+  EXPECT_TRUE(WaitForSync(2 * kNumClients));
+  for (auto &client : clients)
+    client->Stop();
+}
+
+TEST_F(GepChannelArrayTest, SlowConsumerDrop) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  int slow_id;
+  int sock = ConnectSlowClient(&slow_id);
+  int fast_id = server_->ids_.front();
+  gca->SetSlowConsumerPolicy(
+      GetPolicy(GepSlowConsumerPolicy::ACTION_DROP));
+  ASSERT_TRUE(FillSlowClient());
+  EXPECT_TRUE(gca->GetGepChannel(slow_id)->IsSlow());
+
+  // messages to the slow client are dropped, the others go through
+  GepSendResults results;
+  EXPECT_EQ(-1, gca->SendMessage(command3_, &results));
+  EXPECT_EQ(-1, results[slow_id]);
+  EXPECT_EQ(0, results[fast_id]);
+  EXPECT_EQ(-1, gca->SendMessage(command3_, slow_id));
+
+  // the client recovers once it reads its data
+  EXPECT_TRUE(DrainSlowClient(sock));
+  EXPECT_FALSE(gca->GetGepChannel(slow_id)->IsSlow());
+  EXPECT_EQ(0, gca->SendMessage(command3_, slow_id));
+  close(sock);
+}
+
+TEST_F(GepChannelArrayTest, SlowConsumerConflate) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  int slow_id;
+  int sock = ConnectSlowClient(&slow_id);
+  gca->SetSlowConsumerPolicy(
+      GetPolicy(GepSlowConsumerPolicy::ACTION_CONFLATE));
+  ASSERT_TRUE(FillSlowClient());
+
+  // only the latest message of each tag is kept
+  std::shared_ptr<GepChannel> channel = gca->GetGepChannel(slow_id);
+  EXPECT_EQ(0, gca->SendMessage(command3_, slow_id));
+  EXPECT_EQ(0, gca->SendMessage(command3_, slow_id));
+  EXPECT_EQ(0, gca->SendMessage(command4_, slow_id));
+  EXPECT_EQ(2, channel->GetNumConflated());
+
+  // and sent once the client recovers
+  EXPECT_TRUE(DrainSlowClient(sock));
+  EXPECT_EQ(0, channel->GetNumConflated());
+  close(sock);
+}
+
+TEST_F(GepChannelArrayTest, SlowConsumerDisconnect) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  int slow_id;
+  int sock = ConnectSlowClient(&slow_id);
+  gca->SetSlowConsumerPolicy(
+      GetPolicy(GepSlowConsumerPolicy::ACTION_DISCONNECT));
+  ASSERT_TRUE(FillSlowClient());
+
+  // the slow client gets disconnected
+  EXPECT_TRUE(WaitForTrue([=]() { return server_->GetNumClients() == 1; }));
+  EXPECT_EQ(nullptr, gca->GetGepChannel(slow_id));
+  close(sock);
+}
+
+TEST_F(GepChannelArrayTest, SlowConsumerBackground) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  int slow_id;
+  int sock = ConnectSlowClient(&slow_id);
+  gca->SetSlowConsumerPolicy(
+      GetPolicy(GepSlowConsumerPolicy::ACTION_BACKGROUND));
+  ASSERT_TRUE(FillSlowClient());
+
+  // sends to the slow client are queued in the background lane
+  EXPECT_EQ(0, gca->SendMessage(command3_, slow_id));
+  EXPECT_TRUE(DrainSlowClient(sock));
+  EXPECT_EQ(0, gca->SendMessage(command3_, slow_id));
+  close(sock);
+}
+
+TEST_F(GepChannelArrayTest, RateLimitPause) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  GepRateLimitPolicy policy;
+  policy.channel.max_msgs_per_sec = 10;
+  policy.action = GepRateLimitPolicy::ACTION_PAUSE;
+  gca->SetRateLimitPolicy(policy);
+
+  // a burst over the limit is received at the limit rate
+  for (int i = 0; i < 15; ++i)
+    EXPECT_EQ(0, client_->Send(command1_));
+  EXPECT_TRUE(WaitForSync(10));
+  EXPECT_GT(15, GetSynced());
+  std::shared_ptr<GepChannel> channel =
+      gca->GetGepChannel(server_->ids_.front());
+  EXPECT_LT(0, channel->GetNumRateLimited());
+  EXPECT_TRUE(WaitForSync(15));
+  EXPECT_EQ(1, server_->GetNumClients());
+}
+
+TEST_F(GepChannelArrayTest, RateLimitDrop) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  GepRateLimitPolicy policy;
+  policy.tags[TestProtocol::MSG_TAG_COMMAND_1] = GepRateLimit(2, 0);
+  policy.action = GepRateLimitPolicy::ACTION_DROP;
+  gca->SetRateLimitPolicy(policy);
+
+  // only the limited tag is dropped
+  for (int i = 0; i < 10; ++i)
+    EXPECT_EQ(0, client_->Send(command1_));
+  EXPECT_EQ(0, client_->Send(command3_));
+  EXPECT_TRUE(WaitForSync(3));
+  std::shared_ptr<GepChannel> channel =
+      gca->GetGepChannel(server_->ids_.front());
+  EXPECT_TRUE(WaitForTrue([=]() {
+    return channel->GetNumRateLimited() == 8;
+  }));
+  EXPECT_EQ(3, GetSynced());
+
+  // the messages of a batch count one by one
+  EXPECT_EQ(0, client_->SendBatch({&command1_, &command1_, &command1_,
+                                   &command3_}));
+  EXPECT_TRUE(WaitForSync(4));
+  EXPECT_LE(10, channel->GetNumRateLimited());
+}
+
+TEST_F(GepChannelArrayTest, RateLimitDisconnect) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  GepRateLimitPolicy policy;
+  policy.channel.max_bytes_per_sec = 1;
+  policy.action = GepRateLimitPolicy::ACTION_DISCONNECT;
+  int id = server_->ids_.front();
+  gca->SetRateLimitPolicy(policy);
+
+  // the first message gets through, and the next one closes the connection
+  EXPECT_EQ(0, client_->Send(command1_));
+  EXPECT_TRUE(WaitForSync(1));
+  client_->Send(command1_);
+  EXPECT_TRUE(WaitForTrue([=]() { return gca->GetGepChannel(id) == nullptr; }));
+}
+
+TEST_F(GepChannelArrayTest, OverloadShedding) {
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  GepOverloadPolicy policy;
+  policy.max_loop_lag_usec = secs_to_usecs(1);
+  policy.min_priority = kGepPriorityHigh;
+  policy.hold_usec = secs_to_usecs(60);
+  gca->SetOverloadPolicy(policy);
+  server_->GetProto()->SetTagPriority(TestProtocol::MSG_TAG_COMMAND_3,
+                                      kGepPriorityHigh);
+  gca->UpdateOverload(0);
+  EXPECT_FALSE(gca->IsOverloaded());
+
+  // a long service loop overloads the server (for at least hold_usec)
+  gca->UpdateOverload(secs_to_usecs(2));
+  EXPECT_TRUE(gca->IsOverloaded());
+  gca->UpdateOverload(0);
+  EXPECT_TRUE(gca->IsOverloaded());
+
+  // outgoing messages with lower priority are shed (which is not an
+  // error), the others go through
+  EXPECT_EQ(0, gca->SendMessage(command4_));
+  EXPECT_EQ(0, gca->SendMessage(command3_));
+  EXPECT_TRUE(WaitForSync(1));
+  // (in batches too)
+  EXPECT_EQ(0, gca->SendBatch({&command4_, &command3_}));
+  EXPECT_TRUE(WaitForSync(2));
+
+  // and so are incoming ones
+  EXPECT_EQ(0, client_->Send(command1_));
+  EXPECT_TRUE(WaitForTrue([=]() {
+    return gca->GetShedCounters()[TestProtocol::MSG_TAG_COMMAND_1].inbound ==
+        1;
+  }));
+  std::map<uint32_t, GepShedCounters> counters = gca->GetShedCounters();
+  EXPECT_EQ(2, counters.size());
+  EXPECT_EQ(2, counters[TestProtocol::MSG_TAG_COMMAND_4].outbound);
+  EXPECT_EQ(2, GetSynced());
+
+  // nothing is shed once the server recovers
+  gca->SetOverloadPolicy(GepOverloadPolicy());
+  EXPECT_FALSE(gca->IsOverloaded());
+  EXPECT_EQ(0, gca->SendMessage(command4_));
+  EXPECT_TRUE(WaitForSync(3));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
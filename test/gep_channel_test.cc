@@ -2,8 +2,20 @@
 
 #include "gep_channel.h"  // for GepChannel
 
+#include <arpa/inet.h>  // for htonl
+#include <dirent.h>  // for opendir, readdir
+#include <functional>  // for function
+#include <memory>  // for unique_ptr
+#include <netinet/in.h>  // for sockaddr_in, INADDR_LOOPBACK
 #include <stdint.h>  // for int64_t, uint8_t
+#include <string.h>  // for memcpy
+#include <string>  // for to_string
+#include <sys/ioctl.h>  // for ioctl, FIONREAD
+#include <sys/socket.h>  // for socketpair
+#include <sys/time.h>  // for timeval
+#include <thread>  // for thread
 #include <unistd.h>  // for ssize_t
+#include <vector>  // for vector
 
 #include "gep_channel_array.h"  // for GepChannelArray
 #include "gep_client.h"  // for GepClient
@@ -44,7 +56,94 @@ class FlakySocketInterface: public SocketInterface {
   }
 };
 
+// connects a pair of TCP sockets over the loopback interface
+static int TcpSocketPair(int fds[2]) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrlen = sizeof(addr);
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&addr, &addrlen) < 0) {
+    close(listener);
+    return -1;
+  }
+  fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fds[0]);
+    close(listener);
+    return -1;
+  }
+  fds[1] = accept(listener, nullptr, nullptr);
+  close(listener);
+  return fds[1] < 0 ? -1 : 0;
+}
+
+// returns the number of open descriptors
+static int CountOpenFds() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr)
+    return -1;
+  int count = 0;
+  while (readdir(dir) != nullptr)
+    count++;
+  closedir(dir);
+  return count;
+}
+
+// a sender and a receiver channel connected through a socket pair
+struct ChannelPair {
+  int fds[2] = {-1, -1};
+  std::unique_ptr<GepChannel> sender;
+  std::unique_ptr<GepChannel> receiver;
+};
+
 class GepChannelTest : public GepTest {
+ public:
+  // returns a callback that records the tag of the received messages
+  static GepCallback RecordTag(std::vector<uint32_t> *tags, uint32_t tag) {
+    return [tags, tag](const GepProtobufMessage &msg, void *context) {
+      tags->push_back(tag);
+      return true;
+    };
+  }
+  // returns a callback that records the received status messages
+  static GepCallback RecordStatus(std::vector<Status> *received) {
+    return [received](const GepProtobufMessage &msg, void *context) {
+      received->push_back(static_cast<const Status &>(msg));
+      return true;
+    };
+  }
+  // same, only their ids
+  static GepCallback RecordStatusId(std::vector<int> *ids) {
+    return [ids](const GepProtobufMessage &msg, void *context) {
+      ids->push_back(static_cast<const Status &>(msg).id());
+      return true;
+    };
+  }
+
+  // connects the channels of pair through a Unix socket pair (or a TCP
+  // one). Returns false if the sockets cannot be created
+  static bool ConnectPair(GepProtocol *sproto, const GepVFT *sops,
+                          GepProtocol *rproto, const GepVFT *rops,
+                          ChannelPair *pair, bool tcp = false) {
+    int ret = tcp ? TcpSocketPair(pair->fds) :
+        socketpair(AF_UNIX, SOCK_STREAM, 0, pair->fds);
+    if (ret < 0)
+      return false;
+    pair->sender.reset(
+        new GepChannel(0, "sender", sproto, sops, nullptr, pair->fds[0]));
+    pair->receiver.reset(
+        new GepChannel(1, "receiver", rproto, rops, nullptr, pair->fds[1]));
+    return true;
+  }
+  // same, with the same protocol and GepVFT on both sides
+  static bool ConnectPair(GepProtocol *proto, const GepVFT *ops,
+                          ChannelPair *pair, bool tcp = false) {
+    return ConnectPair(proto, ops, proto, ops, pair, tcp);
+  }
 };
 
 TEST_F(GepChannelTest, SetSocket) {
@@ -130,6 +229,852 @@ TEST_F(GepChannelTest, FlakySendSocket) {
   gc->SetSocketInterface(old_socket_interface);
 }
 
+TEST_F(GepChannelTest, PriorityDispatch) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_1),
+                 kGepPriorityLow)},
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3)},
+    {TestProtocol::MSG_TAG_CONTROL,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_CONTROL),
+                 kGepPriorityHigh)},
+  };
+  TestProtocol proto(0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  // queue a burst of messages before the receiver reads any of them
+  EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.sender->SendMessage(control_message_ping_));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+
+  // the control message jumps ahead of the bulk ones
+  std::vector<uint32_t> expected_tags = {
+    TestProtocol::MSG_TAG_CONTROL,
+    TestProtocol::MSG_TAG_COMMAND_3,
+    TestProtocol::MSG_TAG_COMMAND_1,
+  };
+  EXPECT_EQ(expected_tags, tags);
+}
+
+TEST_F(GepChannelTest, PriorityDispatchCarriedMessages) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_STATUS),
+                 kGepPriorityLow)},
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3)},
+  };
+  TestProtocol proto(0);
+  proto.SetMaxMessageSize(TestProtocol::MSG_TAG_STATUS, 256 * 1024);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  // the chunks of a low-priority message sort as its tag
+  Status large;
+  large.set_name(std::string(100 * 1024, 'x'));
+  EXPECT_EQ(0, pair.sender->SendMessage(large));
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  std::vector<uint32_t> expected_tags = {
+    TestProtocol::MSG_TAG_COMMAND_3,
+    TestProtocol::MSG_TAG_STATUS,
+  };
+  EXPECT_EQ(expected_tags, tags);
+}
+
+TEST_F(GepChannelTest, ExecutorDispatch) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3),
+                 kGepPriorityNormal, "bulk")},
+    {TestProtocol::MSG_TAG_CONTROL,
+     RecordTag(&tags, TestProtocol::MSG_TAG_CONTROL)},
+  };
+  TestProtocol proto(0);
+  std::vector<std::function<void()>> tasks;
+  proto.SetExecutor("bulk", [&tasks](const std::function<void()> &task) {
+    tasks.push_back(task);
+  });
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.sender->SendMessage(control_message_ping_));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+
+  // only the inline message has been processed
+  ASSERT_EQ(1, tags.size());
+  EXPECT_EQ(TestProtocol::MSG_TAG_CONTROL, tags[0]);
+  ASSERT_EQ(1, tasks.size());
+
+  // run the executor
+  tasks[0]();
+  ASSERT_EQ(2, tags.size());
+  EXPECT_EQ(TestProtocol::MSG_TAG_COMMAND_3, tags[1]);
+}
+
+TEST_F(GepChannelTest, TagInterest) {
+  GepVFT sender_ops = {};
+  GepVFT receiver_ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3, &RecvMessageId<GepTest, Command3>},
+  };
+  TestProtocol proto(0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &sender_ops, &proto, &receiver_ops, &pair));
+
+  // before the advertisement, the peer is assumed to handle everything
+  EXPECT_TRUE(pair.sender->IsInterested(TestProtocol::MSG_TAG_COMMAND_3));
+  EXPECT_TRUE(pair.sender->IsInterested(TestProtocol::MSG_TAG_COMMAND_4));
+
+  // advertise the receiver tags
+  EXPECT_EQ(0, pair.receiver->SendInterest());
+  EXPECT_EQ(0, pair.sender->RecvData());
+  EXPECT_TRUE(pair.sender->IsInterested(TestProtocol::MSG_TAG_COMMAND_3));
+  EXPECT_FALSE(pair.sender->IsInterested(TestProtocol::MSG_TAG_COMMAND_4));
+  EXPECT_TRUE(pair.sender->IsInterested(GepProtocol::kTagSubscribe));
+
+  // a new connection forgets the old advertisement
+  pair.sender->Close();
+  EXPECT_TRUE(pair.sender->IsInterested(TestProtocol::MSG_TAG_COMMAND_4));
+}
+
+TEST_F(GepChannelTest, ConflateLatestValue) {
+  std::vector<int64_t> ids;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     [](const GepProtobufMessage &msg, void *context) { return true; }},
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     [&ids](const GepProtobufMessage &msg, void *context) {
+       ids.push_back(static_cast<const Command3 &>(msg).id());
+       return true;
+     }},
+  };
+  TestProtocol proto(0);
+  // conflate Command3 messages with the same id parity
+  proto.SetConflation(TestProtocol::MSG_TAG_COMMAND_3,
+                      [](const GepProtobufMessage &msg) {
+    return std::to_string(static_cast<const Command3 &>(msg).id() % 2);
+  });
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+  struct timeval tv = {1, 0};
+  setsockopt(pair.fds[1], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  SocketInterface *socket_interface = pair.sender->GetSocketInterface();
+
+  // conflated messages are written right away when the socket has room
+  command3_.set_id(0);
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.sender->GetNumConflated());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  ASSERT_EQ(1, ids.size());
+
+  // fill the socket
+  while (socket_interface->IsWritable(pair.fds[0]))
+    ASSERT_EQ(0, pair.sender->SendMessage(command1_));
+
+  // only the latest message per key is kept
+  for (int64_t id = 1; id <= 3; ++id) {
+    command3_.set_id(id);
+    EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  }
+  EXPECT_EQ(2, pair.sender->GetNumConflated());
+  EXPECT_TRUE(pair.sender->HasPendingData());
+
+  // drain the socket and write the pending messages
+  while (!socket_interface->IsWritable(pair.fds[0]))
+    ASSERT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(0, pair.sender->FlushConflated());
+  EXPECT_FALSE(pair.sender->HasPendingData());
+  for (int i = 0; i < 1000 && ids.size() < 3; ++i)
+    ASSERT_EQ(0, pair.receiver->RecvData());
+  std::vector<int64_t> expected_ids = {0, 2, 3};
+  EXPECT_EQ(expected_ids, ids);
+
+  // a timed-out send keeps the message for the next flush
+  FailingSocketInterface failing_socket_interface{};
+  failing_socket_interface.send_error_code_ = 0;
+  pair.sender->SetSocketInterface(&failing_socket_interface);
+  command3_.set_id(4);
+  EXPECT_EQ(-1, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(1, pair.sender->GetNumConflated());
+  pair.sender->SetSocketInterface(socket_interface);
+  EXPECT_EQ(0, pair.sender->FlushConflated());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  expected_ids.push_back(4);
+  EXPECT_EQ(expected_ids, ids);
+
+  // sessions conflate too, and go out when their parent flushes
+  // (the pair owns the parents)
+  std::shared_ptr<GepChannel> sender(pair.sender.get(), [](GepChannel *) {});
+  std::shared_ptr<GepChannel> receiver(pair.receiver.get(),
+                                       [](GepChannel *) {});
+  std::shared_ptr<GepChannel> sender_session(
+      new GepChannel(2, "sender_session", &proto, &ops, nullptr));
+  sender_session->SetParent(sender, 1);
+  pair.sender->AddSession(1, sender_session);
+  std::shared_ptr<GepChannel> receiver_session(
+      new GepChannel(3, "receiver_session", &proto, &ops, nullptr));
+  receiver_session->SetParent(receiver, 1);
+  pair.receiver->AddSession(1, receiver_session);
+  while (socket_interface->IsWritable(pair.fds[0]))
+    ASSERT_EQ(0, pair.sender->SendMessage(command1_));
+  for (int64_t id = 5; id <= 7; ++id) {
+    command3_.set_id(id);
+    EXPECT_EQ(0, sender_session->SendMessage(command3_));
+  }
+  EXPECT_EQ(2, sender_session->GetNumConflated());
+  EXPECT_TRUE(pair.sender->HasPendingData());
+  while (!socket_interface->IsWritable(pair.fds[0]))
+    ASSERT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(0, pair.sender->FlushConflated());
+  EXPECT_EQ(0, sender_session->GetNumConflated());
+  expected_ids.push_back(6);
+  expected_ids.push_back(7);
+  for (int i = 0; i < 1000 && ids.size() < expected_ids.size(); ++i)
+    ASSERT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(expected_ids, ids);
+  pair.sender->DelSession(1);
+  pair.receiver->DelSession(1);
+}
+
+TEST_F(GepChannelTest, DeltaEncoding) {
+  std::vector<Status> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatus(&received)},
+  };
+  TestProtocol proto(0);
+#ifdef GEP_LITE
+  // delta encoding needs protobuf reflection
+  EXPECT_EQ(-1, proto.SetDelta(TestProtocol::MSG_TAG_STATUS, nullptr));
+#else
+  // one keyframe every 3 messages
+  ASSERT_EQ(0, proto.SetDelta(TestProtocol::MSG_TAG_STATUS, nullptr, 3));
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  Status status;
+  status.set_name(std::string(200, 'x'));
+  std::vector<int> sizes;
+  for (int64_t id = 0; id < 4; ++id) {
+    status.set_id(id);
+    EXPECT_EQ(0, pair.sender->SendMessage(status));
+    int bytes;
+    ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+    sizes.push_back(bytes);
+    EXPECT_EQ(0, pair.receiver->RecvData());
+  }
+
+  // the receiver gets the full messages
+  ASSERT_EQ(4, received.size());
+  for (int64_t id = 0; id < 4; ++id) {
+    EXPECT_EQ(id, received[id].id());
+    EXPECT_EQ(status.name(), received[id].name());
+  }
+  // keyframes carry the name, deltas only the id
+  EXPECT_GT(sizes[0], 200);
+  EXPECT_LT(sizes[1], 100);
+  EXPECT_LT(sizes[2], 100);
+  EXPECT_GT(sizes[3], 200);
+#endif
+}
+
+TEST_F(GepChannelTest, FlowControl) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3),
+                 kGepPriorityNormal, "bulk")},
+  };
+  TestProtocol proto(0);
+  proto.SetFlowControl(2, 0);
+  std::vector<std::function<void()>> tasks;
+  proto.SetExecutor("bulk", [&tasks](const std::function<void()> &task) {
+    tasks.push_back(task);
+  });
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  // messages over the window wait for credits
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(2, pair.sender->GetNumQueued());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  ASSERT_EQ(2, tasks.size());
+
+  // credits are granted as the callbacks complete
+  tasks[0]();
+  EXPECT_EQ(0, pair.sender->RecvData());
+  EXPECT_EQ(1, pair.sender->GetNumQueued());
+  tasks[1]();
+  EXPECT_EQ(0, pair.sender->RecvData());
+  EXPECT_EQ(0, pair.sender->GetNumQueued());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  ASSERT_EQ(4, tasks.size());
+  tasks[2]();
+  tasks[3]();
+  EXPECT_EQ(4, tags.size());
+  EXPECT_EQ(0, pair.sender->RecvData());
+
+  // control messages do not need credits
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(1, pair.sender->GetNumQueued());
+  EXPECT_EQ(0, pair.sender->SendInterest());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_FALSE(pair.receiver->IsInterested(TestProtocol::MSG_TAG_COMMAND_1));
+  // the channels wait for their tasks
+  ASSERT_EQ(6, tasks.size());
+  tasks[4]();
+  tasks[5]();
+
+  // closing the channel drops the messages still waiting for credits
+  EXPECT_EQ(0, pair.sender->GetNumDropped());
+  pair.sender->Close();
+  EXPECT_EQ(0, pair.sender->GetNumQueued());
+  EXPECT_EQ(1, pair.sender->GetNumDropped());
+}
+
+TEST_F(GepChannelTest, FlowControlSendFailure) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3))},
+  };
+  TestProtocol proto(0);
+  proto.SetFlowControl(1, 0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+  for (int i = 0; i < 3; ++i)
+    EXPECT_EQ(0, pair.sender->SendMessage(command3_));
+  EXPECT_EQ(2, pair.sender->GetNumQueued());
+  // the credit comes back, but the queued message cannot be sent
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(1, tags.size());
+  ASSERT_EQ(0, shutdown(pair.fds[0], SHUT_WR));
+  pair.sender->RecvData();
+  EXPECT_EQ(1, pair.sender->GetNumDropped());
+  EXPECT_EQ(1, pair.sender->GetNumQueued());
+}
+
+TEST_F(GepChannelTest, MemfdLargePayload) {
+  std::vector<Status> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatus(&received)},
+  };
+  TestProtocol proto(0);
+  // descriptors are only read from Unix domain sockets
+  proto.SetUnixPath("@gep_channel_test");
+  proto.SetMemfdThreshold(4096);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+  int open_fds = CountOpenFds();
+
+  // larger than a GEP message
+  Status large;
+  large.set_id(1);
+  large.set_name(std::string(3 * GepProtocol::kMaxMsgLen, 'x'));
+  Status small;
+  small.set_id(2);
+  small.set_name("small");
+  EXPECT_EQ(0, pair.sender->SendMessage(large));
+  EXPECT_EQ(0, pair.sender->SendMessage(small));
+  // only the small message went through the socket
+  int bytes;
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_LT(bytes, 200);
+  // reads stop at the data that carry a descriptor
+  for (int i = 0; i < 4 && received.size() < 2; ++i)
+    EXPECT_EQ(0, pair.receiver->RecvData());
+
+  ASSERT_EQ(2, received.size());
+  EXPECT_EQ(1, received[0].id());
+  EXPECT_EQ(large.name(), received[0].name());
+  EXPECT_EQ(2, received[1].id());
+  EXPECT_EQ(small.name(), received[1].name());
+  // the memfd was closed on both sides
+  EXPECT_EQ(open_fds, CountOpenFds());
+
+  // descriptors passed with other frames are closed
+  std::string frame(proto.GetHdrLen(), '\0');
+  std::string value;
+  ASSERT_TRUE(proto.Serialize(small, &value));
+  proto.PrintHeader(TestProtocol::MSG_TAG_STATUS, value.length(),
+                    reinterpret_cast<uint8_t *>(&frame[0]));
+  frame += value;
+  struct iovec iov = {&frame[0], frame.length()};
+  union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &pair.fds[0], sizeof(int));
+  ASSERT_EQ(frame.length(), sendmsg(pair.fds[0], &msg, 0));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  ASSERT_EQ(3, received.size());
+  EXPECT_EQ(open_fds, CountOpenFds());
+}
+
+TEST_F(GepChannelTest, ChunkedLargePayload) {
+  std::vector<Status> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatus(&received)},
+  };
+  TestProtocol sproto(0);
+  TestProtocol rproto(0);
+  sproto.SetMaxMessageSize(TestProtocol::MSG_TAG_STATUS, 256 * 1024);
+  rproto.SetMaxMessageSize(TestProtocol::MSG_TAG_STATUS, 100 * 1024);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&sproto, &ops, &rproto, &ops, &pair));
+  auto drain = [&]() {
+    int bytes;
+    while (ioctl(pair.fds[1], FIONREAD, &bytes) == 0 && bytes > 0)
+      pair.receiver->RecvData();
+  };
+
+  Status large;
+  large.set_id(1);
+  large.set_name(std::string(150 * 1024, 'x'));
+  Status small;
+  small.set_id(2);
+  small.set_name("small");
+
+  // the sender does not chunk messages above its maximum size
+  Status huge;
+  huge.set_name(std::string(300 * 1024, 'x'));
+  EXPECT_EQ(-1, pair.sender->SendMessage(huge));
+
+  // the receiver drops the chunks of messages above its maximum size
+  EXPECT_EQ(0, pair.sender->SendMessage(large));
+  EXPECT_EQ(0, pair.sender->SendMessage(small));
+  drain();
+  ASSERT_EQ(1, received.size());
+  EXPECT_EQ(2, received[0].id());
+
+  // and reassembles the others
+  received.clear();
+  rproto.SetMaxMessageSize(TestProtocol::MSG_TAG_STATUS, 256 * 1024);
+  EXPECT_EQ(0, pair.sender->SendMessage(large));
+  EXPECT_EQ(0, pair.sender->SendMessage(small));
+  drain();
+  ASSERT_EQ(2, received.size());
+  EXPECT_EQ(1, received[0].id());
+  EXPECT_EQ(large.name(), received[0].name());
+  EXPECT_EQ(2, received[1].id());
+}
+
+TEST_F(GepChannelTest, ZeroCopyLargePayload) {
+  std::vector<Status> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatus(&received)},
+  };
+  TestProtocol proto(0);
+  proto.SetZeroCopyThreshold(4096);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair, true));
+
+  Status large;
+  large.set_id(1);
+  large.set_name(std::string(100 * 1024, 'x'));
+  std::shared_ptr<std::string> buf(new std::string());
+  ASSERT_TRUE(proto.Serialize(large, buf.get()));
+  EXPECT_EQ(0, pair.sender->SendBuffer(TestProtocol::MSG_TAG_STATUS, buf));
+  large.set_id(2);
+  EXPECT_EQ(0, pair.sender->SendMessage(large));
+  for (int i = 0; i < 100 && received.size() < 2; ++i) {
+    int bytes;
+    if (ioctl(pair.fds[1], FIONREAD, &bytes) == 0 && bytes > 0)
+      EXPECT_EQ(0, pair.receiver->RecvData());
+    else
+      usleep(10000);
+  }
+  ASSERT_EQ(2, received.size());
+  EXPECT_EQ(1, received[0].id());
+  EXPECT_EQ(large.name(), received[0].name());
+  EXPECT_EQ(2, received[1].id());
+
+  // the sender keeps the buffer until the kernel reports the send
+  // complete (if the socket supports zero-copy sends)
+  for (int i = 0; i < 100 && buf.use_count() > 1; ++i) {
+    EXPECT_EQ(0, pair.sender->RecvData());
+    usleep(10000);
+  }
+  EXPECT_EQ(1, buf.use_count());
+
+  // and closing the channel waits for it
+  EXPECT_EQ(0, pair.sender->SendBuffer(TestProtocol::MSG_TAG_STATUS, buf));
+  pair.sender->Close();
+  EXPECT_EQ(1, buf.use_count());
+  EXPECT_EQ(0, GepChannel::GetNumZeroCopyOrphaned());
+}
+
+TEST_F(GepChannelTest, BulkLane) {
+  std::vector<Status> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatus(&received)},
+  };
+  TestProtocol sproto(0);
+  TestProtocol rproto(0);
+  // bulk messages are chunked with no maximum size set
+  for (TestProtocol *proto : {&sproto, &rproto})
+    proto->SetBulkTag(TestProtocol::MSG_TAG_STATUS);
+  EXPECT_EQ((int)GepProtocol::kMaxMsgLen,
+            sproto.GetMaxMessageSize(TestProtocol::MSG_TAG_STATUS));
+  const int kBulkQueueBytes = 100 * 1024;
+  sproto.SetBulkQueueBytes(kBulkQueueBytes);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&sproto, &ops, &rproto, &ops, &pair));
+
+  Status large;
+  large.set_id(1);
+  large.set_name(std::string(400 * 1024, 'x'));
+  Status small;
+  small.set_id(2);
+  small.set_name("small");
+
+  // the large message stops once the socket holds kBulkQueueBytes
+  int ret = -1;
+  std::thread bulk([&]() { ret = pair.sender->SendMessage(large); });
+  int64_t max_usec = GetUnixTimeUsec() + secs_to_usecs(1);
+  while (pair.sender->GetQueuedBytes() < kBulkQueueBytes &&
+         GetUnixTimeUsec() < max_usec)
+    std::this_thread::yield();
+  // and the small one goes ahead of its remaining chunks
+  EXPECT_EQ(0, pair.sender->SendMessage(small));
+  while (received.size() < 2 && GetUnixTimeUsec() < max_usec) {
+    int bytes;
+    if (ioctl(pair.fds[1], FIONREAD, &bytes) == 0 && bytes > 0)
+      pair.receiver->RecvData();
+    else
+      std::this_thread::yield();
+  }
+  bulk.join();
+  EXPECT_EQ(0, ret);
+  ASSERT_EQ(2, received.size());
+  EXPECT_EQ(2, received[0].id());
+  EXPECT_EQ(1, received[1].id());
+  EXPECT_EQ(large.name(), received[1].name());
+}
+
+TEST_F(GepChannelTest, ResyncAfterBadFrames) {
+  std::vector<int> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatusId(&received)},
+  };
+  TestProtocol sproto(0);
+  TestProtocol rproto(0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&sproto, &ops, &rproto, &ops, &pair));
+  auto send_garbage = [&](const std::string &garbage) {
+    ASSERT_EQ(garbage.length(),
+              write(pair.fds[0], garbage.data(), garbage.length()));
+  };
+  auto send_status = [&](int id) {
+    Status status;
+    status.set_id(id);
+    EXPECT_EQ(0, pair.sender->SendMessage(status));
+  };
+
+  // bad frames drop the connection by default
+  send_garbage("garbage");
+  send_status(1);
+  EXPECT_EQ(-1, pair.receiver->RecvData());
+  EXPECT_TRUE(received.empty());
+
+  // or cost only the frames in between, with resync enabled (including
+  // bytes that look like the start of a header)
+  rproto.SetResync(true);
+  send_garbage("g ge gep geppXXXXgarbage");
+  send_status(2);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(1, pair.receiver->GetNumResyncs());
+
+  // a valid magic number with an invalid length
+  send_garbage(std::string("gepp\0\0\0\0\xff\xff\xff\xff", 12));
+  send_status(3);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(2, pair.receiver->GetNumResyncs());
+
+  // a header prefix at the end of the data may continue later
+  send_garbage("garbage garbage ge");
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  send_status(4);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(4, pair.receiver->GetNumResyncs());
+  EXPECT_EQ(std::vector<int>({2, 3, 4}), received);
+}
+
+TEST_F(GepChannelTest, ChecksumMismatch) {
+  std::vector<int> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, RecordStatusId(&received)},
+  };
+  TestProtocol sproto(0);
+  TestProtocol rproto(0);
+  sproto.SetChecksum(true);
+  rproto.SetChecksum(true);
+  rproto.SetResync(true);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&sproto, &ops, &rproto, &ops, &pair));
+  // a frame with a valid header and value, and a wrong checksum
+  auto send_corrupted = [&](int id) {
+    Status status;
+    status.set_id(id);
+    std::string value;
+    ASSERT_TRUE(sproto.Serialize(status, &value));
+    uint8_t hdr[GepProtocol::GetHdrLen()];
+    sproto.PrintHeader(TestProtocol::MSG_TAG_STATUS, value.length(), hdr);
+    std::string frame(reinterpret_cast<char *>(hdr), sizeof(hdr));
+    frame += value + std::string(GepProtocol::kChecksumLen, '\0');
+    ASSERT_EQ(frame.length(),
+              write(pair.fds[0], frame.data(), frame.length()));
+  };
+  auto send_status = [&](int id) {
+    Status status;
+    status.set_id(id);
+    EXPECT_EQ(0, pair.sender->SendMessage(status));
+  };
+
+  // negotiate checksums (as a client does when it connects)
+  EXPECT_EQ(0, pair.sender->SendString(GepProtocol::kTagChecksum,
+                                  std::string(1, '\x01')));
+  EXPECT_EQ(0, pair.receiver->RecvData());  // offer
+  EXPECT_EQ(0, pair.sender->RecvData());  // accept
+  send_status(1);
+  EXPECT_EQ(0, pair.receiver->RecvData());  // switch, and message
+  EXPECT_EQ(std::vector<int>({1}), received);
+
+  // a wrong checksum costs the frame
+  send_corrupted(2);
+  send_status(3);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(1, pair.receiver->GetNumChecksumErrors());
+  EXPECT_EQ(std::vector<int>({1, 3}), received);
+
+  // or the connection, without resync
+  rproto.SetResync(false);
+  send_corrupted(4);
+  EXPECT_EQ(-1, pair.receiver->RecvData());
+  EXPECT_EQ(2, pair.receiver->GetNumChecksumErrors());
+  EXPECT_EQ(0, pair.sender->GetNumChecksumErrors());
+}
+
+TEST_F(GepChannelTest, BatchFrames) {
+  // (the ids of each batch of status messages, and -1 for commands)
+  std::vector<std::vector<int>> received;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_STATUS, GepVFTEntry::Batch(
+        [&received](const std::vector<const GepProtobufMessage *> &msgs,
+                    void *context) {
+          std::vector<int> ids;
+          for (const GepProtobufMessage *msg : msgs)
+            ids.push_back(static_cast<const Status *>(msg)->id());
+          received.push_back(ids);
+          return true;
+        })},
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     [&received](const GepProtobufMessage &msg, void *context) {
+       received.push_back({-1});
+       return true;
+     }},
+  };
+  TestProtocol proto(0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+  Status status[3];
+  for (int i = 0; i < 3; ++i)
+    status[i].set_id(i + 1);
+
+  // one frame: the batch callback gets all the status messages at the
+  // position of the first one
+  EXPECT_EQ(0, pair.sender->SendBatch({&status[0], &command1_, &status[1],
+                                  &status[2]}));
+  int bytes = 0;
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(std::vector<std::vector<int>>({{1, 2, 3}, {-1}}), received);
+
+  // the batch costs one header
+  std::string s;
+  int value_bytes = 0;
+  for (const GepProtobufMessage *msg :
+       std::vector<const GepProtobufMessage *>({&status[0], &command1_,
+                                                &status[1], &status[2]})) {
+    ASSERT_TRUE(proto.Serialize(*msg, &s));
+    value_bytes += 8 + s.length();
+  }
+  EXPECT_EQ(GepProtocol::GetHdrLen() + value_bytes, bytes);
+
+  // messages sent on their own come in batches of one
+  received.clear();
+  EXPECT_EQ(0, pair.sender->SendMessage(status[0]));
+  EXPECT_EQ(0, pair.sender->SendBatch({&status[1]}));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(std::vector<std::vector<int>>({{1}, {2}}), received);
+
+  // load shedding and the rate limits apply to each message of a batch
+  received.clear();
+  pair.receiver->SetShedCallback([](uint32_t tag, int priority) {
+    return tag == TestProtocol::MSG_TAG_COMMAND_1;
+  });
+  GepRateLimitPolicy policy;
+  policy.tags[TestProtocol::MSG_TAG_STATUS] = GepRateLimit(2, 0);
+  policy.action = GepRateLimitPolicy::ACTION_DROP;
+  pair.receiver->SetRateLimitPolicy(policy);
+  EXPECT_EQ(0, pair.sender->SendBatch({&command1_, &status[0], &status[1],
+                                       &status[2]}));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(std::vector<std::vector<int>>({{1, 2}}), received);
+  EXPECT_EQ(1, pair.receiver->GetNumRateLimited());
+
+  // a batch over the limits is received, and pauses the frames after it
+  received.clear();
+  policy.tags[TestProtocol::MSG_TAG_STATUS] = GepRateLimit(1, 0);
+  policy.action = GepRateLimitPolicy::ACTION_PAUSE;
+  pair.receiver->SetRateLimitPolicy(policy);
+  EXPECT_EQ(0, pair.sender->SendBatch(
+      std::vector<const GepProtobufMessage *>({&status[0], &status[1]})));
+  EXPECT_EQ(0, pair.sender->SendMessage(status[2]));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(std::vector<std::vector<int>>({{1, 2}}), received);
+  EXPECT_TRUE(pair.receiver->IsRecvPaused());
+}
+
+TEST_F(GepChannelTest, SendCoalescing) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_1)},
+    {TestProtocol::MSG_TAG_COMMAND_2,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_2)},
+  };
+  TestProtocol proto(0);
+  std::string s1, s2;
+  ASSERT_TRUE(proto.Serialize(command1_, &s1));
+  ASSERT_TRUE(proto.Serialize(command2_, &s2));
+  int frame_bytes = 2 * GepProtocol::GetHdrLen() + s1.length() + s2.length();
+  // (corked: writes only at the threshold or on Flush())
+  proto.SetCoalescing(2 * frame_bytes, 0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  // the frames wait in the sender
+  EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+  EXPECT_EQ(0, pair.sender->SendMessage(command2_));
+  int bytes = -1;
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_EQ(0, bytes);
+  EXPECT_EQ(0, pair.sender->FlushCoalesced());
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_EQ(0, bytes);
+
+  // until flushed, in one write
+  EXPECT_EQ(0, pair.sender->Flush());
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_EQ(frame_bytes, bytes);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(std::vector<uint32_t>({TestProtocol::MSG_TAG_COMMAND_1,
+                                   TestProtocol::MSG_TAG_COMMAND_2}), tags);
+
+  // or until the buffer reaches the threshold
+  tags.clear();
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+    EXPECT_EQ(0, pair.sender->SendMessage(command2_));
+  }
+  ASSERT_EQ(0, ioctl(pair.fds[1], FIONREAD, &bytes));
+  EXPECT_EQ(2 * frame_bytes, bytes);
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(4, tags.size());
+
+  // the frames of a failed write count as dropped
+  EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+  pair.receiver->Close();
+  EXPECT_EQ(-1, pair.sender->Flush());
+  EXPECT_EQ(1, pair.sender->GetNumDropped());
+}
+
+TEST_F(GepChannelTest, PriorityDispatchSessions) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_1)},
+  };
+  GepVFT session_ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     GepVFTEntry(RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_3),
+                 kGepPriorityHigh)},
+  };
+  TestProtocol proto(0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+  // (the pair owns the parents)
+  std::shared_ptr<GepChannel> sender(pair.sender.get(), [](GepChannel *) {});
+  std::shared_ptr<GepChannel> receiver(pair.receiver.get(),
+                                       [](GepChannel *) {});
+  std::shared_ptr<GepChannel> sender_session(
+      new GepChannel(2, "sender_session", &proto, &session_ops, nullptr));
+  sender_session->SetParent(sender, 1);
+  std::shared_ptr<GepChannel> receiver_session(
+      new GepChannel(3, "receiver_session", &proto, &session_ops, nullptr));
+  receiver_session->SetParent(receiver, 1);
+  pair.receiver->AddSession(1, receiver_session);
+
+  // session frames sort as the message they carry, in the GepVFT of the
+  // session
+  EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+  EXPECT_EQ(0, sender_session->SendMessage(command3_));
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  std::vector<uint32_t> expected_tags = {
+    TestProtocol::MSG_TAG_COMMAND_3,
+    TestProtocol::MSG_TAG_COMMAND_1,
+  };
+  EXPECT_EQ(expected_tags, tags);
+  pair.receiver->DelSession(1);
+}
+
+TEST_F(GepChannelTest, CorkedFlowControl) {
+  std::vector<uint32_t> tags;
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_1,
+     RecordTag(&tags, TestProtocol::MSG_TAG_COMMAND_1)},
+  };
+  TestProtocol proto(0);
+  proto.SetFlowControl(2, 0);
+  proto.SetCoalescing(64 * 1024, 0);
+  ChannelPair pair;
+  ASSERT_TRUE(ConnectPair(&proto, &ops, &pair));
+
+  // messages over the window wait for credits
+  for (int i = 0; i < 4; ++i)
+    EXPECT_EQ(0, pair.sender->SendMessage(command1_));
+  EXPECT_EQ(2, pair.sender->GetNumQueued());
+  EXPECT_EQ(0, pair.sender->Flush());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(2, tags.size());
+
+  // a corked receiver that only consumes still sends its credits
+  EXPECT_EQ(0, pair.sender->RecvData());
+  EXPECT_EQ(0, pair.sender->GetNumQueued());
+  EXPECT_EQ(0, pair.sender->Flush());
+  EXPECT_EQ(0, pair.receiver->RecvData());
+  EXPECT_EQ(4, tags.size());
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <atomic>
 #include <functional>
+#include <gep_channel.h>
+#include <gep_channel_array.h>
 #include <gep_protocol.h>
 #include <gep_client.h>
 #include <gep_server.h>
@@ -12,7 +14,8 @@
 #include <mutex>
 #include <stddef.h>  // for NULL
 #include <string>  // for string
-#include <unistd.h>  // for usleep
+#include <sys/socket.h>  // for socket, bind
+#include <unistd.h>  // for access, close, getpid, usleep
 
 #include "../src/utils.h"
 #include "gep_test_lib.h"
@@ -31,6 +34,10 @@ class GepEndToEndTest : public GepTest {
  public:
   void SenderPusherThread();
   void SenderLockThread();
+  // restarts the client and the server (to apply protocol changes)
+  void Restart();
+  // restarts the client and the server over a Unix domain socket
+  void RestartOverUnix(const std::string &path);
 };
 
 TEST_F(GepEndToEndTest, BasicEndToEnd) {
@@ -169,6 +176,370 @@ TEST_F(GepEndToEndTest, EndToEndBinaryProtocol) {
   WaitForSync(2);
 }
 
+void GepEndToEndTest::Restart() {
+  client_->Stop();
+  server_->Stop();
+  ASSERT_EQ(0, server_->Start());
+  cproto_->SetPort(sproto_->GetPort());
+  ASSERT_EQ(0, client_->Start());
+  // ensure the server has seen the client
+  ASSERT_TRUE(WaitForTrue([=]() {return server_->GetNumClients() != 0;}));
+}
+
+void GepEndToEndTest::RestartOverUnix(const std::string &path) {
+  sproto_->SetUnixPath(path);
+  cproto_->SetUnixPath(path);
+  Restart();
+}
+
+TEST_F(GepEndToEndTest, UnixEndToEnd) {
+  std::string path = "/tmp/gep_end_to_end_test." + std::to_string(getpid());
+  // leave a stale socket behind: the server must replace it
+  TestProtocol proto(0);
+  proto.SetUnixPath(path);
+  struct sockaddr_storage saddr;
+  socklen_t saddr_len = proto.GetSockAddr(&saddr);
+  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+  ASSERT_EQ(0, bind(sock, (struct sockaddr *)&saddr, saddr_len));
+  close(sock);
+  EXPECT_EQ(0, access(path.c_str(), F_OK));
+  RestartOverUnix(path);
+
+  // push message in the client
+  client_->Send(command1_);
+
+  // push message in the server
+  server_->Send(command3_);
+
+  WaitForSync(2);
+  EXPECT_EQ(0, client_->GetReconnectCount());
+
+  // the socket is removed on stop
+  client_->Stop();
+  server_->Stop();
+  EXPECT_NE(0, access(path.c_str(), F_OK));
+  EXPECT_EQ(0, server_->Start());
+  EXPECT_EQ(0, client_->Start());
+}
+
+TEST_F(GepEndToEndTest, AbstractUnixEndToEnd) {
+  RestartOverUnix("@gep_end_to_end_test." + std::to_string(getpid()));
+
+  // push message in the client
+  client_->Send(command1_);
+
+  // push message in the server
+  server_->Send(command3_);
+
+  WaitForSync(2);
+  EXPECT_EQ(0, client_->GetReconnectCount());
+}
+
+TEST_F(GepEndToEndTest, SharedMemoryEndToEnd) {
+  sproto_->SetSharedMemory(4096);
+  cproto_->SetSharedMemory(4096);
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(id);
+  GepChannel *cchannel = client_->GetGepChannel();
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return schannel->IsSharedMemory() && cchannel->IsSharedMemory();
+  }));
+
+  // push more messages than the rings can hold at once
+  const int kNumMessages = 1000;
+  for (int i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(0, client_->Send(command1_));
+    EXPECT_EQ(0, server_->Send(command3_));
+  }
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages));
+  EXPECT_EQ(2 * kNumMessages, GetSynced());
+  EXPECT_EQ(0, client_->GetReconnectCount());
+
+  // the server sees the client closing the socket
+  client_->Stop();
+  EXPECT_TRUE(WaitForTrue([=]() {return server_->GetNumClients() == 0;}));
+  EXPECT_EQ(0, client_->Start());
+}
+
+TEST_F(GepEndToEndTest, SharedMemoryFallback) {
+  // the server does not support shared memory
+  cproto_->SetSharedMemory(4096);
+  Restart();
+
+  client_->Send(command1_);
+  server_->Send(command3_);
+
+  WaitForSync(2);
+  EXPECT_FALSE(client_->GetGepChannel()->IsSharedMemory());
+  EXPECT_EQ(0, client_->GetReconnectCount());
+
+  // nor rings larger than its own
+  sproto_->SetSharedMemory(4096);
+  cproto_->SetSharedMemory(65536);
+  Restart();
+
+  client_->Send(command1_);
+  server_->Send(command3_);
+
+  EXPECT_TRUE(WaitForSync(4));
+  EXPECT_FALSE(client_->GetGepChannel()->IsSharedMemory());
+}
+
+TEST_F(GepEndToEndTest, InProcessEndToEnd) {
+  sproto_->SetInProcess(4096, true);
+  cproto_->SetInProcess(4096, true);
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(id);
+  GepChannel *cchannel = client_->GetGepChannel();
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return schannel->IsInProcess() && cchannel->IsInProcess();
+  }));
+
+  // push more messages than the object slots can hold at once (the rest
+  // are serialized)
+  const int kNumMessages = 2000;
+  for (int i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(0, client_->Send(command1_));
+    EXPECT_EQ(0, server_->Send(command3_, id));
+  }
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages));
+  EXPECT_EQ(2 * kNumMessages, GetSynced());
+  EXPECT_EQ(0, client_->GetReconnectCount());
+
+  // the server sees the client closing the socket
+  client_->Stop();
+  EXPECT_TRUE(WaitForTrue([=]() {return server_->GetNumClients() == 0;}));
+  EXPECT_EQ(0, client_->Start());
+}
+
+TEST_F(GepEndToEndTest, InProcessFallback) {
+  // the server only supports shared memory (as if it were in another
+  // process)
+  sproto_->SetSharedMemory(4096);
+  cproto_->SetInProcess(4096, true);
+  cproto_->SetSharedMemory(4096);
+  Restart();
+  GepChannel *cchannel = client_->GetGepChannel();
+  ASSERT_TRUE(WaitForTrue([&]() { return cchannel->IsSharedMemory(); }));
+  EXPECT_FALSE(cchannel->IsInProcess());
+
+  client_->Send(command1_);
+  server_->Send(command3_);
+
+  WaitForSync(2);
+  EXPECT_EQ(0, client_->GetReconnectCount());
+}
+
+// context of a client session
+struct SessionContext {
+  std::atomic<int> received;
+};
+
+TEST_F(GepEndToEndTest, SessionsEndToEnd) {
+  const int kNumSessions = 3;
+  SessionContext contexts[kNumSessions];
+  GepVFT session_ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     [](const GepProtobufMessage &msg, void *context) {
+       GepChannel *channel = static_cast<GepChannel *>(context);
+       static_cast<SessionContext *>(channel->GetContext())->received++;
+       return true;
+     }},
+  };
+  int sessions[kNumSessions];
+  for (int i = 0; i < kNumSessions; ++i) {
+    contexts[i].received = 0;
+    sessions[i] = client_->AddSession(&contexts[i], &session_ops);
+    EXPECT_LT(0, sessions[i]);
+  }
+  // the server sees each session as a client
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumClients() == 1 + kNumSessions;
+  }));
+  ASSERT_EQ(1 + kNumSessions, server_->ids_.size());
+
+  // sessions send to the server callbacks
+  for (int i = 0; i < kNumSessions; ++i)
+    EXPECT_EQ(0, client_->Send(command1_, sessions[i]));
+  EXPECT_TRUE(WaitForSync(kNumSessions));
+
+  // the server sends to a single session
+  EXPECT_EQ(0, server_->Send(command3_, server_->ids_[2]));
+  EXPECT_TRUE(WaitForTrue([&]() { return contexts[1].received == 1; }));
+  EXPECT_EQ(0, contexts[0].received);
+  EXPECT_EQ(0, contexts[2].received);
+  EXPECT_EQ(kNumSessions, GetSynced());
+
+  // or to all the clients and sessions
+  EXPECT_EQ(0, server_->Send(command3_));
+  EXPECT_TRUE(WaitForSync(kNumSessions + 1));
+  EXPECT_TRUE(WaitForTrue([&]() {
+    return contexts[0].received == 1 && contexts[1].received == 2 &&
+        contexts[2].received == 1;
+  }));
+
+  // conflated messages of a session go out with its connection
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(server_->ids_[2]);
+  ASSERT_NE(nullptr, schannel);
+  std::string s;
+  ASSERT_TRUE(sproto_->Serialize(command3_, &s));
+  schannel->Conflate(TestProtocol::MSG_TAG_COMMAND_3, "", s);
+  EXPECT_TRUE(WaitForTrue([&]() { return contexts[1].received == 3; }));
+  EXPECT_EQ(0, schannel->GetNumConflated());
+
+  // closing a session removes its client
+  EXPECT_EQ(0, client_->DelSession(sessions[0]));
+  EXPECT_EQ(-1, client_->Send(command1_, sessions[0]));
+  EXPECT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumClients() == kNumSessions;
+  }));
+
+  // the sessions go away with the connection, and come back with it
+  client_->Stop();
+  EXPECT_TRUE(WaitForTrue([=]() { return server_->GetNumClients() == 0; }));
+  EXPECT_EQ(0, client_->Start());
+  EXPECT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumClients() == kNumSessions;
+  }));
+  for (int i = 1; i < kNumSessions; ++i)
+    EXPECT_EQ(0, client_->DelSession(sessions[i]));
+}
+
+TEST_F(GepEndToEndTest, DatagramEndToEnd) {
+  for (TestProtocol *proto : {sproto_, cproto_}) {
+    proto->SetDatagramTag(TestProtocol::MSG_TAG_COMMAND_1);
+    proto->SetDatagramTag(TestProtocol::MSG_TAG_COMMAND_3);
+  }
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(id);
+  GepChannel *cchannel = client_->GetGepChannel();
+  // the server learns the client UDP port through the connection
+  ASSERT_LE(0, cchannel->GetDatagramSocket());
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return schannel->GetDatagramSocket() >= 0;
+  }));
+
+  const int kNumMessages = 100;
+  for (int i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(0, client_->Send(command1_));
+    EXPECT_EQ(0, server_->Send(command3_, id));
+  }
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages));
+  GepDatagramStats cstats = cchannel->GetDatagramStats();
+  GepDatagramStats sstats = schannel->GetDatagramStats();
+  EXPECT_EQ(kNumMessages, cstats.sent);
+  EXPECT_EQ(kNumMessages, cstats.received);
+  EXPECT_EQ(kNumMessages, sstats.sent);
+  EXPECT_EQ(kNumMessages, sstats.received);
+  EXPECT_EQ(0, cstats.lost + sstats.lost);
+
+  // the other tags still use the connection
+  EXPECT_EQ(0, client_->Send(command2_));
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages + 1));
+  EXPECT_EQ(kNumMessages, cchannel->GetDatagramStats().sent);
+}
+
+TEST_F(GepEndToEndTest, DatagramRateLimit) {
+  for (TestProtocol *proto : {sproto_, cproto_})
+    proto->SetDatagramTag(TestProtocol::MSG_TAG_COMMAND_1);
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(id);
+  GepChannel *cchannel = client_->GetGepChannel();
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return schannel->GetDatagramSocket() >= 0;
+  }));
+  // datagrams over the limit are dropped, even with ACTION_PAUSE
+  GepRateLimitPolicy policy;
+  policy.tags[TestProtocol::MSG_TAG_COMMAND_1] = GepRateLimit(10, 0);
+  schannel->SetRateLimitPolicy(policy);
+
+  const int kNumMessages = 100;
+  for (int i = 0; i < kNumMessages; ++i)
+    EXPECT_EQ(0, client_->Send(command1_));
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return schannel->GetDatagramStats().received == kNumMessages;
+  }));
+  EXPECT_EQ(kNumMessages, cchannel->GetDatagramStats().sent);
+  EXPECT_LT(0, schannel->GetNumRateLimited());
+  EXPECT_GT(kNumMessages, schannel->GetNumRateLimited());
+}
+
+TEST_F(GepEndToEndTest, CompactHeaderEndToEnd) {
+  for (TestProtocol *proto : {sproto_, cproto_}) {
+    proto->SetCompactHeader(true);
+    // (credits are control messages)
+    proto->SetFlowControl(8, 0);
+  }
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  std::shared_ptr<GepChannel> schannel =
+      server_->GetGepChannelArray()->GetGepChannel(id);
+  GepChannel *cchannel = client_->GetGepChannel();
+  ASSERT_TRUE(WaitForTrue([&]() {
+    return cchannel->IsCompactHeader() && schannel->IsCompactHeader();
+  }));
+
+  // tags in the table of the peer (by index), and control messages (full
+  // tags)
+  const int kNumMessages = 100;
+  for (int i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(0, client_->Send(command1_));
+    EXPECT_EQ(0, server_->Send(command3_, id));
+  }
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages));
+  EXPECT_EQ(0, cchannel->GetNumQueued());
+  EXPECT_EQ(0, client_->GetReconnectCount());
+}
+
+TEST_F(GepEndToEndTest, CompactHeaderFallback) {
+  // the server does not take the offer
+  cproto_->SetCompactHeader(true);
+  Restart();
+  GepChannel *cchannel = client_->GetGepChannel();
+
+  client_->Send(command1_);
+  server_->Send(command3_);
+
+  WaitForSync(2);
+  EXPECT_FALSE(cchannel->IsCompactHeader());
+  EXPECT_EQ(0, client_->GetReconnectCount());
+}
+
+TEST_F(GepEndToEndTest, BatchEndToEnd) {
+  EXPECT_EQ(0, client_->SendBatch({&command1_, &command1_, &command1_}));
+  EXPECT_EQ(0, server_->SendBatch({&command3_, &command3_}));
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  EXPECT_EQ(0, server_->SendBatch({&command3_}, id));
+  EXPECT_EQ(-1, server_->SendBatch({&command3_}, id + 1000));
+
+  EXPECT_TRUE(WaitForSync(6));
+}
+
+TEST_F(GepEndToEndTest, CoalescingEndToEnd) {
+  // (the service threads write the frames after the delay)
+  for (TestProtocol *proto : {sproto_, cproto_})
+    proto->SetCoalescing(64 * 1024, 1000);
+  Restart();
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+
+  const int kNumMessages = 100;
+  for (int i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(0, client_->Send(command1_));
+    EXPECT_EQ(0, server_->Send(command3_, id));
+  }
+  EXPECT_TRUE(WaitForSync(2 * kNumMessages));
+  EXPECT_EQ(0, client_->GetReconnectCount());
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -74,6 +74,60 @@ TEST_F(GepProtocolTest, Unserialize) {
   }
 }
 
+TEST_F(GepProtocolTest, CompactHeader) {
+  struct gep_compact_header_test {
+    int line;
+    uint32_t tag;
+    int index;
+    uint32_t value_len;
+    int hdr_len;
+  } test_arr[] = {
+    {__LINE__, TestProtocol::MSG_TAG_COMMAND_1, 0, 0, 3},
+    {__LINE__, TestProtocol::MSG_TAG_COMMAND_1, 127, 127, 3},
+    {__LINE__, TestProtocol::MSG_TAG_COMMAND_2, 128, 128, 5},
+    {__LINE__, TestProtocol::MSG_TAG_COMMAND_2, 1, GepProtocol::kMaxMsgLen, 5},
+    {__LINE__, GepProtocol::kTagCredit, -1, 8, 6},
+    {__LINE__, GepProtocol::kTagCredit, -1, 0xffffffff, 10},
+  };
+
+  for (const auto &test_item : test_arr) {
+    uint8_t buf[GepProtocol::kMaxCompactHdrLen];
+    int hdr_len = GepProtocol::PrintCompactHeader(
+        test_item.tag, test_item.index, test_item.value_len, buf);
+    EXPECT_EQ(test_item.hdr_len, hdr_len) <<
+        "Error on line " << test_item.line;
+    bool full_tag;
+    uint32_t tag;
+    uint32_t value_len;
+    // partial headers are incomplete
+    for (int len = 0; len < hdr_len; ++len)
+      EXPECT_EQ(0, GepProtocol::ScanCompactHeader(buf, len, &full_tag, &tag,
+                                                  &value_len)) <<
+          "Error on line " << test_item.line;
+    EXPECT_EQ(hdr_len, GepProtocol::ScanCompactHeader(buf, hdr_len,
+                                                      &full_tag, &tag,
+                                                      &value_len)) <<
+        "Error on line " << test_item.line;
+    EXPECT_EQ(test_item.index < 0, full_tag) <<
+        "Error on line " << test_item.line;
+    EXPECT_EQ(test_item.index < 0 ? test_item.tag : test_item.index, tag) <<
+        "Error on line " << test_item.line;
+    EXPECT_EQ(test_item.value_len, value_len) <<
+        "Error on line " << test_item.line;
+  }
+
+  // reserved flags, and overlong varints
+  const uint8_t reserved[] = {0x02, 0x00, 0x00};
+  const uint8_t overlong[] = {0x00, 0x80, 0x80, 0x80, 0x80, 0x80, 0x00};
+  bool full_tag;
+  uint32_t tag;
+  uint32_t value_len;
+  EXPECT_EQ(-1, GepProtocol::ScanCompactHeader(reserved, sizeof(reserved),
+                                               &full_tag, &tag, &value_len));
+  EXPECT_EQ(-1, GepProtocol::ScanCompactHeader(overlong, sizeof(overlong),
+                                               &full_tag, &tag, &value_len));
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -47,6 +47,118 @@ TEST_F(GepServerTest, ServerDropUnsupportedMessage) {
   WaitForSync(2);
 }
 
+TEST_F(GepServerTest, PublishToSubscribers) {
+  // nobody is subscribed yet
+  EXPECT_EQ(0, server_->GetNumSubscribers("topic1"));
+  EXPECT_EQ(0, server_->Publish("topic1", command3_));
+  // subscribe the client
+  EXPECT_EQ(0, client_->Subscribe("topic1"));
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumSubscribers("topic1") == 1;
+  }));
+  // a message in another topic must not reach the client, and would
+  // arrive before the second one
+  EXPECT_EQ(0, server_->Publish("topic2", command4_));
+  EXPECT_EQ(0, server_->Publish("topic1", command3_));
+  ASSERT_TRUE(WaitForSync(1));
+  EXPECT_EQ(1, GetSynced());
+  // unsubscribe the client
+  EXPECT_EQ(0, client_->Unsubscribe("topic1"));
+  EXPECT_EQ(-1, client_->Unsubscribe("topic1"));
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumSubscribers("topic1") == 0;
+  }));
+}
+
+TEST_F(GepServerTest, SubscriptionsSurviveReconnect) {
+  GepChannel *gc = client_->GetGepChannel();
+  EXPECT_EQ(0, client_->Subscribe("topic1"));
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumSubscribers("topic1") == 1;
+  }));
+  // restart the server: subscriptions are dropped with the channels
+  server_->Stop();
+  EXPECT_EQ(0, server_->GetNumSubscribers("topic1"));
+  ASSERT_TRUE(WaitForTrue([=]() {return gc->GetSocket() == -1;}));
+  server_->Start();
+  // the client subscribes again when reconnecting
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return server_->GetNumSubscribers("topic1") == 1;
+  }));
+  EXPECT_EQ(0, server_->Publish("topic1", command3_));
+  ASSERT_TRUE(WaitForSync(1));
+}
+
+TEST_F(GepServerTest, ServerSideSubscription) {
+  int id = server_->GetGepChannelArray()->GetClientId(0);
+  EXPECT_EQ(-1, server_->Subscribe(id + 1, "group1"));
+  EXPECT_EQ(0, server_->Subscribe(id, "group1"));
+  EXPECT_EQ(1, server_->GetNumSubscribers("group1"));
+  EXPECT_EQ(0, server_->Publish("group1", command3_));
+  ASSERT_TRUE(WaitForSync(1));
+  EXPECT_EQ(0, server_->Unsubscribe(id, "group1"));
+  EXPECT_EQ(0, server_->GetNumSubscribers("group1"));
+}
+
+TEST_F(GepServerTest, SnapshotReplay) {
+  server_->SetSnapshot(TestProtocol::MSG_TAG_COMMAND_3, nullptr);
+  GepChannelArray *gca = server_->GetGepChannelArray();
+  EXPECT_EQ(0, gca->GetSnapshotSize());
+  // the cache keeps only the latest message per key
+  EXPECT_EQ(0, server_->Send(command3_));
+  EXPECT_EQ(0, server_->Send(command3_));
+  EXPECT_EQ(0, server_->Send(command4_));
+  ASSERT_TRUE(WaitForSync(3));
+  EXPECT_EQ(1, gca->GetSnapshotSize());
+
+  // a new client gets the cached message when it connects
+  TestProtocol *proto = new TestProtocol(server_->GetPort());
+  proto->SetSelectTimeoutUsec(msecs_to_usecs(10));
+  GepClient client("gep_test_client", context_, proto, &kGepTestOps);
+  EXPECT_EQ(0, client.Start());
+  ASSERT_TRUE(WaitForSync(4));
+  client.Stop();
+
+  EXPECT_EQ(-1, gca->DelSnapshot(TestProtocol::MSG_TAG_COMMAND_4, ""));
+  EXPECT_EQ(0, gca->DelSnapshot(TestProtocol::MSG_TAG_COMMAND_3, ""));
+  EXPECT_EQ(0, gca->GetSnapshotSize());
+}
+
+TEST_F(GepServerTest, SkipUnhandledTags) {
+  // a client that only handles Command3 messages
+  std::atomic<int> received(0);
+  GepVFT ops = {
+    {TestProtocol::MSG_TAG_COMMAND_3,
+     [&received](const GepProtobufMessage &msg, void *context) {
+       received++;
+       return true;
+     }},
+  };
+  TestProtocol *proto = new TestProtocol(server_->GetPort());
+  proto->SetSelectTimeoutUsec(msecs_to_usecs(10));
+  GepClient client("gep_test_client2", context_, proto, &ops);
+  EXPECT_EQ(0, client.Start());
+  ASSERT_TRUE(WaitForTrue([=]() {return server_->GetNumClients() == 2;}));
+  int id = server_->GetGepChannelArray()->GetClientId(1);
+  std::shared_ptr<GepChannel> gc = server_->GetGepChannelArray()->GetGepChannel(
+      id);
+  ASSERT_TRUE(gc != nullptr);
+  // wait for the client to advertise its tags
+  ASSERT_TRUE(WaitForTrue([=]() {
+    return !gc->IsInterested(TestProtocol::MSG_TAG_COMMAND_4);
+  }));
+  EXPECT_TRUE(gc->IsInterested(TestProtocol::MSG_TAG_COMMAND_3));
+
+  // unhandled messages are skipped without an error
+  EXPECT_EQ(0, server_->Send(command4_, id));
+  EXPECT_EQ(0, server_->Send(command4_));
+  EXPECT_EQ(0, server_->Send(command3_));
+  // the first client gets both broadcasts, the second only one
+  ASSERT_TRUE(WaitForSync(2));
+  ASSERT_TRUE(WaitForTrue([&received]() {return received == 1;}));
+  client.Stop();
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
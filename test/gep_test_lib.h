@@ -38,15 +38,18 @@ class TestServer : public GepServer {
  public:
   TestServer(const std::string &name, int max_channels, void *context,
              GepProtocol *proto, const GepVFT* ops)
-    : GepServer(name, max_channels, context, proto, ops) {
+    : GepServer(name, max_channels, context, proto, ops),
+      num_slow_clients_(0) {
   }
 
   virtual int Start() {
     ids_.clear();
+    num_slow_clients_ = 0;
     return GepServer::Start();
   }
 
   std::vector<int> ids_;
+  std::atomic<int> num_slow_clients_;
 
   virtual void AddClient(int id) {
     ids_.push_back(id);
@@ -58,6 +61,9 @@ class TestServer : public GepServer {
     // remove it
     ids_.erase(it);
   }
+  virtual void SlowClient(int id, bool slow) {
+    num_slow_clients_ += slow ? 1 : -1;
+  }
 };
 
 class GepTest : public ::testing::Test {
@@ -106,6 +112,7 @@ class GepTest : public ::testing::Test {
   void TearDown();
   static bool WaitForSync(int number);
   static bool WaitForTrue(std::function<bool()> fun);
+  static int GetSynced() { return synced_; }
 
   TestProtocol *cproto_;
   TestProtocol *sproto_;
@@ -126,7 +133,6 @@ class GepTest : public ::testing::Test {
 
  private:
   static std::atomic<int> synced_;
-  static int GetSynced() { return synced_; }
 };
 
 const GepVFT kGepTestOps = {
@@ -0,0 +1,116 @@
+// Copyright Google Inc. Apache 2.0.
+
+#include "shm_transport.h"
+
+#include <gtest/gtest.h>  // for AssertHelper, TEST, etc
+#include <memory>  // for unique_ptr, shared_ptr
+#include <string>  // for string
+#include <unistd.h>  // for getpid
+
+const int kRingBytes = 8192;
+
+class ShmTransportTest : public ::testing::Test {
+ protected:
+  void SetUp() {
+    name_ = "/gep.shm_transport_test." + std::to_string(getpid());
+    creator_.reset(ShmTransport::Create(name_, kRingBytes));
+    ASSERT_NE(nullptr, creator_);
+    opener_.reset(ShmTransport::Open(name_, kRingBytes, kRingBytes));
+    ASSERT_NE(nullptr, opener_);
+  }
+
+  std::string name_;
+  std::unique_ptr<ShmTransport> creator_;
+  std::unique_ptr<ShmTransport> opener_;
+};
+
+TEST_F(ShmTransportTest, Wraparound) {
+  std::string data(3000, '\0');
+  for (int i = 0; i < data.size(); ++i)
+    data[i] = i % 251;
+  char buf[kRingBytes];
+  bool wake;
+  for (int round = 0; round < 4; ++round) {
+    // the reader only needs a wake-up when the ring was empty
+    EXPECT_EQ(1000, creator_->Write(data.data(), 1000, &wake));
+    EXPECT_TRUE(wake);
+    EXPECT_EQ(2000, creator_->Write(data.data() + 1000, 2000, &wake));
+    EXPECT_FALSE(wake);
+    EXPECT_EQ(3000, creator_->GetWriteQueued());
+    // every other round crosses the end of the ring
+    EXPECT_EQ(3000, opener_->Read(buf, sizeof(buf)));
+    EXPECT_EQ(data, std::string(buf, 3000));
+    EXPECT_EQ(0, opener_->Read(buf, sizeof(buf)));
+    EXPECT_EQ(kRingBytes, creator_->GetWriteSpace());
+  }
+
+  // the other direction uses its own ring
+  EXPECT_EQ(10, opener_->Write(data.data(), 10, &wake));
+  EXPECT_EQ(0, opener_->Read(buf, sizeof(buf)));
+  EXPECT_EQ(10, creator_->Read(buf, sizeof(buf)));
+  EXPECT_EQ(data.substr(0, 10), std::string(buf, 10));
+}
+
+TEST_F(ShmTransportTest, FullRing) {
+  std::string data(2 * kRingBytes, 'x');
+  char buf[kRingBytes];
+  bool wake;
+  // writes stop at the free space
+  EXPECT_EQ(kRingBytes, creator_->Write(data.data(), data.size(), &wake));
+  EXPECT_EQ(0, creator_->GetWriteSpace());
+  EXPECT_EQ(0, creator_->Write(data.data(), data.size(), &wake));
+  EXPECT_FALSE(wake);
+
+  // reading makes room for exactly as many bytes
+  EXPECT_EQ(100, opener_->Read(buf, 100));
+  EXPECT_EQ(100, creator_->GetWriteSpace());
+  EXPECT_EQ(100, creator_->Write(data.data(), 200, &wake));
+  EXPECT_FALSE(wake);
+  EXPECT_EQ(kRingBytes, opener_->Read(buf, sizeof(buf)));
+  EXPECT_EQ(0, opener_->Read(buf, sizeof(buf)));
+
+  // a polling reader needs no wake-ups
+  opener_->SetPolling(true);
+  EXPECT_EQ(10, creator_->Write(data.data(), 10, &wake));
+  EXPECT_FALSE(wake);
+}
+
+TEST_F(ShmTransportTest, OpenChecks) {
+  // rings larger than the maximum are refused
+  EXPECT_EQ(nullptr, ShmTransport::Open(name_, kRingBytes, kRingBytes / 2));
+  // and so are the ones of a different size
+  EXPECT_EQ(nullptr, ShmTransport::Open(name_, 2 * kRingBytes,
+                                        2 * kRingBytes));
+  // the name is gone after unlinking it
+  creator_->Unlink();
+  EXPECT_EQ(nullptr, ShmTransport::Open(name_, kRingBytes, kRingBytes));
+}
+
+TEST(ShmTransportLocalTest, ObjectSlots) {
+  std::unique_ptr<ShmTransport> creator(ShmTransport::CreateLocal(4096));
+  ASSERT_NE(nullptr, creator);
+  std::unique_ptr<ShmTransport> opener(
+      ShmTransport::OpenLocal(creator->GetName(), 4096));
+  ASSERT_NE(nullptr, opener);
+
+  std::shared_ptr<void> obj = std::make_shared<int>(1);
+  EXPECT_TRUE(creator->PutObject(7, obj));
+  // the slot is busy until the peer takes the object
+  EXPECT_FALSE(creator->PutObject(7, obj));
+  EXPECT_EQ(nullptr, opener->TakeObject(8));
+  EXPECT_EQ(obj, opener->TakeObject(7));
+  EXPECT_EQ(nullptr, opener->TakeObject(7));
+
+  // or the sender reclaims it
+  EXPECT_TRUE(creator->PutObject(8, obj));
+  creator->ReclaimObject(8);
+  EXPECT_EQ(nullptr, opener->TakeObject(8));
+  EXPECT_TRUE(creator->PutObject(8, obj));
+  // the slots keep the objects alive
+  EXPECT_EQ(2, obj.use_count());
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -36,6 +36,7 @@ constexpr uint32_t TestProtocol::MSG_TAG_COMMAND_2;
 constexpr uint32_t TestProtocol::MSG_TAG_COMMAND_3;
 constexpr uint32_t TestProtocol::MSG_TAG_COMMAND_4;
 constexpr uint32_t TestProtocol::MSG_TAG_CONTROL;
+constexpr uint32_t TestProtocol::MSG_TAG_STATUS;
 
 uint32_t TestProtocol::GetTag(const GepProtobufMessage *msg) {
   // TODO(chema): use send VFT map here instead of listing all the cases (?)
@@ -49,6 +50,8 @@ uint32_t TestProtocol::GetTag(const GepProtobufMessage *msg) {
     return MSG_TAG_COMMAND_4;
   else if (dynamic_cast<const ControlMessage *>(msg) != NULL)
     return MSG_TAG_CONTROL;
+  else if (dynamic_cast<const Status *>(msg) != NULL)
+    return MSG_TAG_STATUS;
   return 0;
 }
 
@@ -70,6 +73,9 @@ GepProtobufMessage *TestProtocol::GetMessage(uint32_t tag) {
     case MSG_TAG_CONTROL:
       msg = new ControlMessage();
       break;
+    case MSG_TAG_STATUS:
+      msg = new Status();
+      break;
   }
   return msg;
 }
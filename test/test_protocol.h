@@ -33,6 +33,8 @@ class TestProtocol : public GepProtocol {
       MakeTag('c', 'm', 'd', '4');
   static constexpr uint32_t MSG_TAG_CONTROL =
       MakeTag('c', 't', 'r', 'l');
+  static constexpr uint32_t MSG_TAG_STATUS =
+      MakeTag('s', 't', 'a', 't');
 
   // returns the tag associated to a message.
   virtual uint32_t GetTag(const GepProtobufMessage *msg);
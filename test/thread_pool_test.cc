@@ -0,0 +1,43 @@
+// Copyright Google Inc. Apache 2.0.
+
+#include "thread_pool.h"
+
+#include <atomic>  // for atomic
+#include <gtest/gtest.h>  // for AssertHelper, TEST, etc
+#include <mutex>  // for mutex, lock_guard
+#include <set>  // for set
+#include <thread>  // for thread
+
+
+TEST(ThreadPoolTest, RunsAllTasks) {
+  std::atomic<int> counter(0);
+  {
+    ThreadPool pool(4);
+    EXPECT_EQ(4, pool.GetNumThreads());
+    for (int i = 0; i < 100; ++i)
+      pool.Post([&counter]() { counter++; });
+    // the destructor runs all the pending tasks
+  }
+  EXPECT_EQ(100, counter);
+}
+
+TEST(ThreadPoolTest, RunsTasksInPoolThreads) {
+  std::mutex lock;
+  std::set<std::thread::id> ids;
+  {
+    ThreadPool pool(2);
+    for (int i = 0; i < 10; ++i) {
+      pool.Post([&lock, &ids]() {
+        std::lock_guard<std::mutex> lock_guard(lock);
+        ids.insert(std::this_thread::get_id());
+      });
+    }
+  }
+  EXPECT_GE(2, ids.size());
+  EXPECT_EQ(0, ids.count(std::this_thread::get_id()));
+}
+
+int main(int argc, char **argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -7,6 +7,7 @@
 #include <string.h>  // for memcmp, strlen
 #include <sys/time.h>  // for timeval
 #include <time.h>  // for tzset
+#include <string>  // for string
 #include "gtest/gtest.h"  // for EXPECT_EQ, TEST, etc
 
 using namespace libgep_utils;
@@ -163,6 +164,32 @@ TEST(UtilTest, snprintf_date) {
   }
 }
 
+TEST(UtilTest, Crc32c) {
+  struct crc32c_test {
+    int line;
+    std::string data;
+    uint32_t crc;
+  } test_arr[] = {
+    {__LINE__, "", 0x00000000},
+    {__LINE__, "a", 0xc1d04330},
+    {__LINE__, "123456789", 0xe3069283},
+    {__LINE__, std::string(32, '\0'), 0x8a9136aa},
+    {__LINE__, std::string(32, '\xff'), 0x62a8ab43},
+  };
+
+  for (const auto &test_item : test_arr) {
+    const uint8_t *data =
+        reinterpret_cast<const uint8_t *>(test_item.data.data());
+    int len = test_item.data.length();
+    EXPECT_EQ(test_item.crc, Crc32c(0, data, len)) << test_item.line;
+    // in two parts, unaligned
+    for (int split = 0; split <= len; ++split)
+      EXPECT_EQ(test_item.crc,
+                Crc32c(Crc32c(0, data, split), data + split, len - split)) <<
+          test_item.line << " split " << split;
+  }
+}
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();